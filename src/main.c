@@ -32,6 +32,10 @@
 #include "ppm_db.h"
 #include "ppm_command.h"
 #include "ppm_mem.h"
+#include "ppm_profile.h"
+
+/* Set by '--json'. */
+static unsigned int json = 0;
 
 static unsigned int
 interactive(void)
@@ -50,13 +54,52 @@ interactive(void)
 
     if (!ppm_init())
         return EXIT_FAILURE;
+
+    /* A session can run for a long time, saves made by other processes
+       in the meantime are picked up as they happen. */
+    ppmD_watch(ppm_vault);
     
     while ((line = ppmC_readline()))
         ppmC_eval(line);
 
+    /* Waits for a background save that may still be running. */
+    ppm_cleanup();
     return 0;
 }
 
+/* Like interactive mode, but requests and responses are JSON. */
+static unsigned int
+serve(void)
+{
+    if (!ppm_cipherkey)
+    {
+        ppm_error("'--json' needs a key, use '-k'");
+        return EXIT_FAILURE;
+    }
+    if (!ppm_init())
+        return EXIT_FAILURE;
+    ppmD_watch(ppm_vault);
+    ppmC_serve(stdin);
+    ppm_cleanup();
+    return EXIT_SUCCESS;
+}
+
+static unsigned int
+parse_shards(const char *arg)
+{
+    char *end;
+    unsigned long n;
+
+    n = strtoul(arg, &end, 10);
+    if (*arg == '-' || *end || n < 1 || n > 4096)
+    {
+        ppm_error("invalid number of shards: %s", arg);
+        return 0;
+    }
+    ppm_shards = (unsigned int)n;
+    return 1;
+}
+
 static char **
 parse_argv(int *argc, char **argv)
 {
@@ -73,7 +116,10 @@ parse_argv(int *argc, char **argv)
         char c;
 
         arg = *argv;
-        if (*arg != '-' || arg[1] == '\0')
+
+        /* Options are only recognized before the command, anything
+           after it belongs to the command itself. */
+        if (i > 0 || *arg != '-' || arg[1] == '\0')
         {
             args[i++] = arg;
             continue;
@@ -93,6 +139,20 @@ parse_argv(int *argc, char **argv)
                 ppm_usecolor = 0;
                 continue;
             }
+
+            if (strcmp(arg, "json") == 0)
+            {
+                json = 1;
+                ppm_usecolor = 0;
+                continue;
+            }
+
+            /* Where the time goes, written to stderr on exit. */
+            if (strcmp(arg, "profile") == 0 || strcmp(arg, "profile-json") == 0)
+            {
+                ppmF_profile(arg[7] == '-');
+                continue;
+            }
      
             if (!*++argv)
             {
@@ -108,11 +168,21 @@ parse_argv(int *argc, char **argv)
             if (strcmp(arg, "file") == 0)
                 ppm_dbfile = *argv;
 
+            else
+            if (strcmp(arg, "shards") == 0)
+            {
+                if (!parse_shards(*argv))
+                {
+                    free(args);
+                    return NULL;
+                }
+            }
+
             continue;
         }
         c = arg[1];
         
-        if (!strchr("sc", c) && !*++argv)
+        if (!strchr("scpj", c) && !*++argv)
         {
             ppm_error("no argument provided for '-%c'", c);
             free(args);
@@ -129,6 +199,14 @@ parse_argv(int *argc, char **argv)
             ppm_dbfile = *argv;
             break;
 
+        case 'n':
+            if (!parse_shards(*argv))
+            {
+                free(args);
+                return NULL;
+            }
+            break;
+
         case 's':
             ppm_autosave = 1;
             break;
@@ -137,6 +215,15 @@ parse_argv(int *argc, char **argv)
             ppm_usecolor = 0;
             break;
 
+        case 'p':
+            ppmF_profile(0);
+            break;
+
+        case 'j':
+            json = 1;
+            ppm_usecolor = 0;
+            break;
+
         default:
             ppm_error("unrecognized option '-%c'");
             return NULL;
@@ -151,10 +238,14 @@ parse_argv(int *argc, char **argv)
 int 
 main(int argc, char *argv[])
 {
-    int ret;
+    int ret = EXIT_SUCCESS;
     char **args;
 
     program_name = argv[0];
+
+    /* Checked first, so loading is counted as well. */
+    if (getenv("PPM_MEMSTATS"))
+        ppmM_track();
     args = parse_argv(&argc, argv);
 
     /* ARGS and ARGC's value refer to the number of arguments passed
@@ -162,6 +253,15 @@ main(int argc, char *argv[])
        the number of arguments passed to 'add'. This means we have '2' 
        arguments. If argc is less than 0, no command was request so
        interactive mode is expected. */
+    if (json)
+    {
+        if (!args) return EXIT_FAILURE;
+        free(args);
+        if (argc < 0)
+            return serve();
+        ppm_error("'--json' reads commands from stdin");
+        return EXIT_FAILURE;
+    }
     if (argc < 0)
         return interactive();
 
@@ -175,7 +275,7 @@ main(int argc, char *argv[])
     if (!ppmC_command(argc, args))
         ret = EXIT_FAILURE;
 
-    ppmD_save();
+    if (ppm_vault) ppmD_save(ppm_vault);
     ppm_cleanup();
     free(args);
     return ret;
@@ -26,62 +26,25 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <errno.h>
-#include <string.h>
-#include <stdarg.h>
 #include "ppm.h"
 #include "ppm_db.h"
 #include "ppm_command.h"
-#include "ppm_aes.h"
+#include "ppm_gen.h"
+#include "ppm_pool.h"
 
 unsigned int ppm_autosave = 0;
-unsigned int ppm_usecolor = 1;
+unsigned int ppm_shards = 0;
 
 char *ppm_cipherkey = NULL;
 char *ppm_dbfile = NULL;
-char *program_name = NULL;
+ppm_Vault *ppm_vault = NULL;
 
 #define COLOR(c) "\033[" #c "m"
-char *ppm_colors[] = { "", "", "", "", "", ""};
-
-void 
-ppm_error(const char *format, ...)
-{
-    va_list vl;
-    
-    va_start(vl, format);
-    fprintf(stderr, "%s%s:%s ", 
-            PPMC(BLUE),
-            program_name,
-            PPMC(RED));
-    vfprintf(stderr, format, vl);
-    if (errno != 0)
-    {
-        fprintf(stderr, ": %s", strerror(errno));
-        errno = 0;
-    }
-    fprintf(stderr, "%s\n", PPMC(NONE));
-}
-
-void 
-ppm_message(const char *format, ...)
-{
-    va_list vl;
-    
-    va_start(vl, format);
-    fprintf(stdout, "%s%s:%s ", 
-            PPMC(BLUE), 
-            program_name,
-            PPMC(GREEN));
-    vfprintf(stdout, format, vl);
-    fprintf(stdout, "%s\n", PPMC(NONE));
-}
-
 
 static void 
 printopt(char ch, const char *str, const char *desc)
 {
-    printf("    %s-%c%s, %s--%s%s%s\n",
+    fprintf(PPM_OUT, "    %s-%c%s, %s--%s%s%s\n",
            PPMC(GREEN), ch, PPMC(BLUE), PPMC(GREEN), str, PPMC(BLUE), desc);
 
 }
@@ -89,7 +52,7 @@ printopt(char ch, const char *str, const char *desc)
 void
 ppm_usage(void)
 {
-    printf("%sUsage%s: %s %s[%sOPTIONS%s]%s... %s[%sCOMMAND%s] %s[%sARGS%s]\n\n", 
+    fprintf(PPM_OUT, "%sUsage%s: %s %s[%sOPTIONS%s]%s... %s[%sCOMMAND%s] %s[%sARGS%s]\n\n", 
            PPMC(RED),   PPMC(BLUE),  program_name,
            PPMC(WHITE), PPMC(GREEN), PPMC(WHITE),
            PPMC(BLUE), 
@@ -99,8 +62,11 @@ ppm_usage(void)
     printopt('k', "key", "       provide cipher key used for encryption en decryption");
     printopt('f', "file", "      specifiy file for storing passwords (default: $HOME/.ppm)");
     printopt('s', "save", "      automatically save when running interactively");
+    printopt('n', "shards", "    split a new database over N files in a directory");
     printopt('c', "no-color", "  don't use colors");
-    fprintf(stdout, "%s\n", PPMC(NONE));
+    printopt('j', "json", "      read JSON requests from stdin, answer in JSON Lines");
+    printopt('p', "profile", "   print where the time went to stderr (--profile-json as JSON)");
+    fprintf(PPM_OUT, "%s\n", PPMC(NONE));
 
 }
 
@@ -123,10 +89,8 @@ ppm_init(void)
     if (!ppm_cipherkey)
         return 1;
 
-    if (!ppmA_initcipher(ppm_cipherkey))
-        return 0;
-    
-    if (!ppmD_init()) return 0;
+    ppm_vault = ppmD_open(ppm_dbfile, ppm_cipherkey, ppm_shards);
+    if (!ppm_vault) return 0;
     ppmC_init();
     return 1;
 }
@@ -134,7 +98,13 @@ ppm_init(void)
 void
 ppm_cleanup(void)
 {
-    ppmA_cleanup();
-    ppmD_cleanup();
+    /* The vault goes first, a save still in flight needs the pool. A
+       background save another process got ahead of is redone here. */
+    if (ppm_vault && ppm_autosave)
+        ppmD_save(ppm_vault);
+    ppmD_close(ppm_vault);
+    ppm_vault = NULL;
+    ppmP_cleanup();
+    ppmG_cleanup();
     if (ppm_cipherkey) free(ppm_cipherkey);
 }
@@ -27,6 +27,10 @@
 #ifndef PPM_H
 #define PPM_H
 
+#include <stdio.h>
+
+#include "ppm_db.h"
+
 enum
 {
     PPM_CNONE = 0,
@@ -40,14 +44,24 @@ enum
 extern void ppm_error(const char * /* format */, ...);
 extern void ppm_message(const char * /* format */, ...);
 
+/* Commands write their results to ppm_output, stdout while it's NULL.
+   When ppm_report is set errors and messages are passed to it instead
+   of being printed, without color or program name. */
+extern FILE *ppm_output;
+extern void (*ppm_report)(unsigned int /* error */, const char * /* text */);
+
+#define PPM_OUT (ppm_output ? ppm_output : stdout)
+
 extern unsigned int ppm_init();
 extern void ppm_cleanup(void);
 extern void ppm_usage(void);
 
 extern unsigned int ppm_autosave;
 extern unsigned int ppm_usecolor;
+extern unsigned int ppm_shards;
 extern char *ppm_dbfile;
 extern char *ppm_cipherkey;
+extern ppm_Vault *ppm_vault;
 extern char *program_name;
 extern char *ppm_colors[];
 
@@ -27,75 +27,476 @@
 #include <string.h>
 #include <openssl/evp.h>
 #include <openssl/aes.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
 
 #include "ppm_aes.h"
 #include "ppm.h"
 #include "ppm_mem.h"
+#include "ppm_profile.h"
 
-static const unsigned int salt[] = { 1234, 5432 };
-static EVP_CIPHER_CTX e_ctx, d_ctx;
+struct ppm_chunks
+{
+    EVP_CIPHER_CTX *ctx;
+    unsigned char nonce[PPM_PREFIXSIZE + 5];
+    char *aad;
+    unsigned long count;
+    unsigned int seal;
+    unsigned int done;
+};
+
+static unsigned int
+derive(const ppm_KeySlot *slot, const char *key, unsigned char *kek)
+{
+    struct timespec start;
+    int ok;
+
+    ppmF_start(&start);
+    ok = PKCS5_PBKDF2_HMAC(key, strlen(key), slot->salt, PPM_SALTSIZE, 
+                           slot->rounds, EVP_sha256(), PPM_KEYSIZE, kek);
+    ppmF_stop(PPM_PHASE_KEY, &start);
+    if (!ok)
+    {
+        ppm_error("failed to derive key");
+        return 0;
+    }
+    return 1;
+}
+
+/* Wrapping uses AES key wrap (RFC 3394), its integrity check is what
+   tells us whether a user key belongs to a slot. */
+static unsigned int
+wrap(const unsigned char *kek, const unsigned char *in, unsigned char *out, int enc)
+{
+    EVP_CIPHER_CTX *ctx;
+    int len = 0, flen = 0;
+    unsigned int ok;
+
+    ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) return 0;
+    EVP_CIPHER_CTX_set_flags(ctx, EVP_CIPHER_CTX_FLAG_WRAP_ALLOW);
+    ok = EVP_CipherInit_ex(ctx, EVP_aes_256_wrap(), NULL, kek, NULL, enc)
+      && EVP_CipherUpdate(ctx, out, &len, in, enc ? PPM_KEYSIZE : PPM_WRAPSIZE)
+      && EVP_CipherFinal_ex(ctx, out + len, &flen);
+    EVP_CIPHER_CTX_free(ctx);
+
+    return ok && len + flen == (enc ? PPM_WRAPSIZE : PPM_KEYSIZE);
+}
+
+static int
+findslot(const ppm_Header *header, const char *key, unsigned char *key_out)
+{
+    unsigned char kek[PPM_KEYSIZE];
+    int i;
+
+    for (i = 0; i < PPM_MAXKEYS; i++)
+    {
+        const ppm_KeySlot *slot = header->slots + i;
+
+        if (!slot->used) continue;
+        if (derive(slot, key, kek) && wrap(kek, slot->wrapped, key_out, 0))
+            break;
+    }
+    OPENSSL_cleanse(kek, sizeof(kek));
+    return i < PPM_MAXKEYS ? i : -1;
+}
+
+static unsigned int
+setslot(ppm_KeySlot *slot, const char *key, const unsigned char *datakey)
+{
+    unsigned char kek[PPM_KEYSIZE];
+    unsigned int ok;
+
+    slot->rounds = PPM_KDFROUNDS;
+    if (RAND_bytes(slot->salt, PPM_SALTSIZE) != 1)
+    {
+        ppm_error("failed to gather entropy");
+        return 0;
+    }
+    ok = derive(slot, key, kek) && wrap(kek, datakey, slot->wrapped, 1);
+    OPENSSL_cleanse(kek, sizeof(kek));
+    if (!ok)
+    {
+        ppm_error("failed to wrap data key");
+        return 0;
+    }
+    slot->used = 1;
+    return 1;
+}
+
+unsigned int
+ppmA_initcipher(ppm_Key *k, const ppm_Header *header, const char *key)
+{
+    int i;
+
+    i = findslot(header, key, k->dek);
+    if (i < 0)
+    {
+        ppm_error("invalid key");
+        return 0;
+    }
+    k->slot = i;
+    return 1;
+}
 
 unsigned int
-ppmA_initcipher(const char *key)
+ppmA_legacycipher(ppm_Key *k, const char *key)
 {
-    const EVP_CIPHER *cipher;
-    const EVP_MD *md;
-    unsigned int bytes;
-    size_t len, count = 5;
-    unsigned char k[32], iv[32];
+    struct timespec start;
+    int bytes;
+
+    /* Vaults written before the header was introduced were encrypted
+       with a key derived straight from the user key. */
+    ppmF_start(&start);
+    bytes = EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), NULL, 
+                           (unsigned char *)key, strlen(key), 5, k->dek, k->legacyiv);
+    ppmF_stop(PPM_PHASE_KEY, &start);
+    if (bytes != PPM_KEYSIZE) 
+    {
+        ppm_error("Key size is %d bits - should be 256 bits", bytes * 8);
+        return 0;
+    }
+    k->slot = -1;
+    return 1;
+}
+
+unsigned int
+ppmA_newkey(ppm_Key *k, ppm_Header *header, const char *key)
+{
+    memset(header, 0, sizeof(ppm_Header));
+    if (RAND_bytes(k->dek, PPM_KEYSIZE) != 1)
+    {
+        ppm_error("failed to gather entropy");
+        return 0;
+    }
+    if (!setslot(header->slots, key, k->dek))
+        return 0;
+    k->slot = 0;
+    return 1;
+}
+
+unsigned int
+ppmA_addkey(const ppm_Key *k, ppm_Header *header, const char *key)
+{
+    unsigned char tmp[PPM_KEYSIZE];
+    int i;
+
+    i = findslot(header, key, tmp);
+    OPENSSL_cleanse(tmp, sizeof(tmp));
+    if (i >= 0)
+    {
+        ppm_error("key already has access to this vault");
+        return 0;
+    }
+    for (i = 0; i < PPM_MAXKEYS; i++)
+    {
+        if (!header->slots[i].used)
+            return setslot(header->slots + i, key, k->dek);
+    }
+    ppm_error("all %d key slots are in use", PPM_MAXKEYS);
+    return 0;
+}
+
+unsigned int
+ppmA_rmkey(const ppm_Key *k, ppm_Header *header, const char *key)
+{
+    unsigned char tmp[PPM_KEYSIZE];
+    int i;
+
+    i = findslot(header, key, tmp);
+    OPENSSL_cleanse(tmp, sizeof(tmp));
+    if (i < 0)
+    {
+        ppm_error("key not found");
+        return 0;
+    }
+    if (i == k->slot)
+    {
+        ppm_error("can't remove the key in use, use 'rekey' to change it");
+        return 0;
+    }
+    OPENSSL_cleanse(header->slots + i, sizeof(ppm_KeySlot));
+    return 1;
+}
 
-    cipher = EVP_aes_256_cbc();
-    md = EVP_sha1();
-    len = strlen(key);
-    bytes = EVP_BytesToKey(cipher, md, NULL, (unsigned char *)key, len, count, k, iv);
+unsigned int
+ppmA_rekey(const ppm_Key *k, ppm_Header *header, const char *key)
+{
+    unsigned char tmp[PPM_KEYSIZE];
+    int i;
 
-    if (bytes != 32) 
+    if (k->slot < 0)
     {
-        ppm_error("Key size is %d bits - should be 256 bits", bytes);
+        ppm_error("no key slot in use");
         return 0;
     }
-  
-    EVP_CIPHER_CTX_init(&e_ctx);
-    EVP_EncryptInit_ex(&e_ctx, EVP_aes_256_cbc(), NULL, k, iv);
-    EVP_CIPHER_CTX_init(&d_ctx);
-    EVP_DecryptInit_ex(&d_ctx, EVP_aes_256_cbc(), NULL, k, iv);
+    i = findslot(header, key, tmp);
+    OPENSSL_cleanse(tmp, sizeof(tmp));
+    if (i >= 0 && i != k->slot)
+    {
+        ppm_error("key already has access to this vault");
+        return 0;
+    }
+    return setslot(header->slots + k->slot, key, k->dek);
+}
 
+unsigned int
+ppmA_keycount(const ppm_Header *header)
+{
+    unsigned int i, n = 0;
+
+    for (i = 0; i < PPM_MAXKEYS; i++)
+        n += header->slots[i].used ? 1 : 0;
+    return n;
+}
+
+void
+ppmA_packheader(const ppm_Header *header, unsigned char *buf)
+{
+    unsigned int i;
+
+    memcpy(buf, header->version == 2 ? PPM_MAGIC2 : PPM_MAGIC, 4);
+    buf += 4;
+    memcpy(buf, header->iv, PPM_IVSIZE);
+    buf += PPM_IVSIZE;
+    for (i = 0; i < PPM_MAXKEYS; i++)
+    {
+        const ppm_KeySlot *slot = header->slots + i;
+
+        *buf++ = slot->used ? 1 : 0;
+        *buf++ = (slot->rounds >> 24) & 0xff;
+        *buf++ = (slot->rounds >> 16) & 0xff;
+        *buf++ = (slot->rounds >> 8) & 0xff;
+        *buf++ = slot->rounds & 0xff;
+        memcpy(buf, slot->salt, PPM_SALTSIZE);
+        buf += PPM_SALTSIZE;
+        memcpy(buf, slot->wrapped, PPM_WRAPSIZE);
+        buf += PPM_WRAPSIZE;
+    }
+}
+
+unsigned int
+ppmA_unpackheader(ppm_Header *header, const unsigned char *buf)
+{
+    unsigned int i;
+
+    if (memcmp(buf, PPM_MAGIC, 4) == 0)
+        header->version = 1;
+    else if (memcmp(buf, PPM_MAGIC2, 4) == 0)
+        header->version = 2;
+    else
+        return 0;
+    buf += 4;
+    memcpy(header->iv, buf, PPM_IVSIZE);
+    buf += PPM_IVSIZE;
+    for (i = 0; i < PPM_MAXKEYS; i++)
+    {
+        ppm_KeySlot *slot = header->slots + i;
+
+        slot->used = *buf++;
+        slot->rounds = ((unsigned long)buf[0] << 24) | ((unsigned long)buf[1] << 16)
+                     | ((unsigned long)buf[2] << 8) | buf[3];
+        buf += 4;
+        memcpy(slot->salt, buf, PPM_SALTSIZE);
+        buf += PPM_SALTSIZE;
+        memcpy(slot->wrapped, buf, PPM_WRAPSIZE);
+        buf += PPM_WRAPSIZE;
+    }
     return 1;
 }
 
 char *
-ppmA_encrypt(const char *data, size_t *len) 
+ppmA_encryptbuf(const ppm_Key *k, unsigned char *iv, const char *data, size_t *len) 
 {
-    int slen = strlen(data) + 1;
+    EVP_CIPHER_CTX *ctx;
+    int slen = (int)*len;
     int clen = slen + AES_BLOCK_SIZE;
     int flen = 0;
     unsigned char *text = ppmM_alloc(clen);
+    unsigned int ok;
+    struct timespec start;
 
-    EVP_EncryptInit_ex(&e_ctx, NULL, NULL, NULL, NULL);
-    EVP_EncryptUpdate(&e_ctx, text, &clen, (unsigned char *)data, slen);
-    EVP_EncryptFinal_ex(&e_ctx, text + clen, &flen);
+    /* Every save gets a fresh IV, it is stored in the header. A context
+       per call keeps this safe to use from the background writer. */
+    ppmF_start(&start);
+    ctx = EVP_CIPHER_CTX_new();
+    ok = ctx && RAND_bytes(iv, PPM_IVSIZE) == 1
+      && EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, k->dek, iv)
+      && EVP_EncryptUpdate(ctx, text, &clen, (unsigned char *)data, slen)
+      && EVP_EncryptFinal_ex(ctx, text + clen, &flen);
+    EVP_CIPHER_CTX_free(ctx);
+    ppmF_stop(PPM_PHASE_ENCRYPT, &start);
+    if (!ok)
+    {
+        free(text);
+        ppm_error("encryption failed");
+        return NULL;
+    }
 
-    *len = (size_t)(flen + slen);
+    *len = (size_t)(clen + flen);
     return (char *)text;
 }
 
 char *
-ppmA_decrypt(const char *data, size_t len)
+ppmA_encrypt(const ppm_Key *k, ppm_Header *header, const char *data, size_t *len) 
 {
-    int plen = (int)len;
+    *len = strlen(data) + 1;
+    return ppmA_encryptbuf(k, header->iv, data, len);
+}
+
+static char *
+decrypt(const unsigned char *key, const unsigned char *iv, const char *data, size_t *len)
+{
+    EVP_CIPHER_CTX *ctx;
+    int plen = (int)*len;
     int flen = 0;
-    unsigned char *text = ppmM_alloc(len);
-  
-    EVP_DecryptInit_ex(&d_ctx, NULL, NULL, NULL, NULL);
-    EVP_DecryptUpdate(&d_ctx, text, &plen, (unsigned char *)data, (int)len);
-    EVP_DecryptFinal_ex(&d_ctx, text + plen, &flen);
+    unsigned char *text = ppmM_alloc(*len + 1);
+    unsigned int ok;
+    struct timespec start;
+
+    ppmF_start(&start);
+    ctx = EVP_CIPHER_CTX_new();
+    ok = ctx && EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv)
+      && EVP_DecryptUpdate(ctx, text, &plen, (unsigned char *)data, (int)*len)
+      && EVP_DecryptFinal_ex(ctx, text + plen, &flen);
+    EVP_CIPHER_CTX_free(ctx);
+    ppmF_stop(PPM_PHASE_DECRYPT, &start);
+    if (!ok)
+    {
+        free(text);
+        ppm_error("decryption failed, wrong key or corrupted file");
+        return NULL;
+    }
+    text[plen + flen] = '\0';
+    *len = (size_t)(plen + flen);
 
     return (char *)text;
 }
 
+char *
+ppmA_decrypt(const ppm_Key *k, const ppm_Header *header, const char *data, size_t len)
+{
+    /* Legacy files were written with the plaintext length plus one
+       block, which overshoots the real ciphertext. Anything past the
+       last whole block is garbage. */
+    if (!header && len > AES_BLOCK_SIZE)
+        len = ((len - AES_BLOCK_SIZE) / AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE;
+
+    return decrypt(k->dek, header ? header->iv : k->legacyiv, data, &len);
+}
+
+char *
+ppmA_decryptbuf(const ppm_Key *k, const unsigned char *iv, const char *data, size_t *len)
+{
+    return decrypt(k->dek, iv, data, len);
+}
+
+ppm_Chunks *
+ppmA_chunkstart(const ppm_Key *k, unsigned char *prefix, const char *aad, unsigned int seal)
+{
+    ppm_Chunks *chunks;
+    unsigned int ok;
+
+    chunks = NEW(ppm_Chunks);
+    chunks->ctx = EVP_CIPHER_CTX_new();
+    chunks->seal = seal;
+    chunks->count = 0;
+    chunks->done = 0;
+    ok = chunks->ctx && (!seal || RAND_bytes(prefix, PPM_PREFIXSIZE) == 1)
+      && EVP_CipherInit_ex(chunks->ctx, EVP_aes_256_gcm(), NULL, k->dek, NULL, seal);
+    if (!ok)
+    {
+        EVP_CIPHER_CTX_free(chunks->ctx);
+        free(chunks);
+        ppm_error(seal ? "encryption failed" : "decryption failed");
+        return NULL;
+    }
+    memcpy(chunks->nonce, prefix, PPM_PREFIXSIZE);
+    chunks->aad = ppmM_strdup(aad);
+    return chunks;
+}
+
+size_t
+ppmA_chunk(ppm_Chunks *chunks, const char *data, size_t len, unsigned int last, char *out)
+{
+    EVP_CIPHER_CTX *ctx = chunks->ctx;
+    unsigned char *nonce = chunks->nonce;
+    unsigned long n = chunks->count;
+    int alen = (int)strlen(chunks->aad), plen = 0, flen = 0;
+    unsigned int ok;
+
+    /* Nothing follows the last chunk, and the number can't wrap. */
+    if (chunks->done || n > 0xfffffffful || (!chunks->seal && len < PPM_TAGSIZE))
+    {
+        ppm_error(chunks->seal ? "encryption failed" : "decryption failed, corrupted file");
+        return (size_t)-1;
+    }
+    nonce[PPM_PREFIXSIZE] = (n >> 24) & 0xff;
+    nonce[PPM_PREFIXSIZE + 1] = (n >> 16) & 0xff;
+    nonce[PPM_PREFIXSIZE + 2] = (n >> 8) & 0xff;
+    nonce[PPM_PREFIXSIZE + 3] = n & 0xff;
+    nonce[PPM_PREFIXSIZE + 4] = last ? 1 : 0;
+    chunks->count++;
+    chunks->done = last;
+
+    if (chunks->seal)
+    {
+        ok = EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, nonce)
+          && EVP_EncryptUpdate(ctx, NULL, &plen, (const unsigned char *)chunks->aad, alen)
+          && EVP_EncryptUpdate(ctx, (unsigned char *)out, &plen, (const unsigned char *)data, (int)len)
+          && EVP_EncryptFinal_ex(ctx, (unsigned char *)out + plen, &flen)
+          && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, PPM_TAGSIZE, out + len);
+        if (!ok)
+        {
+            ppm_error("encryption failed");
+            return (size_t)-1;
+        }
+        return len + PPM_TAGSIZE;
+    }
+
+    len -= PPM_TAGSIZE;
+    ok = EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, nonce)
+      && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, PPM_TAGSIZE, (void *)(data + len))
+      && EVP_DecryptUpdate(ctx, NULL, &plen, (const unsigned char *)chunks->aad, alen)
+      && EVP_DecryptUpdate(ctx, (unsigned char *)out, &plen, (const unsigned char *)data, (int)len)
+      && EVP_DecryptFinal_ex(ctx, (unsigned char *)out + plen, &flen);
+    if (!ok)
+    {
+        ppm_error("decryption failed, wrong key or corrupted file");
+        return (size_t)-1;
+    }
+    return len;
+}
+
+void
+ppmA_chunkend(ppm_Chunks *chunks)
+{
+    if (!chunks) return;
+    EVP_CIPHER_CTX_free(chunks->ctx);
+    free(chunks->aad);
+    free(chunks);
+}
+
+void
+ppmA_name(const ppm_Key *k, const char *name, char *out)
+{
+    unsigned char md[32];
+    EVP_MD_CTX *ctx;
+    unsigned int i;
+
+    ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    EVP_DigestUpdate(ctx, k->dek, PPM_KEYSIZE);
+    EVP_DigestUpdate(ctx, name, strlen(name));
+    EVP_DigestFinal_ex(ctx, md, NULL);
+    EVP_MD_CTX_free(ctx);
+    for (i = 0; i < sizeof(md); i++)
+        sprintf(out + i * 2, "%02x", md[i]);
+}
+
 void
-ppmA_cleanup(void)
+ppmA_cleanup(ppm_Key *k)
 {
-    EVP_CIPHER_CTX_cleanup(&d_ctx);
-    EVP_CIPHER_CTX_cleanup(&e_ctx);
+    OPENSSL_cleanse(k, sizeof(ppm_Key));
+    k->slot = -1;
 }
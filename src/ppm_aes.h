@@ -27,9 +27,92 @@
 #ifndef PPM_AES_H
 #define PPM_AES_H
 
-extern unsigned int ppmA_initcipher(const char * /* key */);
-extern char *ppmA_encrypt(const char * /* data */, size_t * /* len */); 
-extern char *ppmA_decrypt(const char * /* data */, size_t /* len */);
-extern void ppmA_cleanup(void);
+#define PPM_KEYSIZE    32
+#define PPM_IVSIZE     16
+#define PPM_SALTSIZE   16
+#define PPM_WRAPSIZE   (PPM_KEYSIZE + 8)
+#define PPM_MAXKEYS    8
+#define PPM_KDFROUNDS  100000
+
+/* On disk a vault starts with a fixed size header: a magic string, the
+   IV of the payload and PPM_MAXKEYS key slots. Each slot holds the data
+   key wrapped by a key derived from one user key, so keys can be added,
+   removed or changed by changing the header only. The magic tells the
+   layout of what follows, version 2 files hold an index of the names
+   and a section of values encrypted apart, see ppm_db.c. */
+#define PPM_MAGIC      "PPM\001"
+#define PPM_MAGIC2     "PPM\002"
+#define PPM_SLOTSIZE   (1 + 4 + PPM_SALTSIZE + PPM_WRAPSIZE)
+#define PPM_HEADERSIZE (4 + PPM_IVSIZE + PPM_MAXKEYS * PPM_SLOTSIZE)
+
+typedef struct
+{
+    unsigned int used;
+    unsigned long rounds;
+    unsigned char salt[PPM_SALTSIZE];
+    unsigned char wrapped[PPM_WRAPSIZE];
+}
+ppm_KeySlot;
+
+typedef struct
+{
+    unsigned int version;
+    unsigned char iv[PPM_IVSIZE];
+    ppm_KeySlot slots[PPM_MAXKEYS];
+}
+ppm_Header;
+
+/* The data key encrypting a vault's payload, it never changes for the
+   lifetime of a vault no matter which user keys have access to it. Slot
+   is the key slot that opened it, -1 for legacy files. */
+typedef struct
+{
+    unsigned char dek[PPM_KEYSIZE];
+    unsigned char legacyiv[PPM_IVSIZE];
+    int slot;
+}
+ppm_Key;
+
+extern unsigned int ppmA_initcipher(ppm_Key * /* k */, const ppm_Header * /* header */, const char * /* key */);
+extern unsigned int ppmA_legacycipher(ppm_Key * /* k */, const char * /* key */);
+extern unsigned int ppmA_newkey(ppm_Key * /* k */, ppm_Header * /* header */, const char * /* key */);
+extern unsigned int ppmA_addkey(const ppm_Key * /* k */, ppm_Header * /* header */, const char * /* key */);
+extern unsigned int ppmA_rmkey(const ppm_Key * /* k */, ppm_Header * /* header */, const char * /* key */);
+extern unsigned int ppmA_rekey(const ppm_Key * /* k */, ppm_Header * /* header */, const char * /* key */);
+extern unsigned int ppmA_keycount(const ppm_Header * /* header */);
+extern void ppmA_packheader(const ppm_Header * /* header */, unsigned char * /* buf */);
+extern unsigned int ppmA_unpackheader(ppm_Header * /* header */, const unsigned char * /* buf */);
+extern char *ppmA_encrypt(const ppm_Key * /* k */, ppm_Header * /* header */, const char * /* data */, size_t * /* len */); 
+extern char *ppmA_decrypt(const ppm_Key * /* k */, const ppm_Header * /* header */, const char * /* data */, size_t /* len */);
+
+/* Encrypt len bytes of data under a fresh IV written to iv, or decrypt
+   them. Both return a buffer holding len bytes, which decrypting
+   follows with a '\0'. */
+extern char *ppmA_encryptbuf(const ppm_Key * /* k */, unsigned char * /* iv */, const char * /* data */, size_t * /* len */);
+extern char *ppmA_decryptbuf(const ppm_Key * /* k */, const unsigned char * /* iv */, const char * /* data */, size_t * /* len */);
+
+/* Chunked encryption for streams that have to be read back in pieces
+   as well, AES-256-GCM under the data key. Each chunk is sealed on its
+   own, its nonce is the stream's random prefix, the chunk's number and
+   whether it is the last one, so a chunk that is changed, moved or cut
+   off fails to open. Every chunk authenticates aad as well, a stream
+   only opens under the aad it was sealed with. Start fills in prefix
+   when sealing. Sealing writes
+   len + PPM_TAGSIZE bytes, opening len - PPM_TAGSIZE, both return
+   (size_t)-1 on failure. */
+#define PPM_PREFIXSIZE 7
+#define PPM_TAGSIZE    16
+typedef struct ppm_chunks ppm_Chunks;
+
+extern ppm_Chunks *ppmA_chunkstart(const ppm_Key * /* k */, unsigned char * /* prefix */, const char * /* aad */, unsigned int /* seal */);
+extern size_t ppmA_chunk(ppm_Chunks * /* chunks */, const char * /* data */, size_t /* len */, unsigned int /* last */, char * /* out */);
+extern void ppmA_chunkend(ppm_Chunks * /* chunks */);
+
+/* Writes a name for files belonging to name to out, which reveals
+   nothing about it without the data key: SHA-256 over the data key and
+   name, in hex. */
+#define PPM_NAMESIZE 65
+extern void ppmA_name(const ppm_Key * /* k */, const char * /* name */, char * /* out */);
+extern void ppmA_cleanup(ppm_Key * /* k */);
 
 #endif /* PPM_AES_H */
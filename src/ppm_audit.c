@@ -0,0 +1,927 @@
+/*
+ * ppm_audit.c
+ *
+ * Copyright (C) 2014 Niels Vanden Eynde
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#include "ppm_audit.h"
+#include "ppm.h"
+#include "ppm_mem.h"
+#include "ppm_pool.h"
+#include "ppm_table.h"
+
+#define HASH_SIZE 20
+#define HEX_SIZE (HASH_SIZE * 2)
+
+/* Below this many bytes the rest of a range is scanned rather than
+   searched, they are a page or two that are read either way. */
+#define SCAN_SIZE 4096
+
+/* Interpolation steps before falling back to bisection. Hashes are
+   uniform, a lookup rarely takes more than three. */
+#define GUESSES 8
+
+/* Ten bits per hash and seven probes give about 1% false positives.
+   The filter starts with a text header of BLOOM_HEADER bytes. */
+#define BLOOM_BITS 10
+#define BLOOM_PROBES 7
+#define BLOOM_HEADER 64
+#define BLOOM_MAGIC "PPMBLOOM"
+
+#define MAC_SIZE 32
+
+/* Guesses, in bits, below which a password is weak or merely fair. */
+#define WEAK_BITS 40
+#define FAIR_BITS 60
+
+/* An entry's severity is the sum of its issues. */
+enum
+{
+    ISSUE_FAIR = 1,
+    ISSUE_REUSED = 2,
+    ISSUE_WEAK = 4,
+    ISSUE_BREACHED = 8
+};
+
+typedef struct
+{
+    const unsigned char *data;
+    size_t size;
+    time_t mtime;
+}
+Map;
+
+typedef struct
+{
+    Map file;
+
+    /* Hex lines as published by breach notification services, else
+       raw records of HASH_SIZE bytes. */
+    unsigned int text;
+
+    Map bloom;
+    const unsigned char *bits;
+    size_t nbits;
+    unsigned int probes;
+}
+Corpus;
+
+typedef struct
+{
+    char *key;
+    char *value;
+    unsigned char hash[HASH_SIZE];
+    unsigned char mac[MAC_SIZE];
+    unsigned long count;
+    double bits;
+
+    /* 1 if the hash is in the corpus, -1 if the corpus turned out not
+       to be a sorted hash list where it was looked at. */
+    int found;
+
+    /* How many entries share the password, itself included. Entries
+       with the same password are chained through group. */
+    size_t reused;
+    size_t group;
+
+    unsigned int issues;
+}
+Entry;
+
+typedef struct
+{
+    Corpus *corpus;
+    Entry *entries;
+    size_t count;
+    size_t cap;
+    unsigned int chunks;
+
+    /* Passwords are compared by their MAC under a key that only lives
+       as long as the audit. */
+    unsigned char mackey[MAC_SIZE];
+
+    /* Building a filter: its bits, and set if a record isn't a hash. */
+    unsigned char *bits;
+    int bad;
+}
+Audit;
+
+/* Common passwords and the words they are built from. */
+static const char *words[] = 
+{
+    "password", "passw0rd", "qwerty", "letmein", "welcome", "admin", 
+    "login", "master", "dragon", "monkey", "iloveyou", "sunshine", 
+    "princess", "football", "baseball", "shadow", "superman", "trustno1", 
+    "secret", "hello", "freedom", "whatever", "michael", "summer", 
+    "winter", "ninja", "mustang", "access", "batman", "starwars", 
+    "charlie", "love", "test", "changeme", "default", "root", "pass", 
+    "user", "guest", "abc"
+};
+
+static const char *rows[] = 
+{
+    "1234567890", "qwertyuiop", "asdfghjkl", "zxcvbnm"
+};
+
+static int
+hexval(unsigned char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static unsigned int
+unhex(const unsigned char *p, const unsigned char *end, unsigned char *hash)
+{
+    int hi, lo;
+    size_t i;
+
+    if (end - p < HEX_SIZE) return 0;
+    for (i = 0; i < HASH_SIZE; i++)
+    {
+        hi = hexval(p[2 * i]);
+        lo = hexval(p[2 * i + 1]);
+        if (hi < 0 || lo < 0) return 0;
+        hash[i] = (unsigned char)(hi << 4 | lo);
+    }
+    return 1;
+}
+
+/* The leading bytes of a hash as a number, for interpolation and for
+   the filter's probes. */
+static unsigned long
+prefix(const unsigned char *hash)
+{
+    unsigned long v = 0;
+    size_t i;
+
+    for (i = 0; i < sizeof(unsigned long); i++)
+        v = v << 8 | hash[i];
+    return v;
+}
+
+static size_t
+nextline(const unsigned char *data, size_t p, size_t end)
+{
+    while (p < end && data[p] != '\n') p++;
+    return p < end ? p + 1 : end;
+}
+
+static unsigned long
+linecount(const unsigned char *p, const unsigned char *end)
+{
+    unsigned long n = 0;
+
+    if (p >= end || *p != ':') return 0;
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+        n = n * 10 + (*p - '0');
+    return n;
+}
+
+/* Where target should be between lo and hi, given the keys found at
+   either end. Bisects once guessing stops paying off. */
+static size_t
+guess(size_t lo, size_t hi, unsigned long klo, unsigned long khi, unsigned long target, unsigned int step)
+{
+    size_t pos;
+
+    if (step < GUESSES && target >= klo && target <= khi && khi > klo)
+        pos = lo + (size_t)((double)(target - klo) / ((double)(khi - klo) + 1) * (double)(hi - lo));
+    else
+        pos = lo + (hi - lo) / 2;
+    return pos < hi ? pos : hi - 1;
+}
+
+/* Returns 1 if hash is in a corpus of hex lines, 0 if not and -1 if
+   a line looked at isn't a hash. */
+static int
+searchtext(const Corpus *c, const unsigned char *hash, unsigned long *count)
+{
+    const unsigned char *data = c->file.data;
+    unsigned char line[HASH_SIZE];
+    unsigned long target = prefix(hash), klo = 0, khi = ULONG_MAX;
+    size_t lo = 0, hi = c->file.size, p;
+    unsigned int step = 0;
+    int cmp;
+
+    /* lo and hi are always at the start of a line. */
+    while (hi - lo > SCAN_SIZE)
+    {
+        p = guess(lo, hi, klo, khi, target, step++);
+        while (p > lo && data[p - 1] != '\n') p--;
+        if (!unhex(data + p, data + hi, line)) return -1;
+
+        cmp = memcmp(line, hash, HASH_SIZE);
+        if (cmp == 0)
+        {
+            *count = linecount(data + p + HEX_SIZE, data + c->file.size);
+            return 1;
+        }
+        if (cmp < 0)
+        {
+            lo = nextline(data, p, hi);
+            klo = prefix(line);
+        }
+        else
+        {
+            hi = p;
+            khi = prefix(line);
+        }
+    }
+
+    for (p = lo; p < hi; p = nextline(data, p, hi))
+    {
+        if (!unhex(data + p, data + hi, line)) return -1;
+        cmp = memcmp(line, hash, HASH_SIZE);
+        if (cmp == 0)
+        {
+            *count = linecount(data + p + HEX_SIZE, data + c->file.size);
+            return 1;
+        }
+        if (cmp > 0) break;
+    }
+    return 0;
+}
+
+static int
+searchraw(const Corpus *c, const unsigned char *hash)
+{
+    const unsigned char *data = c->file.data;
+    unsigned long target = prefix(hash), klo = 0, khi = ULONG_MAX;
+    size_t lo = 0, hi = c->file.size / HASH_SIZE, i;
+    unsigned int step = 0;
+    int cmp;
+
+    while (hi - lo > SCAN_SIZE / HASH_SIZE)
+    {
+        i = guess(lo, hi, klo, khi, target, step++);
+        cmp = memcmp(data + i * HASH_SIZE, hash, HASH_SIZE);
+        if (cmp == 0) return 1;
+        if (cmp < 0)
+        {
+            lo = i + 1;
+            klo = prefix(data + i * HASH_SIZE);
+        }
+        else
+        {
+            hi = i;
+            khi = prefix(data + i * HASH_SIZE);
+        }
+    }
+
+    for (i = lo; i < hi; i++)
+    {
+        cmp = memcmp(data + i * HASH_SIZE, hash, HASH_SIZE);
+        if (cmp == 0) return 1;
+        if (cmp > 0) break;
+    }
+    return 0;
+}
+
+/* Probe positions are derived from the hash itself, it is uniform
+   already. */
+static size_t
+probe(const Corpus *c, const unsigned char *hash, unsigned int i)
+{
+    return (prefix(hash) + i * (prefix(hash + 8) | 1)) % c->nbits;
+}
+
+static unsigned int
+maybein(const Corpus *c, const unsigned char *hash)
+{
+    unsigned int i;
+    size_t bit;
+
+    if (!c->bits) return 1;
+    for (i = 0; i < c->probes; i++)
+    {
+        bit = probe(c, hash, i);
+        if (!(c->bits[bit >> 3] & (1 << (bit & 7)))) return 0;
+    }
+    return 1;
+}
+
+/* Maps a whole file read-only. Returns 0 with an error, or -1 without
+   one if the file doesn't exist and missing is set. */
+static int
+mapfile(const char *path, Map *map, unsigned int missing)
+{
+    struct stat st;
+    void *data;
+    int fd;
+
+    map->data = NULL;
+    map->size = 0;
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        if (missing && errno == ENOENT)
+        {
+            errno = 0;
+            return -1;
+        }
+        ppm_error("failed to open %s", path);
+        return 0;
+    }
+    if (fstat(fd, &st) != 0)
+    {
+        ppm_error("failed to read %s", path);
+        close(fd);
+        return 0;
+    }
+    map->mtime = st.st_mtime;
+    if (st.st_size > 0)
+    {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            ppm_error("failed to map %s", path);
+            close(fd);
+            return 0;
+        }
+        map->data = data;
+        map->size = st.st_size;
+    }
+    close(fd);
+    return 1;
+}
+
+static void
+unmap(Map *map)
+{
+    if (map->data)
+        munmap((void *)map->data, map->size);
+    map->data = NULL;
+}
+
+/* Sets the filter's bits for one part of the corpus, parts start and
+   end at a record boundary. */
+static void
+fillbloom(void *arg, unsigned int i)
+{
+    Audit *a = arg;
+    Corpus *c = a->corpus;
+    const unsigned char *data = c->file.data;
+    unsigned char line[HASH_SIZE];
+    const unsigned char *hash;
+    size_t start, end, p, bit;
+    unsigned int j;
+
+    start = c->file.size / a->chunks * i;
+    end = i + 1 < a->chunks ? c->file.size / a->chunks * (i + 1) : c->file.size;
+    if (c->text)
+    {
+        while (start > 0 && start < c->file.size && data[start - 1] != '\n') start++;
+        while (end > 0 && end < c->file.size && data[end - 1] != '\n') end++;
+    }
+    else
+    {
+        start -= start % HASH_SIZE;
+        end -= end % HASH_SIZE;
+    }
+
+    for (p = start; p < end; p = c->text ? nextline(data, p, end) : p + HASH_SIZE)
+    {
+        hash = data + p;
+        if (c->text)
+        {
+            /* A trailing empty line is fine. */
+            if (data[p] == '\n' || data[p] == '\r') continue;
+            if (!unhex(data + p, data + end, line))
+            {
+                __atomic_store_n(&a->bad, 1, __ATOMIC_RELAXED);
+                return;
+            }
+            hash = line;
+        }
+        for (j = 0; j < c->probes; j++)
+        {
+            bit = probe(c, hash, j);
+            __atomic_fetch_or(a->bits + (bit >> 3), (unsigned char)(1 << (bit & 7)), __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Builds the filter straight into its file, which is only put in place
+   once complete. Hex lines are at least HEX_SIZE + 1 bytes, sizing it by
+   that errs on the side of fewer false positives. */
+static unsigned int
+buildbloom(Corpus *c, const char *bloompath, const char *path)
+{
+    Audit a;
+    char header[BLOOM_HEADER + 1], *tmp;
+    void *bits;
+    size_t n, size;
+    int fd;
+
+    n = c->file.size / (c->text ? HEX_SIZE + 1 : HASH_SIZE) + 1;
+    c->nbits = (n * BLOOM_BITS + 7) & ~(size_t)7;
+    c->probes = BLOOM_PROBES;
+    size = BLOOM_HEADER + c->nbits / 8;
+
+    tmp = ppmM_alloc(strlen(bloompath) + 8);
+    sprintf(tmp, "%s.XXXXXX", bloompath);
+    fd = mkstemp(tmp);
+    if (fd < 0)
+    {
+        ppm_error("failed to create %s", tmp);
+        free(tmp);
+        return 0;
+    }
+    if (ftruncate(fd, size) != 0 
+     || (bits = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        ppm_error("failed to write to %s", tmp);
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        return 0;
+    }
+
+    ppm_message("building %s", bloompath);
+    memset(&a, 0, sizeof(a));
+    a.corpus = c;
+    a.bits = (unsigned char *)bits + BLOOM_HEADER;
+    a.chunks = ppmP_threads() * 4;
+    ppmP_run(fillbloom, &a, a.chunks);
+
+    memset(header, ' ', BLOOM_HEADER);
+    sprintf(header, "%s %lu %u %lu", BLOOM_MAGIC, (unsigned long)c->nbits, c->probes, 
+            (unsigned long)c->file.size);
+    header[strlen(header)] = ' ';
+    header[BLOOM_HEADER - 1] = '\n';
+    memcpy(bits, header, BLOOM_HEADER);
+
+    if (a.bad)
+        ppm_error("%s is not a sorted list of SHA-1 hashes", path);
+    if (a.bad 
+     || msync(bits, size, MS_SYNC) != 0 
+     || munmap(bits, size) != 0
+     || close(fd) != 0 
+     || rename(tmp, bloompath) != 0)
+    {
+        if (!a.bad) 
+            ppm_error("failed to write to %s", tmp);
+        unlink(tmp);
+        free(tmp);
+        return 0;
+    }
+    free(tmp);
+    return 1;
+}
+
+/* Uses the filter next to the corpus, or builds it if there is none
+   or it was built for another version of the corpus. */
+static unsigned int
+openbloom(Corpus *c, const char *path)
+{
+    char *bloompath, header[BLOOM_HEADER + 1], magic[16];
+    unsigned long nbits, size;
+    unsigned int probes, built = 0;
+    int status;
+
+    bloompath = ppmM_alloc(strlen(path) + 8);
+    sprintf(bloompath, "%s.bloom", path);
+    for (;;)
+    {
+        status = mapfile(bloompath, &c->bloom, 1);
+        if (status == 0) break;
+        if (status > 0 && c->bloom.size > BLOOM_HEADER && c->bloom.mtime >= c->file.mtime)
+        {
+            memcpy(header, c->bloom.data, BLOOM_HEADER);
+            header[BLOOM_HEADER] = '\0';
+            if (sscanf(header, "%15s %lu %u %lu", magic, &nbits, &probes, &size) == 4
+             && strcmp(magic, BLOOM_MAGIC) == 0
+             && size == c->file.size
+             && nbits > 0 && nbits / 8 <= c->bloom.size - BLOOM_HEADER)
+            {
+                c->bits = c->bloom.data + BLOOM_HEADER;
+                c->nbits = nbits;
+                c->probes = probes;
+                break;
+            }
+        }
+        unmap(&c->bloom);
+        if (built || !buildbloom(c, bloompath, path))
+        {
+            status = 0;
+            break;
+        }
+        built = 1;
+    }
+    free(bloompath);
+    return status != 0;
+}
+
+/* log2 without libm: the integer part by halving, the fraction bit
+   by bit by squaring. */
+static double
+lg(double x)
+{
+    double bits = 0, bit = 0.5;
+    unsigned int i;
+
+    while (x >= 2)
+    {
+        x /= 2;
+        bits++;
+    }
+    for (i = 0; i < 16; i++, bit /= 2)
+    {
+        x *= x;
+        if (x >= 2)
+        {
+            x /= 2;
+            bits += bit;
+        }
+    }
+    return bits;
+}
+
+static int
+lower(int c)
+{
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+/* Row and column of every lowercase key on the rows above, the row is
+   0 for other characters. Filled before the first audit's threads start. */
+static unsigned char keyrow[256];
+static unsigned char keycol[256];
+
+static void
+initkeys(void)
+{
+    const char *p;
+    size_t i;
+
+    if (keyrow['q']) return;
+    for (i = 0; i < sizeof(rows) / sizeof(*rows); i++)
+    {
+        for (p = rows[i]; *p; p++)
+        {
+            keyrow[(unsigned char)*p] = i + 1;
+            keycol[(unsigned char)*p] = p - rows[i];
+        }
+    }
+}
+
+/* Whether b follows a on a row of the keyboard, either way. */
+static unsigned int
+adjacent(int a, int b)
+{
+    a = lower(a);
+    b = lower(b);
+    return keyrow[a] && keyrow[a] == keyrow[b] 
+        && (keycol[a] == keycol[b] + 1 || keycol[b] == keycol[a] + 1);
+}
+
+static unsigned int
+wordat(const char *p, const char *word)
+{
+    while (*word && lower(*p) == *word)
+    {
+        p++;
+        word++;
+    }
+    return !*word;
+}
+
+/* A rough estimate of the bits of guessing a password takes. Every
+   character is worth the alphabet it's drawn from, unless it repeats
+   or continues the one before it, in a sequence or along the keyboard.
+   A common word counts as a single guess from the word list, plus a
+   bit if it's capitalized. */
+static double
+strength(const char *pw)
+{
+    size_t len = strlen(pw), i, j, n;
+    unsigned int alphabet = 0, lowers = 0, uppers = 0, digits = 0, others = 0;
+    double perchar, bits = 0;
+    const unsigned char *p = (const unsigned char *)pw;
+
+    for (i = 0; i < len; i++)
+    {
+        if (p[i] >= 'a' && p[i] <= 'z') lowers = 1;
+        else if (p[i] >= 'A' && p[i] <= 'Z') uppers = 1;
+        else if (p[i] >= '0' && p[i] <= '9') digits = 1;
+        else others = 1;
+    }
+    alphabet = lowers * 26 + uppers * 26 + digits * 10 + others * 33;
+    if (alphabet == 0) return 0;
+    perchar = lg(alphabet);
+
+    for (i = 0; i < len; )
+    {
+        /* The longest common word starting here. */
+        for (j = n = 0; j < sizeof(words) / sizeof(*words); j++)
+        {
+            if (*words[j] == lower(p[i]) && strlen(words[j]) > n && wordat(pw + i, words[j]))
+                n = strlen(words[j]);
+        }
+        if (n > 0)
+        {
+            bits += lg(sizeof(words) / sizeof(*words)) + (p[i] >= 'A' && p[i] <= 'Z');
+            i += n;
+            continue;
+        }
+
+        if (i > 0 && (p[i] == p[i - 1] || p[i] == p[i - 1] + 1 || p[i] + 1 == p[i - 1] 
+                      || adjacent(p[i], p[i - 1])))
+            bits += 1;
+        else
+            bits += perchar;
+        i++;
+    }
+    return bits;
+}
+
+static void
+collect(ppm_Node *node, void *arg)
+{
+    Audit *a = arg;
+    Entry *e;
+
+    if (a->count == a->cap)
+    {
+        a->cap = a->cap ? a->cap * 2 : 64;
+        a->entries = ppmM_realloc(a->entries, a->cap * sizeof(Entry));
+    }
+    e = a->entries + a->count++;
+    e->key = ppmM_strdup(node->key);
+    e->value = ppmM_strdup(node->value);
+}
+
+/* Everything about an entry that doesn't depend on the others, on the
+   pool. */
+static void
+assess(void *arg, unsigned int i)
+{
+    Audit *a = arg;
+    Corpus *c = a->corpus;
+    EVP_MD_CTX *keyed, *ctx;
+    size_t j, end;
+
+    /* The MAC is SHA-256 over the key and the password. Digesting the
+       key once and copying that state is far cheaper than setting up
+       an HMAC per entry. */
+    keyed = EVP_MD_CTX_new();
+    ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(keyed, EVP_sha256(), NULL);
+    EVP_DigestUpdate(keyed, a->mackey, MAC_SIZE);
+
+    end = i + 1 < a->chunks ? a->count / a->chunks * (i + 1) : a->count;
+    for (j = a->count / a->chunks * i; j < end; j++)
+    {
+        Entry *e = a->entries + j;
+        size_t len = strlen(e->value);
+
+        e->count = 0;
+        e->found = 0;
+        e->reused = 1;
+        e->group = j;
+        e->bits = strength(e->value);
+        e->issues = e->bits < WEAK_BITS ? ISSUE_WEAK : e->bits < FAIR_BITS ? ISSUE_FAIR : 0;
+        EVP_MD_CTX_copy_ex(ctx, keyed);
+        EVP_DigestUpdate(ctx, e->value, len);
+        EVP_DigestFinal_ex(ctx, e->mac, NULL);
+
+        if (!c) continue;
+        EVP_Digest(e->value, len, e->hash, NULL, EVP_sha1(), NULL);
+        if (!maybein(c, e->hash)) continue;
+        e->found = c->text ? searchtext(c, e->hash, &e->count) : searchraw(c, e->hash);
+        if (e->found > 0)
+            e->issues |= ISSUE_BREACHED;
+    }
+    EVP_MD_CTX_free(ctx);
+    EVP_MD_CTX_free(keyed);
+}
+
+/* Groups entries by MAC in an open addressed table of entry indexes,
+   the MACs are uniform so their leading bytes make a fine hash. */
+static void
+findreuse(Audit *a)
+{
+    size_t *slots, size, mask, i, h, head;
+
+    for (size = 64; size < a->count * 2; size *= 2);
+    mask = size - 1;
+    slots = ppmM_alloc(size * sizeof(size_t));
+    for (i = 0; i < size; i++) 
+        slots[i] = (size_t)-1;
+
+    for (i = 0; i < a->count; i++)
+    {
+        Entry *e = a->entries + i;
+
+        for (h = prefix(e->mac) & mask; slots[h] != (size_t)-1; h = (h + 1) & mask)
+        {
+            if (memcmp(a->entries[slots[h]].mac, e->mac, MAC_SIZE) == 0) break;
+        }
+        if (slots[h] == (size_t)-1)
+        {
+            slots[h] = i;
+            continue;
+        }
+        head = slots[h];
+        e->group = a->entries[head].group;
+        a->entries[head].group = i;
+        a->entries[head].reused++;
+    }
+
+    /* Every member of a group learns its size from the head. */
+    for (i = 0; i < size; i++)
+    {
+        Entry *e;
+
+        if (slots[i] == (size_t)-1) continue;
+        head = slots[i];
+        if (a->entries[head].reused < 2) continue;
+        for (h = head;; h = a->entries[h].group)
+        {
+            e = a->entries + h;
+            e->reused = a->entries[head].reused;
+            e->issues |= ISSUE_REUSED;
+            if (e->group == head) break;
+        }
+    }
+    free(slots);
+}
+
+/* Most severe first, then weakest. */
+static int
+cmpentry(const void *a, const void *b)
+{
+    const Entry *ea = a, *eb = b;
+
+    if (ea->issues != eb->issues) return ea->issues < eb->issues ? 1 : -1;
+    if (ea->count != eb->count) return ea->count < eb->count ? 1 : -1;
+    if (ea->bits != eb->bits) return ea->bits < eb->bits ? -1 : 1;
+    return strcmp(ea->key, eb->key);
+}
+
+static void
+report(const Entry *e)
+{
+    const char *sep = "";
+
+    fprintf(PPM_OUT, "%s%s%s => %s", PPMC(WHITE), e->key, PPMC(GREEN), 
+           e->issues >= ISSUE_WEAK ? PPMC(RED) : PPMC(BLUE));
+    if (e->issues & ISSUE_BREACHED)
+    {
+        fprintf(PPM_OUT, "breached");
+        if (e->count)
+            fprintf(PPM_OUT, " (%lu times)", e->count);
+        sep = ", ";
+    }
+    if (e->issues & ISSUE_REUSED)
+    {
+        fprintf(PPM_OUT, "%sreused by %lu entries", sep, (unsigned long)e->reused);
+        sep = ", ";
+    }
+    if (e->issues & (ISSUE_WEAK | ISSUE_FAIR))
+        fprintf(PPM_OUT, "%s%s (%d bits)", sep, e->issues & ISSUE_WEAK ? "weak" : "fair", (int)e->bits);
+    fprintf(PPM_OUT, "%s\n", PPMC(NONE));
+}
+
+static unsigned int
+opencorpus(Corpus *c, const char *path, unsigned int bloom)
+{
+    unsigned char hash[HASH_SIZE];
+
+    if (!mapfile(path, &c->file, 0))
+        return 0;
+
+    /* Lookups jump around the file, reading ahead would only waste
+       memory on a corpus this size. */
+    if (c->file.data)
+        posix_madvise((void *)c->file.data, c->file.size, POSIX_MADV_RANDOM);
+    c->text = c->file.size >= HEX_SIZE && unhex(c->file.data, c->file.data + c->file.size, hash);
+    if (c->file.size > 0 && !c->text && c->file.size % HASH_SIZE != 0)
+    {
+        ppm_error("%s is not a sorted list of SHA-1 hashes", path);
+        unmap(&c->file);
+        return 0;
+    }
+    if (bloom && c->file.size > 0 && !openbloom(c, path))
+    {
+        unmap(&c->file);
+        return 0;
+    }
+    return 1;
+}
+
+unsigned int
+ppmU_audit(ppm_Vault *vault, const char *breached, unsigned int bloom)
+{
+    Corpus c;
+    Audit a;
+    unsigned long nbreached = 0, nweak = 0, nreused = 0;
+    unsigned int ok = 1;
+    size_t i;
+
+    memset(&c, 0, sizeof(c));
+    memset(&a, 0, sizeof(a));
+    if (breached)
+    {
+        if (!opencorpus(&c, breached, bloom))
+            return 0;
+        if (c.file.size > 0)
+            a.corpus = &c;
+    }
+    if (RAND_bytes(a.mackey, MAC_SIZE) != 1)
+    {
+        ppm_error("failed to generate a key");
+        unmap(&c.bloom);
+        unmap(&c.file);
+        return 0;
+    }
+
+    /* Only copying the entries holds up the vault, the rest runs on
+       the pool in a few chunks per thread. */
+    initkeys();
+    if (!ppmD_foreach(vault, collect, &a))
+    {
+        OPENSSL_cleanse(a.mackey, MAC_SIZE);
+        unmap(&c.bloom);
+        unmap(&c.file);
+        return 0;
+    }
+    if (a.count > 0)
+    {
+        a.chunks = ppmP_threads() * 4;
+        if (a.chunks > a.count) a.chunks = a.count;
+        ppmP_run(assess, &a, a.chunks);
+        findreuse(&a);
+    }
+
+    qsort(a.entries, a.count, sizeof(Entry), cmpentry);
+    for (i = 0; i < a.count; i++)
+    {
+        Entry *e = a.entries + i;
+
+        if (e->found < 0) 
+            ok = 0;
+        if (e->issues)
+            report(e);
+        nbreached += (e->issues & ISSUE_BREACHED) != 0;
+        nweak += (e->issues & ISSUE_WEAK) != 0;
+        nreused += (e->issues & ISSUE_REUSED) != 0;
+        OPENSSL_cleanse(e->value, strlen(e->value));
+        free(e->value);
+        free(e->key);
+    }
+    OPENSSL_cleanse(a.mackey, MAC_SIZE);
+    free(a.entries);
+    unmap(&c.bloom);
+    unmap(&c.file);
+
+    if (!ok)
+    {
+        ppm_error("%s is not a sorted list of SHA-1 hashes", breached);
+        return 0;
+    }
+    if (breached)
+        ppm_message("%lu passwords audited, %lu breached, %lu weak, %lu reused", 
+                    (unsigned long)a.count, nbreached, nweak, nreused);
+    else
+        ppm_message("%lu passwords audited, %lu weak, %lu reused", 
+                    (unsigned long)a.count, nweak, nreused);
+    return 1;
+}
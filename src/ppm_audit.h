@@ -0,0 +1,39 @@
+/*
+ * ppm_audit.h
+ *
+ * Copyright (C) 2014 Niels Vanden Eynde
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef PPM_AUDIT_H
+#define PPM_AUDIT_H
+
+#include "ppm_db.h"
+
+/* Reports weak and reused passwords, most severe first. With breached
+   the passwords are also looked up in a breach corpus: a file of SHA-1
+   hashes sorted by hash, either as hex lines optionally followed by ':'
+   and a count, or as raw 20 byte records. With bloom a filter kept next
+   to the corpus is used, and built first if need be. */
+extern unsigned int ppmU_audit(ppm_Vault * /* vault */, const char * /* breached */, unsigned int /* bloom */);
+
+#endif /* PPM_AUDIT_H */
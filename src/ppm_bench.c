@@ -0,0 +1,281 @@
+/*
+ * ppm_bench.c
+ *
+ * Copyright (C) 2014 Niels Vanden Eynde
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "ppm_db.h"
+#include "ppm_mem.h"
+#include "ppm_pool.h"
+
+/* Times the life of a synthetic vault: adding its entries, saving it,
+   loading it again, looking entries up and updating them. The vault is
+   the same for the same options, results are printed as one JSON
+   object so runs on different commits can be compared. */
+
+typedef struct
+{
+    unsigned long entries;
+    unsigned long lookups;
+    unsigned long seed;
+    unsigned int keymin, keymax;
+    unsigned int valuemin, valuemax;
+}
+Options;
+
+static const char alphabet[] = 
+    "abcdefghijklmnopqrstuvwxyz0123456789"
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZ!#$%&()*+,-./:;<=>?@[]^_{|}~";
+
+static unsigned long
+rnd(unsigned long *state)
+{
+    /* xorshift, the same sequence on every platform with 64 bit longs
+       and on any other as long as the seed fits. */
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static unsigned int
+length(unsigned long *state, unsigned int min, unsigned int max)
+{
+    return min + (unsigned int)(rnd(state) % (max - min + 1));
+}
+
+/* Keys start with random letters up to their length and end in their
+   index, which keeps them unique. */
+static char *
+genkey(unsigned long *state, const Options *o, unsigned long i)
+{
+    char digits[24], *key;
+    unsigned int len, n = 0, j;
+
+    do
+    {
+        digits[n++] = '0' + i % 10;
+        i /= 10;
+    }
+    while (i);
+
+    len = length(state, o->keymin, o->keymax);
+    if (len < n) len = n;
+    key = ppmM_alloc(len + 1);
+    for (j = 0; j < len - n; j++)
+        key[j] = alphabet[rnd(state) % 26];
+    while (n)
+        key[j++] = digits[--n];
+    key[j] = '\0';
+    return key;
+}
+
+static void
+genvalue(unsigned long *state, const Options *o, char *value)
+{
+    unsigned int len, j;
+
+    len = length(state, o->valuemin, o->valuemax);
+    for (j = 0; j < len; j++)
+        value[j] = alphabet[rnd(state) % (sizeof(alphabet) - 1)];
+    value[len] = '\0';
+}
+
+static double
+since(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int
+cmplong(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+
+    return (x > y) - (x < y);
+}
+
+static unsigned int
+range(const char *arg, unsigned int *min, unsigned int *max)
+{
+    char *end;
+
+    *min = *max = (unsigned int)strtoul(arg, &end, 10);
+    if (*end == '-')
+        *max = (unsigned int)strtoul(end + 1, &end, 10);
+    return *end == '\0' && *min > 0 && *min <= *max && *max < 4096;
+}
+
+static void
+removevault(const char *path)
+{
+    char lockpath[80];
+
+    sprintf(lockpath, "%s.lock", path);
+    unlink(path);
+    unlink(lockpath);
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n entries] [-l lookups] [-k keylen[-max]] "
+            "[-v valuelen[-max]] [-r seed]\n", name);
+}
+
+int
+main(int argc, char *argv[])
+{
+    Options o;
+    ppm_Vault *vault;
+    struct timespec start;
+    struct rusage ru;
+    char path[64], *value, **keys;
+    unsigned long *samples, state, i;
+    double add, save, load, update;
+    int c;
+
+    o.entries = 100000;
+    o.lookups = 100000;
+    o.seed = 1;
+    o.keymin = 8;
+    o.keymax = 32;
+    o.valuemin = 8;
+    o.valuemax = 64;
+    while ((c = getopt(argc, argv, "n:l:k:v:r:")) != -1)
+    {
+        switch (c)
+        {
+        case 'n': o.entries = strtoul(optarg, NULL, 10); break;
+        case 'l': o.lookups = strtoul(optarg, NULL, 10); break;
+        case 'r': o.seed = strtoul(optarg, NULL, 10); break;
+        case 'k':
+            if (!range(optarg, &o.keymin, &o.keymax)) o.entries = 0;
+            break;
+        case 'v':
+            if (!range(optarg, &o.valuemin, &o.valuemax)) o.entries = 0;
+            break;
+        default:
+            o.entries = 0;
+        }
+    }
+    if (o.entries == 0 || o.lookups == 0 || o.seed == 0 || optind < argc)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    sprintf(path, "/tmp/ppm-bench-%ld", (long)getpid());
+    vault = ppmD_open(path, "bench", 0);
+    if (!vault) return EXIT_FAILURE;
+
+    /* Keys are made up front so adding only times the vault. */
+    state = o.seed;
+    keys = ppmM_alloc(o.entries * sizeof(char *));
+    value = ppmM_alloc(o.valuemax + 1);
+    for (i = 0; i < o.entries; i++)
+        keys[i] = genkey(&state, &o, i);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < o.entries; i++)
+    {
+        genvalue(&state, &o, value);
+        ppmD_put(vault, keys[i], value);
+    }
+    add = since(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!ppmD_save(vault))
+    {
+        removevault(path);
+        return EXIT_FAILURE;
+    }
+    save = since(&start);
+    ppmD_close(vault);
+
+    /* Loading includes deriving the key, as every run of ppm does, and
+       the first lookup, which decrypts the passwords. */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    vault = ppmD_open(path, "bench", 0);
+    if (vault) ppmD_get(vault, keys[0]);
+    load = since(&start);
+    if (!vault || ppmD_count(vault) != o.entries)
+    {
+        fprintf(stderr, "%s: vault read back wrong\n", argv[0]);
+        removevault(path);
+        return EXIT_FAILURE;
+    }
+
+    samples = ppmM_alloc(o.lookups * sizeof(unsigned long));
+    for (i = 0; i < o.lookups; i++)
+    {
+        const char *key = keys[rnd(&state) % o.entries];
+        struct timespec t0, t1;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        ppmD_get(vault, key);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        samples[i] = (t1.tv_sec - t0.tv_sec) * 1000000000UL + t1.tv_nsec - t0.tv_nsec;
+    }
+    qsort(samples, o.lookups, sizeof(unsigned long), cmplong);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < o.lookups; i++)
+    {
+        genvalue(&state, &o, value);
+        ppmD_put(vault, keys[rnd(&state) % o.entries], value);
+    }
+    update = since(&start);
+    getrusage(RUSAGE_SELF, &ru);
+
+    printf("{\"entries\":%lu,\"seed\":%lu,\"key_len\":[%u,%u],\"value_len\":[%u,%u],"
+           "\"add_per_s\":%.0f,\"save_ms\":%.3f,\"load_ms\":%.3f,"
+           "\"get_p50_ns\":%lu,\"get_p90_ns\":%lu,\"get_p99_ns\":%lu,\"get_max_ns\":%lu,"
+           "\"update_per_s\":%.0f,\"peak_rss_kb\":%ld}\n",
+           o.entries, o.seed, o.keymin, o.keymax, o.valuemin, o.valuemax,
+           o.entries / add, save * 1e3, load * 1e3,
+           samples[o.lookups / 2], samples[o.lookups * 9 / 10], 
+           samples[o.lookups * 99 / 100], samples[o.lookups - 1],
+           o.lookups / update, ru.ru_maxrss);
+
+    ppmD_close(vault);
+    removevault(path);
+    for (i = 0; i < o.entries; i++)
+        free(keys[i]);
+    free(keys);
+    free(value);
+    free(samples);
+    ppmP_cleanup();
+    return EXIT_SUCCESS;
+}
@@ -26,6 +26,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "config.h"
 
@@ -36,89 +40,1134 @@
 
 #include "ppm_command.h"
 #include "ppm_db.h"
+#include "ppm_aes.h"
 #include "ppm_mem.h"
+#include "ppm_gen.h"
+#include "ppm_import.h"
+#include "ppm_export.h"
+#include "ppm_merkle.h"
+#include "ppm_audit.h"
+#include "ppm_table.h"
+#include "ppm_profile.h"
 #include "ppm.h"
 
 #define PROMPT "ppm > "
 
-typedef unsigned int Function(size_t, char **);
+/* Arguments a command line can be split into, command included. */
+#define MAXARGS 64
+
+typedef unsigned int CommandFunc(size_t, char **);
 static char *line = NULL;
 
-static unsigned int
-add(size_t argc, char **args)
+/* Set while ppmC_serve is reading requests from stdin. */
+static unsigned int serving = 0;
+
+/* Changes made since 'begin', by user, only applied to the database on
+   'commit': new passwords in pending, removals in removed, a user is in
+   one of them at most. Both NULL outside of a transaction. */
+static ppm_Table *pending = NULL;
+static ppm_Table *removed = NULL;
+
+/* What an entry looked like before a commit touched it. */
+typedef struct
+{
+    ppm_Node node;
+    unsigned int existed;
+}
+Undo;
+
+static unsigned int
+notintxn(const char *cmd)
+{
+    if (!pending) return 1;
+    ppm_error("'%s' can't be used in a transaction, use '%scommit%s' or '%sabort%s' first", 
+              cmd, PPMC(WHITE), PPMC(RED), PPMC(WHITE), PPMC(RED));
+    return 0;
+}
+
+static unsigned int
+validname(const char *app)
+{
+    if (ppmD_validname(app)) return 1;
+    ppm_error("invalid name '%s', names can't contain tabs or newlines", app);
+    return 0;
+}
+
+/* Looks a user up as the transaction sees it. */
+static char *
+lookup(const char *app)
+{
+    ppm_Node *node;
+
+    if (pending && ppmT_getnode(removed, app))
+        return NULL;
+    if (pending && (node = ppmT_getnode(pending, app)))
+        return node->value;
+    return ppmD_get(ppm_vault, app);
+}
+
+/* Like lookup, without decrypting any passwords. */
+static unsigned int
+exists(const char *app)
+{
+    if (pending && ppmT_getnode(removed, app))
+        return 0;
+    if (pending && ppmT_getnode(pending, app))
+        return 1;
+    return ppmD_has(ppm_vault, app);
+}
+
+static unsigned int
+add(size_t argc, char **args)
+{
+    char *app, *pass;
+    
+    app = args[0];
+    pass = args[1];
+    if (!validname(app))
+        return 0;
+    if (exists(app))
+    {
+        ppm_error("'%s%s%s' already exists, use '%supdate%s' to change the password", 
+                  PPMC(WHITE), app, PPMC(RED), PPMC(WHITE), PPMC(RED));
+        return 0;
+    }
+    if (pending)
+    {
+        ppmT_remove(removed, app);
+        ppmT_insert(pending, app, pass);
+    }
+    else
+    {
+        if (!ppmD_put(ppm_vault, app, pass))
+            return 0;
+        if (ppm_autosave) ppmD_savebg(ppm_vault);
+    }
+    ppm_message("'%s%s%s' added", PPMC(WHITE), app, PPMC(GREEN));
+    return 1;
+}
+
+static unsigned int
+update(size_t argc, char **args)
+{
+    char *app, *pass;
+
+    app = args[0];
+    pass = args[1];
+    if (!exists(app))
+    {
+        ppm_error("%s%s%s not found, use '%sadd%s' to add a new user", 
+                  PPMC(WHITE), app, PPMC(RED), PPMC(WHITE), PPMC(RED));
+        return 0;
+    }
+    if (pending)
+    {
+        ppmT_remove(removed, app);
+        ppmT_insert(pending, app, pass);
+    }
+    else
+    {
+        if (!ppmD_put(ppm_vault, app, pass))
+            return 0;
+        if (ppm_autosave) ppmD_savebg(ppm_vault);
+    }
+    ppm_message("'%s%s%s' updated", PPMC(WHITE), app, PPMC(GREEN));
+    return 1;
+}
+
+static unsigned int
+get(size_t argc, char **args)
+{
+    char *app, *pass;
+    
+    /* Once a user is known to exist, not finding a password means it
+       couldn't be read. */
+    app = args[0];
+    if (!exists(app))
+        return 1;
+    pass = lookup(app);
+    if (!pass)
+        return 0;
+    fprintf(PPM_OUT, "%s\n", pass);
+    return 1;
+}
+
+static void
+printnode(ppm_Node *node, void *arg)
+{
+    fprintf(PPM_OUT, "%s%s%s => %s%s%s\n", 
+            PPMC(WHITE), node->key,   PPMC(GREEN),
+            PPMC(BLUE),  node->value, PPMC(NONE));
+}
+
+static void
+printname(const char *name, void *arg)
+{
+    fprintf(PPM_OUT, "%s\n", name);
+}
+
+static unsigned int
+list(size_t argc, char **args)
+{
+    const char *tag = NULL;
+    unsigned int names = 0;
+    size_t i;
+
+    for (i = 0; i < argc; i++)
+    {
+        if (strcmp(args[i], "--names") == 0)
+            names = 1;
+        else
+        if (strcmp(args[i], "--tag") == 0 && !tag)
+        {
+            if (i + 1 >= argc)
+            {
+                ppm_error("no argument provided for '%s'", args[i]);
+                return 0;
+            }
+            tag = args[++i];
+        }
+        else
+        {
+            ppm_error("unexpected argument '%s', see '%shelp list%s'", 
+                      args[i], PPMC(WHITE), PPMC(RED));
+            return 0;
+        }
+    }
+    if (names && tag)
+    {
+        ppm_error("'--names' can't be combined with '--tag'");
+        return 0;
+    }
+
+    /* Names only need the index, the passwords stay encrypted. */
+    if (names)
+        ppmD_names(ppm_vault, printname, NULL);
+    else
+    if (tag)
+        return ppmD_tagged(ppm_vault, tag, printnode, NULL);
+    return ppmD_foreach(ppm_vault, printnode, NULL);
+}
+
+static unsigned int
+bye(size_t argc, char **args)
+{
+    ppm_cleanup();
+    exit(EXIT_SUCCESS);
+}
+
+static unsigned int
+save(size_t argc, char **args)
+{
+    if (!ppmD_dirty(ppm_vault))
+    {
+        fprintf(PPM_OUT, "no changes to save\n");
+        return 1;
+    }
+    if (ppmD_save(ppm_vault))
+    {
+        fprintf(PPM_OUT, "saved!\n");
+        return 1;
+    }
+    return 0;
+}
+
+static unsigned int
+rm(size_t argc, char **args)
+{
+    char *app;
+    
+    app = args[0];
+    if (!exists(app))
+    {
+        ppm_error("'%s%s%s' not found", PPMC(WHITE), app, PPMC(RED));
+        return 0;
+    }
+    if (pending)
+    {
+        ppmT_remove(pending, app);
+        ppmT_insert(removed, app, "");
+    }
+    else
+    {
+        if (!ppmD_remove(ppm_vault, app))
+            return 0;
+        ppmD_detach(ppm_vault, app);
+        if (ppm_autosave) ppmD_savebg(ppm_vault);
+    }
+    ppm_message("'%s%s%s' deleted", PPMC(WHITE), app, PPMC(GREEN));
+    return 1;
+}
+
+static unsigned int
+begin(size_t argc, char **args)
+{
+    if (pending)
+    {
+        ppm_error("a transaction is already in progress");
+        return 0;
+    }
+    pending = ppmT_new(32);
+    removed = ppmT_new(32);
+    ppm_message("transaction started, changes apply on '%scommit%s'", PPMC(WHITE), PPMC(GREEN));
+    return 1;
+}
+
+static void
+freeundo(Undo *undo, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        free(undo[i].node.key);
+        free(undo[i].node.value);
+        free(undo[i].node.tags);
+    }
+    free(undo);
+}
+
+static void
+endtxn(void)
+{
+    ppmT_free(pending);
+    ppmT_free(removed);
+    pending = removed = NULL;
+}
+
+/* Applies the changes in table, pass says whether they are passwords
+   or removals, noting in undo how to take them back and counting them
+   in n. Stops at the first change that can't be made. */
+static unsigned int
+apply(ppm_Table *table, unsigned int pass, Undo *undo, size_t *n)
+{
+    ppm_Node *node, *old;
+    unsigned int done;
+    size_t i;
+
+    for (i = 0; i < table->size; i++)
+    {
+        for (node = table->nodes[i]; node; node = node->next)
+        {
+            Undo *u = undo + *n;
+
+            old = ppmD_getnode(ppm_vault, node->key);
+            u->existed = old != NULL;
+            u->node = old ? *old : *node;
+            u->node.key = ppmM_strdup(node->key);
+            u->node.value = old ? ppmM_strdup(old->value) : NULL;
+            u->node.tags = (old && old->tags) ? ppmM_strdup(old->tags) : NULL;
+
+            if (pass)
+                done = ppmD_put(ppm_vault, node->key, node->value);
+            else
+                done = ppmD_remove(ppm_vault, node->key) 
+                    || !ppmD_has(ppm_vault, node->key);
+            if (!done)
+            {
+                free(u->node.key);
+                free(u->node.value);
+                free(u->node.tags);
+                return 0;
+            }
+            (*n)++;
+        }
+    }
+    return 1;
+}
+
+static unsigned int
+commit(size_t argc, char **args)
+{
+    Undo *undo;
+    size_t i, n;
+    unsigned int ok;
+
+    if (!pending)
+    {
+        ppm_error("no transaction in progress");
+        return 0;
+    }
+
+    /* Every change was checked when it was made, applying them only
+       fails on entries that can't be read. Should that or saving fail,
+       the entries are put back the way they were. */
+    undo = ppmM_alloc((pending->count + removed->count + 1) * sizeof(Undo));
+    n = 0;
+    ok = apply(pending, 1, undo, &n) && apply(removed, 0, undo, &n);
+    if (ok)
+        ok = !ppm_autosave || ppmD_save(ppm_vault);
+    if (!ok)
+    {
+        for (i = n; i-- > 0;)
+        {
+            if (undo[i].existed)
+                ppmD_copy(ppm_vault, &undo[i].node);
+            else
+                ppmD_remove(ppm_vault, undo[i].node.key);
+        }
+        ppm_error("commit failed, no changes were applied");
+    }
+    else
+    {
+        /* Attachments can't be put back, they go once nothing can. */
+        for (i = 0; i < n; i++)
+        {
+            if (undo[i].existed && !ppmD_has(ppm_vault, undo[i].node.key))
+                ppmD_detach(ppm_vault, undo[i].node.key);
+        }
+        ppm_message("%lu changes committed", (unsigned long)n);
+    }
+
+    freeundo(undo, n);
+    endtxn();
+    return ok;
+}
+
+static unsigned int
+abort_(size_t argc, char **args)
+{
+    if (!pending)
+    {
+        ppm_error("no transaction in progress");
+        return 0;
+    }
+    ppm_message("transaction aborted, %lu changes discarded", 
+                (unsigned long)(pending->count + removed->count));
+    endtxn();
+    return 1;
+}
+
+static unsigned int
+settags(const char *cmd, size_t argc, char **args, unsigned int add)
+{
+    size_t i;
+
+    if (!notintxn(cmd)) return 0;
+    if (argc < 2)
+    {
+        ppm_error("'%s' expects a user and at least one tag, see '%shelp %s%s'", 
+                  cmd, PPMC(WHITE), cmd, PPMC(RED));
+        return 0;
+    }
+    for (i = 1; i < argc; i++)
+    {
+        if (!*args[i] || strpbrk(args[i], ",\t\n"))
+        {
+            ppm_error("invalid tag '%s', tags can't be empty or contain commas", args[i]);
+            return 0;
+        }
+    }
+    if (!ppmD_has(ppm_vault, args[0]))
+    {
+        ppm_error("'%s%s%s' not found", PPMC(WHITE), args[0], PPMC(RED));
+        return 0;
+    }
+    for (i = 1; i < argc; i++)
+    {
+        if (!ppmD_tag(ppm_vault, args[0], args[i], add))
+            return 0;
+    }
+    if (ppm_autosave) ppmD_savebg(ppm_vault);
+    return 1;
+}
+
+static unsigned int
+tag(size_t argc, char **args)
+{
+    return settags("tag", argc, args, 1);
+}
+
+static unsigned int
+untag(size_t argc, char **args)
+{
+    return settags("untag", argc, args, 0);
+}
+
+static unsigned int
+parsenum(const char *opt, const char *arg, unsigned long *n)
+{
+    char *end;
+
+    if (!arg)
+    {
+        ppm_error("no argument provided for '%s'", opt);
+        return 0;
+    }
+    *n = strtoul(arg, &end, 10);
+    if (*arg == '-' || *end || *n == 0)
+    {
+        ppm_error("invalid value for '%s': %s", opt, arg);
+        return 0;
+    }
+    return 1;
+}
+
+static double
+elapsed(const struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static unsigned int
+gen(size_t argc, char **args)
+{
+    unsigned long length = PPM_GEN_LENGTH;
+    unsigned long count = 0, added = 0, i;
+    const char *app = NULL, *prefix = NULL;
+    const char *charset;
+    char *setname = NULL;
+    char pass[PPM_GEN_MAXLEN + 1];
+    char *key;
+    struct timespec start;
+    unsigned int isnew;
+    double secs;
+
+    if (!notintxn("gen")) return 0;
+    for (i = 0; i < argc; i++)
+    {
+        char *arg = args[i];
+        char *next = (i + 1 < argc) ? args[i + 1] : NULL;
+
+        if (strcmp(arg, "--length") == 0)
+        {
+            if (!parsenum(arg, next, &length)) return 0;
+            i++;
+        }
+        else
+        if (strcmp(arg, "--count") == 0)
+        {
+            if (!parsenum(arg, next, &count)) return 0;
+            i++;
+        }
+        else
+        if (strcmp(arg, "--charset") == 0 || strcmp(arg, "--prefix") == 0)
+        {
+            if (!next)
+            {
+                ppm_error("no argument provided for '%s'", arg);
+                return 0;
+            }
+            if (arg[2] == 'c')
+                setname = next;
+            else
+                prefix = next;
+            i++;
+        }
+        else
+        if (strncmp(arg, "--", 2) == 0 || app)
+        {
+            ppm_error("unexpected argument '%s', see '%shelp gen%s'", 
+                      arg, PPMC(WHITE), PPMC(RED));
+            return 0;
+        }
+        else
+            app = arg;
+    }
+
+    if (!app == !count || (app && prefix) || (count && !prefix))
+    {
+        ppm_error("'gen' expects either a user or '--count' with '--prefix', see '%shelp gen%s'",
+                  PPMC(WHITE), PPMC(RED));
+        return 0;
+    }
+    if (!validname(app ? app : prefix))
+        return 0;
+    if (length > PPM_GEN_MAXLEN)
+    {
+        ppm_error("password length can't exceed %d", PPM_GEN_MAXLEN);
+        return 0;
+    }
+    charset = ppmG_charset(setname);
+    if (!charset)
+    {
+        ppm_error("invalid charset '%s'", setname);
+        return 0;
+    }
+
+    if (app)
+    {
+        if (!ppmG_password(pass, length, charset))
+            return 0;
+        if (!ppmD_put(ppm_vault, app, pass))
+        {
+            memset(pass, 0, sizeof(pass));
+            return 0;
+        }
+        fprintf(PPM_OUT, "%s\n", pass);
+        memset(pass, 0, sizeof(pass));
+        if (ppm_autosave) ppmD_savebg(ppm_vault);
+        return 1;
+    }
+
+    key = ppmM_alloc(strlen(prefix) + 21);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 1; i <= count; i++)
+    {
+        if (!ppmG_password(pass, length, charset))
+            break;
+        sprintf(key, "%s%lu", prefix, i);
+        isnew = !ppmD_has(ppm_vault, key);
+        if (!ppmD_put(ppm_vault, key, pass))
+            break;
+        added += isnew;
+    }
+    secs = elapsed(&start);
+    memset(pass, 0, sizeof(pass));
+    free(key);
+
+    ppm_message("%lu passwords generated (%lu added, %lu updated) in %.3fs, %.0f/s",
+                i - 1, added, i - 1 - added, secs, secs > 0 ? (i - 1) / secs : 0.0);
+    if (ppm_autosave) ppmD_savebg(ppm_vault);
+    return i > count;
+}
+
+static unsigned int
+import(size_t argc, char **args)
+{
+    const char *path = NULL, *ext;
+    int format = -1, policy = PPM_ISKIP;
+    ppm_ImportStats stats;
+    struct timespec start;
+    unsigned int ok;
+    FILE *in;
+    size_t i;
+
+    if (!notintxn("import")) return 0;
+    for (i = 0; i < argc; i++)
+    {
+        char *arg = args[i];
+        char *next = (i + 1 < argc) ? args[i + 1] : NULL;
+
+        if (strcmp(arg, "--format") == 0 || strcmp(arg, "--on-conflict") == 0)
+        {
+            int *opt = (arg[2] == 'f') ? &format : &policy;
+
+            if (!next)
+            {
+                ppm_error("no argument provided for '%s'", arg);
+                return 0;
+            }
+            *opt = (opt == &format) ? ppmI_format(next) : ppmI_policy(next);
+            if (*opt < 0)
+            {
+                ppm_error("invalid value for '%s': %s", arg, next);
+                return 0;
+            }
+            i++;
+        }
+        else
+        if (path || (strncmp(arg, "--", 2) == 0))
+        {
+            ppm_error("unexpected argument '%s', see '%shelp import%s'", 
+                      arg, PPMC(WHITE), PPMC(RED));
+            return 0;
+        }
+        else
+            path = arg;
+    }
+    if (!path)
+    {
+        ppm_error("'import' expects a file, see '%shelp import%s'", PPMC(WHITE), PPMC(RED));
+        return 0;
+    }
+
+    if (format < 0)
+    {
+        ext = strrchr(path, '.');
+        format = ext ? ppmI_format(ext + 1) : -1;
+        if (format < 0) format = PPM_FTSV;
+    }
+
+    if (serving && strcmp(path, "-") == 0)
+    {
+        ppm_error("stdin holds the requests, import from a file");
+        return 0;
+    }
+    in = (strcmp(path, "-") == 0) ? stdin : fopen(path, "rb");
+    if (!in)
+    {
+        ppm_error("failed to open %s", path);
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ok = ppmI_import(ppm_vault, in, format, policy, &stats);
+    if (in != stdin) fclose(in);
+
+    ppm_message("%lu added, %lu updated, %lu skipped, %lu invalid in %.3fs%s", 
+                stats.added, stats.updated, stats.skipped, stats.invalid, elapsed(&start),
+                ok ? "" : ", import stopped");
+    if (ppm_autosave) ppmD_savebg(ppm_vault);
+    return ok;
+}
+
+static unsigned int
+export(size_t argc, char **args)
+{
+    const char *path = "-", *key = NULL, *ext;
+    int format = -1, fd;
+    unsigned long count;
+    struct timespec start;
+    unsigned int ok, havepath = 0;
+    FILE *out;
+    size_t i;
+
+    for (i = 0; i < argc; i++)
+    {
+        char *arg = args[i];
+        char *next = (i + 1 < argc) ? args[i + 1] : NULL;
+
+        if (strcmp(arg, "--format") == 0 || strcmp(arg, "--key") == 0)
+        {
+            if (!next)
+            {
+                ppm_error("no argument provided for '%s'", arg);
+                return 0;
+            }
+            if (arg[2] == 'k')
+                key = next;
+            else
+            if ((format = ppmE_format(next)) < 0)
+            {
+                ppm_error("invalid value for '%s': %s", arg, next);
+                return 0;
+            }
+            i++;
+        }
+        else
+        if (havepath || (strncmp(arg, "--", 2) == 0))
+        {
+            ppm_error("unexpected argument '%s', see '%shelp export%s'", 
+                      arg, PPMC(WHITE), PPMC(RED));
+            return 0;
+        }
+        else
+        {
+            path = arg;
+            havepath = 1;
+        }
+    }
+
+    if (format < 0)
+    {
+        ext = strrchr(path, '.');
+        format = ext ? ppmE_format(ext + 1) : -1;
+        if (format < 0) format = PPM_ETSV;
+    }
+    if (key && format != PPM_EVAULT)
+    {
+        ppm_error("'--key' only applies to the vault format");
+        return 0;
+    }
+
+    /* Exports hold every password in the clear, keep them private. */
+    if (strcmp(path, "-") == 0)
+        out = PPM_OUT;
+    else
+    {
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        out = (fd < 0) ? NULL : fdopen(fd, "wb");
+        if (!out)
+        {
+            if (fd >= 0) close(fd);
+            ppm_error("failed to open %s", path);
+            return 0;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ok = ppmE_export(ppm_vault, out, format, key ? key : ppm_cipherkey, &count);
+    if (out == PPM_OUT)
+        return ok;
+    if (fclose(out) != 0 && ok)
+    {
+        ppm_error("failed to write %s", path);
+        ok = 0;
+    }
+    if (ok)
+        ppm_message("%lu passwords exported to %s in %.3fs", count, path, elapsed(&start));
+    return ok;
+}
+
+static unsigned int
+attach(size_t argc, char **args)
+{
+    FILE *in;
+    unsigned int ok;
+
+    if (!notintxn("attach")) return 0;
+    if (!ppmD_has(ppm_vault, args[0]))
+    {
+        ppm_error("'%s%s%s' not found, use '%sadd%s' to add it first", 
+                  PPMC(WHITE), args[0], PPMC(RED), PPMC(WHITE), PPMC(RED));
+        return 0;
+    }
+    if (serving && strcmp(args[1], "-") == 0)
+    {
+        ppm_error("stdin holds the requests, attach a file");
+        return 0;
+    }
+    in = (strcmp(args[1], "-") == 0) ? stdin : fopen(args[1], "rb");
+    if (!in)
+    {
+        ppm_error("failed to open %s", args[1]);
+        return 0;
+    }
+    ok = ppmD_attach(ppm_vault, args[0], in);
+    if (in != stdin) fclose(in);
+    if (ok)
+        ppm_message("%s attached to '%s%s%s'", in == stdin ? "stdin" : args[1], 
+                    PPMC(WHITE), args[0], PPMC(GREEN));
+    return ok;
+}
+
+static unsigned int
+extract(size_t argc, char **args)
+{
+    FILE *out;
+    int fd;
+    unsigned int ok;
+
+    if (strcmp(args[1], "-") == 0)
+    {
+        /* Responses are lines of JSON, there's no room for a file. */
+        if (serving)
+        {
+            ppm_error("responses can't hold an attachment, extract to a file");
+            return 0;
+        }
+        return ppmD_extract(ppm_vault, args[0], PPM_OUT);
+    }
+
+    /* Attachments are as private as the passwords. A file only written
+       in part is removed again. */
+    fd = open(args[1], O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    out = (fd < 0) ? NULL : fdopen(fd, "wb");
+    if (!out)
+    {
+        if (fd >= 0) close(fd);
+        ppm_error("failed to open %s", args[1]);
+        return 0;
+    }
+    ok = ppmD_extract(ppm_vault, args[0], out);
+    if (fclose(out) != 0 && ok)
+    {
+        ppm_error("failed to write %s", args[1]);
+        ok = 0;
+    }
+    if (!ok)
+        unlink(args[1]);
+    return ok;
+}
+
+/* Shared by diff and merge, policy is NULL for diff. */
+static unsigned int
+parseother(const char *cmd, size_t argc, char **args, char **path, char **key, int *policy)
+{
+    size_t i;
+
+    *path = NULL;
+    *key = ppm_cipherkey;
+    for (i = 0; i < argc; i++)
+    {
+        char *arg = args[i];
+        char *next = (i + 1 < argc) ? args[i + 1] : NULL;
+
+        if (strcmp(arg, "--key") == 0 || (policy && strcmp(arg, "--on-conflict") == 0))
+        {
+            if (!next)
+            {
+                ppm_error("no argument provided for '%s'", arg);
+                return 0;
+            }
+            if (arg[2] == 'k')
+                *key = next;
+            else
+            if ((*policy = ppmH_policy(next)) < 0)
+            {
+                ppm_error("invalid value for '%s': %s", arg, next);
+                return 0;
+            }
+            i++;
+        }
+        else
+        if (*path || (strncmp(arg, "--", 2) == 0))
+        {
+            ppm_error("unexpected argument '%s', see '%shelp %s%s'", 
+                      arg, PPMC(WHITE), cmd, PPMC(RED));
+            return 0;
+        }
+        else
+            *path = arg;
+    }
+    if (!*path)
+    {
+        ppm_error("'%s' expects a vault, see '%shelp %s%s'", cmd, PPMC(WHITE), cmd, PPMC(RED));
+        return 0;
+    }
+    return 1;
+}
+
+static int
+cmpmodified(const void *a, const void *b)
+{
+    const ppm_Node *na = *(ppm_Node * const *)a, *nb = *(ppm_Node * const *)b;
+
+    return na->modified < nb->modified ? -1 : na->modified > nb->modified;
+}
+
+typedef struct
+{
+    ppm_Node **nodes;
+    size_t count;
+    size_t cap;
+}
+NodeList;
+
+static void
+collect(ppm_Node *node, void *arg)
 {
-    char *app, *pass;
-    
-    app = args[0];
-    pass = args[1];
-    ppmD_add(app, pass);
-    if (ppm_autosave) ppmD_save();
-    return 1;
+    NodeList *list = arg;
+
+    if (list->count == list->cap)
+    {
+        list->cap = list->cap ? list->cap * 2 : 64;
+        list->nodes = ppmM_realloc(list->nodes, list->cap * sizeof(ppm_Node *));
+    }
+    list->nodes[list->count++] = node;
 }
 
 static unsigned int
-update(size_t argc, char **args)
+stale(size_t argc, char **args)
 {
-    char *app, *pass;
+    unsigned long days = 90;
+    NodeList list;
+    time_t now = time(NULL);
+    struct tm tm;
+    char date[16];
+    size_t i;
 
-    app = args[0];
-    pass = args[1];
-    ppmD_update(app, pass);
-    if (ppm_autosave) ppmD_save();
+    for (i = 0; i < argc; i++)
+    {
+        if (strcmp(args[i], "--days") == 0)
+        {
+            if (!parsenum(args[i], i + 1 < argc ? args[i + 1] : NULL, &days)) return 0;
+            i++;
+        }
+        else
+        {
+            ppm_error("unexpected argument '%s', see '%shelp stale%s'", 
+                      args[i], PPMC(WHITE), PPMC(RED));
+            return 0;
+        }
+    }
+
+    /* Only entries older than the cutoff are visited, oldest first. */
+    memset(&list, 0, sizeof(list));
+    if (!ppmD_stale(ppm_vault, now - (time_t)days * 86400, collect, &list))
+    {
+        free(list.nodes);
+        return 0;
+    }
+    qsort(list.nodes, list.count, sizeof(ppm_Node *), cmpmodified);
+    for (i = 0; i < list.count; i++)
+    {
+        ppm_Node *node = list.nodes[i];
+
+        localtime_r(&node->modified, &tm);
+        strftime(date, sizeof(date), "%Y-%m-%d", &tm);
+        fprintf(PPM_OUT, "%s%s%s => %s%s (%ld days)%s\n", 
+               PPMC(WHITE), node->key, PPMC(GREEN),
+               PPMC(BLUE), date, (long)((now - node->modified) / 86400), PPMC(NONE));
+    }
+    free(list.nodes);
     return 1;
 }
 
 static unsigned int
-get(size_t argc, char **args)
+diff(size_t argc, char **args)
 {
-    char *app, *pass;
-    
-    app = args[0];
-    pass = ppmD_get(app);
-    if (pass) puts(pass);
-    return 1;
+    char *path, *key;
+
+    if (!parseother("diff", argc, args, &path, &key, NULL))
+        return 0;
+    return ppmH_diff(ppm_vault, path, key);
 }
 
 static unsigned int
-list(size_t argc, char **args)
+merge(size_t argc, char **args)
 {
-    ppmD_list();
+    char *path, *key;
+    int policy = PPM_MNEWER;
+
+    if (!notintxn("merge")) return 0;
+    if (!parseother("merge", argc, args, &path, &key, &policy))
+        return 0;
+    if (serving && policy == PPM_MASK)
+    {
+        ppm_error("'ask' reads answers from stdin, which holds the requests");
+        return 0;
+    }
+    if (!ppmH_merge(ppm_vault, path, key, policy))
+        return 0;
+    if (ppm_autosave) ppmD_savebg(ppm_vault);
     return 1;
 }
 
 static unsigned int
-bye(size_t argc, char **args)
+audit(size_t argc, char **args)
 {
-    ppm_cleanup();
-    exit(EXIT_SUCCESS);
+    const char *breached = NULL;
+    unsigned int bloom = 0;
+    size_t i;
+
+    for (i = 0; i < argc; i++)
+    {
+        if (strcmp(args[i], "--breached") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                ppm_error("no argument provided for '%s'", args[i]);
+                return 0;
+            }
+            breached = args[++i];
+        }
+        else
+        if (strcmp(args[i], "--bloom") == 0)
+            bloom = 1;
+        else
+        {
+            ppm_error("unexpected argument '%s', see '%shelp audit%s'", 
+                      args[i], PPMC(WHITE), PPMC(RED));
+            return 0;
+        }
+    }
+
+    if (bloom && !breached)
+    {
+        ppm_error("'--bloom' needs a list of hashes, use '--breached <file>'");
+        return 0;
+    }
+    return ppmU_audit(ppm_vault, breached, bloom);
+}
+
+static void
+printstat(const char *name, unsigned long value)
+{
+    fprintf(PPM_OUT, "%s%-18s%s%lu%s\n", PPMC(WHITE), name, PPMC(BLUE), value, PPMC(NONE));
+}
+
+static void
+printratio(const char *name, size_t n, size_t d)
+{
+    fprintf(PPM_OUT, "%s%-18s%s%.2f%s\n", PPMC(WHITE), name, PPMC(BLUE), 
+           d ? (double)n / d : 0.0, PPMC(NONE));
+}
+
+/* How evenly the keys are spread over the buckets. A miss compares
+   against a whole chain, so its average is also the load factor. */
+static void
+tablestats(const ppm_TableStats *ts)
+{
+    char name[32];
+    unsigned int i;
+
+    printstat("entries", ts->entries);
+    printstat("buckets", ts->buckets);
+    printratio("load factor", ts->entries, ts->buckets);
+    printstat("longest chain", ts->longest);
+    printratio("compares per hit", ts->hits, ts->entries);
+    printratio("compares per miss", ts->misses, ts->buckets);
+    printratio("bytes per entry", ts->bytes, ts->entries);
+    for (i = 0; i < PPM_CHAINS; i++)
+    {
+        sprintf(name, "chains of %u%s", i, i == PPM_CHAINS - 1 ? "+" : "");
+        printstat(name, ts->chains[i]);
+    }
 }
 
 static unsigned int
-save(size_t argc, char **args)
+stats(size_t argc, char **args)
 {
-    if (ppmD_save())
+    ppm_TableStats ts;
+    unsigned int mem = 0, table = 0;
+    size_t i;
+
+    for (i = 0; i < argc; i++)
+    {
+        if (strcmp(args[i], "--mem") == 0)
+            mem = 1;
+        else if (strcmp(args[i], "--table") == 0)
+            table = 1;
+        else
+        {
+            ppm_error("unexpected argument '%s', see '%shelp stats%s'", 
+                      args[i], PPMC(WHITE), PPMC(RED));
+            return 0;
+        }
+    }
+
+    if (mem)
+    {
+        if (!ppmM_tracking())
+        {
+            ppm_error("allocations aren't counted, run ppm with PPM_MEMSTATS=1 set");
+            return 0;
+        }
+        ppmM_stats(PPM_OUT);
+        if (!table)
+            return 1;
+    }
+
+    if (!ppmD_stats(ppm_vault, &ts))
+        return 0;
+    if (table)
     {
-        printf("saved!\n");
+        tablestats(&ts);
         return 1;
     }
-    return 0;
+    printstat("entries", ts.entries);
+    printstat("distinct values", ts.values);
+    printstat("value bytes", ts.valuebytes);
+    printstat("bytes saved", ts.saved);
+    return 1;
 }
 
 static unsigned int
-rm(size_t argc, char **args)
+addkey(size_t argc, char **args)
 {
-    char *app;
-    
-    app = args[0];
-    ppmD_rm(app);
-    if (ppm_autosave) ppmD_save();
+    if (!ppmD_addkey(ppm_vault, args[0]))
+        return 0;
+    ppm_message("key added, %u of %d key slots in use", 
+                ppmD_keycount(ppm_vault), PPM_MAXKEYS);
+    return 1;
+}
+
+static unsigned int
+rmkey(size_t argc, char **args)
+{
+    if (!ppmD_rmkey(ppm_vault, args[0]))
+        return 0;
+    ppm_message("key removed, %u of %d key slots in use", 
+                ppmD_keycount(ppm_vault), PPM_MAXKEYS);
+    return 1;
+}
+
+static unsigned int
+rekey(size_t argc, char **args)
+{
+    if (!ppmD_rekey(ppm_vault, args[0]))
+        return 0;
+    ppm_message("key changed");
     return 1;
 }
 
 typedef struct
 {
     char *name;
-    Function *f;
+    CommandFunc *f;
     int argc;
     char *descr;
     char *usage;
@@ -131,9 +1180,33 @@ static Command commands[] =
 {
     { "add", add, 2, "add a new password", "add <user> <password>" },
     { "update", update, 2, "update a user", "update <user> <password>" },
-    { "list", list, 0, "list all passwords", "list" },
+    { "list", list, -1, "list all passwords, those with a tag or only the names", "list [--tag <tag>|--names]" },
+    { "tag", tag, -1, "add tags to a user", "tag <user> <tag>..." },
+    { "attach", attach, 2, "store a file with a user, encrypted", "attach <user> <file>" },
+    { "extract", extract, 2, "write the file stored with a user", "extract <user> <file>" },
+    { "untag", untag, -1, "remove tags from a user", "untag <user> <tag>..." },
+    { "stale", stale, -1, "list passwords not changed in a number of days", "stale [--days <n>]" },
     { "get", get, 1, "get a password for a specific user", "get <user>" },
     { "rm", rm, 1, "remove a user from the database", "rm <user>" },
+    { "gen", gen, -1, "generate random passwords", 
+      "gen <user> | --count <n> --prefix <prefix> [--length <n>] [--charset <digit|hex|alpha|alnum|print|chars>]" },
+    { "import", import, -1, "import passwords from a TSV, CSV or JSON file", 
+      "import <file|-> [--format <tsv|csv|json>] [--on-conflict <skip|overwrite|fail>]" },
+    { "export", export, -1, "export passwords as TSV, CSV, JSON Lines or a vault copy", 
+      "export [file|-] [--format <tsv|csv|jsonl|vault>] [--key <key>]" },
+    { "audit", audit, -1, "report weak, reused and breached passwords",
+      "audit [--breached <file>] [--bloom]" },
+    { "stats", stats, -1, "show how the passwords are stored in memory", "stats [--mem|--table]" },
+    { "diff", diff, -1, "show the entries that differ from another vault", 
+      "diff <vault> [--key <key>]" },
+    { "merge", merge, -1, "merge another vault into this one", 
+      "merge <vault> [--key <key>] [--on-conflict <newer|ours|theirs|ask>]" },
+    { "begin", begin, 0, "start a transaction, changes apply together on commit", "begin" },
+    { "commit", commit, 0, "apply and save the changes made since begin", "commit" },
+    { "abort", abort_, 0, "discard the changes made since begin", "abort" },
+    { "addkey", addkey, 1, "give another key access to the database", "addkey <key>" },
+    { "rmkey", rmkey, 1, "revoke a key's access to the database", "rmkey <key>" },
+    { "rekey", rekey, 1, "change the key in use", "rekey <newkey>" },
     { "bye", bye, 0, "exit this program", "bye" },
     { "help", help, -1, "display a list of possible commands", "help [command]" },
     { "save",  save, -1, "save the list of passwords", "save" },
@@ -148,14 +1221,14 @@ help(size_t argc, char **args)
     if (argc == 0)
     {
         ppm_usage();
-        fprintf(stdout, "%sThe following commands are available: \n", PPMC(BLUE));
+        fprintf(PPM_OUT, "%sThe following commands are available: \n", PPMC(BLUE));
     }
     for (i = 0; commands[i].name; i++)
     {
         Command *cmd = commands + i;
         if (argc == 0)
         {
-            printf("%s* %s%s%s: %s%s%s\n", 
+            fprintf(PPM_OUT, "%s* %s%s%s: %s%s%s\n", 
                     PPMC(RED), PPMC(CYAN),  cmd->name, 
                     PPMC(BLUE), PPMC(CYAN), cmd->descr, 
                     PPMC(NONE));
@@ -166,12 +1239,12 @@ help(size_t argc, char **args)
             if (strcmp(cmd->name, args[j]) != 0)
                 continue;
 
-            printf("%s* %s%s%s: %s%s%s\n", 
+            fprintf(PPM_OUT, "%s* %s%s%s: %s%s%s\n", 
                     PPMC(RED), PPMC(CYAN),  cmd->name, 
                     PPMC(BLUE), PPMC(CYAN), cmd->descr, 
                     PPMC(NONE));
 
-            fprintf(stdout, "  %susage%s: %s%s%s\n",
+            fprintf(PPM_OUT, "  %susage%s: %s%s%s\n",
                     PPMC(RED), PPMC(BLUE), PPMC(CYAN), 
                     cmd->usage, PPMC(NONE));
         }
@@ -232,6 +1305,42 @@ completion_cmd(const char *text, int state)
     return NULL;
 }
 
+/* Names starting with the text being completed, each followed by a
+   '\0'. */
+static ppm_String names;
+static const char *prefix;
+
+static void
+matchname(const char *name, void *arg)
+{
+    if (strncmp(name, prefix, strlen(prefix)) != 0) 
+        return;
+    ppmS_append(&names, name);
+    ppmS_addch(&names, '\0');
+}
+
+/* Names are completed from the index, no password is decrypted. */
+static char *
+completion_name(const char *text, int state)
+{
+    static const char *next;
+
+    if (!state)
+    {
+        free(names.cstr);
+        ppmS_init(&names, NULL);
+        prefix = text;
+        if (ppm_vault)
+            ppmD_names(ppm_vault, matchname, NULL);
+        next = names.cstr;
+    }
+    if (next >= names.cstr + names.len)
+        return NULL;
+    text = next;
+    next += strlen(next) + 1;
+    return ppmM_strdup(text);
+}
+
 static char **
 completion(const char *text, int start, int end)
 {
@@ -240,6 +1349,8 @@ completion(const char *text, int start, int end)
     matches = NULL;
     if (start == 0)
         matches = rl_completion_matches(text, completion_cmd);
+    else
+        matches = rl_completion_matches(text, completion_name);
     return matches;
 }
 #endif
@@ -297,65 +1408,476 @@ ppmC_readline(void)
 #else
     line = getline(getprompt());
 #endif
+    if (!line) return NULL;
     return strip_whitespace(line);
 }
 
-unsigned int
-ppmC_command(int argc, char **args)
+/* Runs a command and tells why it failed, if it did. */
+static int
+run(int argc, char **args)
 {
     Command *cmd;
+    ppm_Vault *vault;
+    unsigned int ok;
+    struct timespec start;
 
     cmd = find_command(*args);
     if (!cmd)
     {
         ppm_error("unkown command: %s, type 'help' for a list of commands", *args);
-        return 0;
+        return PPM_EUNKNOWN;
     }
     
     if (cmd->argc >= 0 && argc != cmd->argc)
     {
         ppm_error("'%s' expects %d arguments, %d given", cmd->name, cmd->argc, argc);
-        return 0;
+        return PPM_EARGS;
+    }
+
+    /* Only help and bye work without a key. */
+    if (!ppm_vault && cmd->f != help && cmd->f != bye)
+    {
+        ppm_error("'%s' needs a key, use '-k'", cmd->name);
+        return PPM_ENOKEY;
     }
-        
-    return cmd->f(argc, args + 1);
+    if (!ppm_vault)
+        return cmd->f(argc, args + 1) ? PPM_OK : PPM_EFAILED;
+
+    /* The vault may be refreshed from disk while the command runs, the
+       entries it looks up stay valid until it's done. */
+    vault = ppm_vault;
+    ppmD_readbegin(vault);
+    ppmF_start(&start);
+    ok = cmd->f(argc, args + 1);
+    ppmF_stop(PPM_PHASE_COMMAND, &start);
+    ppmD_readend(vault);
+    return ok ? PPM_OK : PPM_EFAILED;
 }
 
 unsigned int
-ppmC_eval(const char *line)
+ppmC_command(int argc, char **args)
 {
-    char **args;
-    size_t argc = 0; 
-    size_t i = 0; 
-    size_t len;
-    unsigned int ret = 1;
+    return run(argc, args) == PPM_OK;
+}
+
+#define ISSPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\n')
+
+/* Splits line into at most max arguments, writing them back over line
+   as it goes: an argument never takes more room than its text did.
+   Quotes and backslashes work as in the shell, without expansions.
+   Returns the number of arguments, or -1 if line doesn't parse. */
+static int
+tokenize(char *line, char **args, size_t max)
+{
+    char *r = line, *w = line, quote;
+    size_t n = 0;
 
-    args = ppmM_alloc(sizeof(char *));
-    len = strlen(line) + 1;
-    args[0] = ppmM_alloc(len);
+    for (;;)
+    {
+        while (ISSPACE(*r)) r++;
+        if (!*r) break;
+        if (n == max)
+        {
+            ppm_error("too many arguments, at most %lu are allowed", (unsigned long)max - 1);
+            return -1;
+        }
+
+        args[n++] = w;
+        for (quote = '\0'; *r; r++)
+        {
+            if (quote == '\'')
+            {
+                if (*r == '\'') quote = '\0';
+                else *w++ = *r;
+            }
+            else if (*r == '\\' && r[1] && (!quote || strchr("\"\\$`", r[1])))
+                *w++ = *++r;
+            else if (quote == '"')
+            {
+                if (*r == '"') quote = '\0';
+                else *w++ = *r;
+            }
+            else if (*r == '\'' || *r == '"')
+                quote = *r;
+            else if (ISSPACE(*r))
+                break;
+            else
+                *w++ = *r;
+        }
+        if (quote)
+        {
+            ppm_error("missing closing %c", quote);
+            return -1;
+        }
+
+        /* Step past the separator before w can overwrite it. */
+        if (*r) r++;
+        *w++ = '\0';
+    }
+    return (int)n;
+}
+
+unsigned int
+ppmC_eval(char *line)
+{
+    char *args[MAXARGS + 1];
+    int argc;
+
+    argc = tokenize(line, args, MAXARGS);
+    if (argc < 0) return 0;
+    if (argc == 0) return 1;
+    args[argc] = NULL;
+    return ppmC_command(argc - 1, args);
+}
+
+/* Protocol mode. Requests are objects such as
+
+       {"id": 7, "command": "add", "args": ["niels", "secret"]}
+
+   each answered by one line holding the id, a code and status, the
+   lines the command printed and the messages and errors it reported:
+
+       {"id":7,"code":0,"status":"ok","output":[],"messages":["'niels' added"],"errors":[]}
+
+   The request line is decoded in place like a command line, the output
+   goes to memory streams reused by every request. */
+
+static const char *statuses[] = 
+{
+    "ok", "failed", "bad request", "unknown command", "wrong arguments", "no key"
+};
+
+static FILE *notes;
+static FILE *errors;
+
+static void
+putjson(FILE *out, const char *s, size_t len)
+{
+    size_t i;
+
+    putc('"', out);
+    for (i = 0; i < len; i++)
+    {
+        unsigned char c = s[i];
+
+        if (c == '"' || c == '\\')
+        {
+            putc('\\', out);
+            putc(c, out);
+        }
+        else if (c == '\n') fputs("\\n", out);
+        else if (c == '\t') fputs("\\t", out);
+        else if (c < 0x20) fprintf(out, "\\u%04x", c);
+        else putc(c, out);
+    }
+    putc('"', out);
+}
+
+static void
+report(unsigned int error, const char *text)
+{
+    FILE *out = error ? errors : notes;
+
+    if (ftell(out) > 0) putc(',', out);
+    putjson(out, text, strlen(text));
+}
+
+static char *
+skipws(char *p)
+{
+    while (ISSPACE(*p) || *p == '\r') p++;
+    return p;
+}
+
+static unsigned int
+hex4(const char *p, unsigned long *c)
+{
+    unsigned int i;
+
+    *c = 0;
+    for (i = 0; i < 4; i++)
+    {
+        if (!isxdigit((unsigned char)p[i])) return 0;
+        *c = *c * 16 + (isdigit((unsigned char)p[i]) ? p[i] - '0' : (tolower((unsigned char)p[i]) - 'a' + 10));
+    }
+    return 1;
+}
+
+static char *
+pututf8(char *w, unsigned long c)
+{
+    if (c < 0x80)
+        *w++ = (char)c;
+    else if (c < 0x800)
+    {
+        *w++ = (char)(0xc0 | c >> 6);
+        *w++ = (char)(0x80 | (c & 0x3f));
+    }
+    else if (c < 0x10000)
+    {
+        *w++ = (char)(0xe0 | c >> 12);
+        *w++ = (char)(0x80 | (c >> 6 & 0x3f));
+        *w++ = (char)(0x80 | (c & 0x3f));
+    }
+    else
+    {
+        *w++ = (char)(0xf0 | c >> 18);
+        *w++ = (char)(0x80 | (c >> 12 & 0x3f));
+        *w++ = (char)(0x80 | (c >> 6 & 0x3f));
+        *w++ = (char)(0x80 | (c & 0x3f));
+    }
+    return w;
+}
+
+/* Decodes the string whose opening quote p is at into itself, an escape
+   never decodes to more bytes than it took. Returns what follows the
+   closing quote, NULL if the string is invalid. */
+static char *
+jstring(char *p, char **out)
+{
+    char *w;
+    unsigned long c, lo;
 
-    for (; *line; line++)
+    if (*p++ != '"') return NULL;
+    *out = w = p;
+    while (*p != '"')
     {
-        if (*line == '\n') continue;
-        if (*line != ' ')
+        if ((unsigned char)*p < 0x20) return NULL;
+        if (*p != '\\')
         {
-            args[argc][i++] = *line;
+            *w++ = *p++;
             continue;
         }
-        
-        args[argc][i] = '\0';
-        argc++;
-        i = 0;
-        args = ppmM_realloc(args, sizeof(char *) * (argc + 1));
-        args[argc] = ppmM_alloc(len);
-        while (line[1] == ' ') line++;
+        switch (*++p)
+        {
+        case '"': case '\\': case '/': *w++ = *p; break;
+        case 'b': *w++ = '\b'; break;
+        case 'f': *w++ = '\f'; break;
+        case 'n': *w++ = '\n'; break;
+        case 'r': *w++ = '\r'; break;
+        case 't': *w++ = '\t'; break;
+        case 'u':
+            if (!hex4(p + 1, &c) || c == 0) return NULL;
+            p += 4;
+            if (c >= 0xd800 && c < 0xdc00 && p[1] == '\\' && p[2] == 'u' 
+             && hex4(p + 3, &lo) && lo >= 0xdc00 && lo < 0xe000)
+            {
+                c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+                p += 6;
+            }
+            w = pututf8(w, c);
+            break;
+        default:
+            return NULL;
+        }
+        p++;
+    }
+    *w = '\0';
+    return p + 1;
+}
+
+/* Steps over a number, true, false, null or string, left as it is. */
+static char *
+jscalar(char *p)
+{
+    if (*p == '"')
+    {
+        for (p++; *p != '"'; p++)
+        {
+            if ((unsigned char)*p < 0x20) return NULL;
+            if (*p == '\\' && !*++p) return NULL;
+        }
+        return p + 1;
+    }
+    if (!*p || !strchr("-0123456789tfn", *p)) return NULL;
+    while (isalnum((unsigned char)*p) || (*p && strchr("+-.", *p))) p++;
+    return p;
+}
+
+/* Reads a request into args, the command first. The id is left as it
+   was written, to be sent back. Returns the number of arguments or -1
+   if the request is invalid. */
+static int
+parserequest(char *p, char **args, size_t max, char **id, size_t *idlen)
+{
+    char *name, *command = NULL;
+    size_t n = 1;
+
+    *id = NULL;
+    p = skipws(p);
+    if (*p++ != '{') return -1;
+    p = skipws(p);
+    while (*p != '}')
+    {
+        if (!(p = jstring(p, &name))) return -1;
+        p = skipws(p);
+        if (*p++ != ':') return -1;
+        p = skipws(p);
+
+        if (strcmp(name, "command") == 0)
+        {
+            if (!(p = jstring(p, &command))) return -1;
+        }
+        else if (strcmp(name, "args") == 0)
+        {
+            if (*p++ != '[') return -1;
+            for (p = skipws(p); *p != ']'; )
+            {
+                if (n == max || !(p = jstring(p, args + n++))) return -1;
+                p = skipws(p);
+                if (*p == ',') p = skipws(p + 1);
+                else if (*p != ']') return -1;
+            }
+            p++;
+        }
+        else
+        {
+            char *start = p;
+
+            if (!(p = jscalar(p))) return -1;
+            if (strcmp(name, "id") == 0)
+            {
+                *id = start;
+                *idlen = p - start;
+            }
+        }
+
+        p = skipws(p);
+        if (*p == ',') p = skipws(p + 1);
+        else if (*p != '}') return -1;
+    }
+    if (!command || *skipws(p + 1)) return -1;
+    args[0] = command;
+    return (int)n;
+}
+
+/* Escapes in a request can put tabs and newlines in arguments no
+   command line could, the names among them are checked before the
+   command runs: the user of commands whose usage starts with one, the
+   user or prefix given to gen. Returns the first invalid name. */
+static const char *
+badname(int argc, char **args)
+{
+    Command *cmd = find_command(args[0]);
+    size_t len;
+    int i;
+
+    if (!cmd) return NULL;
+    if (cmd->f != gen)
+    {
+        len = strlen(cmd->name);
+        if (argc > 1 && strncmp(cmd->usage + len, " <user>", 7) == 0 
+            && !ppmD_validname(args[1]))
+            return args[1];
+        return NULL;
+    }
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(args[i], "--length") == 0 || strcmp(args[i], "--count") == 0 
+            || strcmp(args[i], "--charset") == 0)
+            i++;
+        else
+        {
+            if (strcmp(args[i], "--prefix") == 0 && ++i == argc) break;
+            if (!ppmD_validname(args[i])) return args[i];
+        }
     }
+    return NULL;
+}
 
-    args[argc][i] = '\0';
-    ret = ppmC_command(argc, args);
-    for (i = 0; i <= argc; i++)
-        free(args[i]);
-    free(args);
-    return ret;
+/* Sends the lines of text as a JSON array. */
+static void
+putlines(FILE *out, const char *text, size_t len)
+{
+    const char *end;
+
+    putc('[', out);
+    while (len > 0)
+    {
+        end = memchr(text, '\n', len);
+        if (!end) end = text + len;
+        putjson(out, text, end - text);
+        len -= end - text;
+        text = end;
+        if (len > 0)
+        {
+            text++;
+            if (--len > 0) putc(',', out);
+        }
+    }
+    putc(']', out);
 }
 
+void
+ppmC_serve(FILE *in)
+{
+    char *buf = NULL, *args[MAXARGS + 1], *id, *text, *msgs, *errs;
+    const char *name;
+    size_t size = 0, len, idlen, msglen, errlen;
+    FILE *output;
+    int argc, code;
+    unsigned int quit = 0;
+
+    output = open_memstream(&text, &len);
+    notes = open_memstream(&msgs, &msglen);
+    errors = open_memstream(&errs, &errlen);
+    if (!output || !notes || !errors)
+    {
+        ppm_error("failed to allocate output buffers");
+        return;
+    }
+    ppm_output = output;
+    ppm_report = report;
+    serving = 1;
+
+    while (!quit && getline(&buf, &size, in) != -1)
+    {
+        if (!*skipws(buf)) continue;
+        rewind(output);
+        rewind(notes);
+        rewind(errors);
+
+        argc = parserequest(buf, args, MAXARGS, &id, &idlen);
+        if (argc < 0)
+        {
+            ppm_error("invalid request, expected {\"command\": ..., \"args\": [...]}");
+            code = PPM_EREQUEST;
+        }
+        else
+        if ((name = badname(argc, args)))
+        {
+            ppm_error("invalid name '%s', names can't contain tabs or newlines", name);
+            code = PPM_EREQUEST;
+        }
+        else
+        {
+            /* bye would exit before answering, the caller cleans up. */
+            args[argc] = NULL;
+            quit = strcmp(args[0], "bye") == 0 && argc == 1;
+            code = quit ? PPM_OK : run(argc - 1, args);
+        }
+
+        fflush(output);
+        fflush(notes);
+        fflush(errors);
+        fputs("{\"id\":", stdout);
+        if (id) fwrite(id, 1, idlen, stdout);
+        else fputs("null", stdout);
+        printf(",\"code\":%d,\"status\":\"%s\",\"output\":", code, statuses[code]);
+        putlines(stdout, text, len);
+        printf(",\"messages\":[%.*s],\"errors\":[%.*s]}\n", 
+               (int)msglen, msgs, (int)errlen, errs);
+        fflush(stdout);
+    }
+
+    ppm_output = NULL;
+    ppm_report = NULL;
+    serving = 0;
+    fclose(output);
+    fclose(notes);
+    fclose(errors);
+    free(text);
+    free(msgs);
+    free(errs);
+    free(buf);
+}
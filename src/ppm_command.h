@@ -27,10 +27,28 @@
 #ifndef PPM_COMMAND_H
 #define PPM_COMMAND_H
 
-extern unsigned int ppmC_eval(const char * /* line */);
+#include <stdio.h>
+
+/* Outcome of a command, the code of a ppmC_serve response. */
+enum
+{
+    PPM_OK = 0,
+    PPM_EFAILED,
+    PPM_EREQUEST,
+    PPM_EUNKNOWN,
+    PPM_EARGS,
+    PPM_ENOKEY
+};
+
+/* Runs the command on line, which is split into arguments in place. */
+extern unsigned int ppmC_eval(char * /* line */);
 extern char *ppmC_getline(const char * /* prompt */);
 extern char *ppmC_readline(void);
 extern void ppmC_init(void);
 extern unsigned int ppmC_command(int /* argc */, char ** /* args */);
 
+/* Reads JSON requests from in, one per line, and answers each with one
+   line of JSON on stdout. */
+extern void ppmC_serve(FILE * /* in */);
+
 #endif /* PPM_COMMAND */
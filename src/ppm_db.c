@@ -28,18 +28,240 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pwd.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <openssl/crypto.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include "ppm_db.h"
 #include "ppm.h"
 #include "ppm_aes.h"
 #include "ppm_mem.h"
+#include "ppm_pool.h"
 #include "ppm_table.h"
 #include "ppm_string.h"
+#include "ppm_index.h"
+#include "ppm_epoch.h"
+#include "ppm_profile.h"
+
+typedef struct snapshot Snapshot;
+
+/* Where an entry's value is in the values of a version 2 file. */
+typedef struct
+{
+    const char *key;
+    size_t offset;
+    size_t len;
+}
+Record;
+
+/* The values of a shard read from a version 2 file until something
+   needs them, its entries are in the table with empty values in the
+   meantime. The file stays mapped, other processes replace it rather
+   than writing to it and rewriting the header in place leaves the rest
+   alone. Keys point into the decrypted index. */
+typedef struct
+{
+    char *index;
+    Record *recs;
+    size_t nrecs;
+    unsigned char iv[PPM_IVSIZE];
+    char *map;
+    size_t maplen;
+    const char *data;
+    size_t len;
+}
+Lazy;
+
+/* A vault is either a single file or a directory of shard files named
+   0 .. n-1, a key lives in the shard picked by shardhash(). Every shard
+   has its own table and is loaded, saved and marked dirty on its own.
+   All shards share one data key and thus the same key slots. */
+typedef struct
+{
+    ppm_Vault *vault;
+    char *path;
+    ppm_Table *table;
+
+    /* Set by every change to the table, saving a clean shard is a
+       no-op. */
+    unsigned int dirty;
+
+    /* Set once the file on disk starts with a header, until then key
+       changes need a full save rather than a header rewrite. */
+    unsigned int envelope;
+
+    /* Keys changed since the table was last written, their version
+       wins when another process changed the file in the meantime. */
+    ppm_Table *changed;
+
+    /* The file as last read or written, to tell whether another process
+       replaced it since. */
+    ino_t ino;
+    time_t mtime;
+    long mtimens;
+
+    unsigned int failed;
+    Snapshot *pending;
+
+    /* Set while the values are yet to be decrypted, readers check it
+       without holding writelock. It stays set if they can't be, the
+       shard is not saved then. */
+    Lazy *lazy;
+
+    /* Snapshots the saver couldn't write, their changes are taken back
+       by waitsaver. */
+    Snapshot *returned;
+}
+Shard;
+
+struct snapshot
+{
+    Shard *shard;
+    ppm_Header header;
+    ppm_String index;
+    ppm_String values;
+    ppm_Table *changed;
+
+    /* The file written, not yet renamed over the shard's. */
+    char *tmp;
+    unsigned int ok;
+
+    /* Not written because another process saved first. */
+    unsigned int conflict;
+    Snapshot *next;
+};
+
+/* Everything about one open vault, any number of them can be open side
+   by side. */
+struct ppm_vault
+{
+    char *path;
+    ppm_Header header;
+    ppm_Key key;
+    ppm_Index index;
+    Shard *shards;
+    unsigned int nshards;
+
+    /* Every change and every walk over the entries holds writelock.
+       Lookups don't, once ppmD_concurrent set up epoch they only have
+       to announce themselves there. */
+    pthread_mutex_t writelock;
+    ppm_Epoch *epoch;
+
+    /* Other processes are kept out by an advisory lock on lockfd, which
+       also holds a generation counter bumped by every save. A save only
+       re-reads the vault when generation no longer matches. */
+    char *lockpath;
+    int lockfd;
+    unsigned int lockdepth;
+    unsigned long generation;
+
+    /* The user key, kept while the vault only exists in memory. Should
+       another process create the file first, its data key is adopted. */
+    char *newkey;
+
+    /* Background saves: shards are serialized into snapshots on the
+       calling thread, encrypting and writing them happens on
+       saverthread. */
+    pthread_t saverthread;
+    pthread_mutex_t savelock;
+    pthread_cond_t savecond;
+    unsigned int npending;
+    unsigned int saverup;
+    unsigned int saverquit;
+    unsigned int saving;
+    unsigned int conflict;
+
+    /* Watching for saves by other processes: watchfd is an inotify
+       descriptor on the directory holding the lock file, writing to
+       watchpipe stops watchthread. */
+    pthread_t watchthread;
+    unsigned int watching;
+    int watchfd;
+    int watchpipe[2];
+};
+
+enum
+{
+    DB_NEW,
+    DB_ENVELOPE,
+    DB_LEGACY,
+    DB_ERROR
+};
+
+/* A record is its key, value, creation and modification time and its
+   comma separated tags, separated by tabs. Records written before the
+   metadata was added only hold the key and value, their times default
+   to deftime. */
+enum
+{
+    REC_KEY,
+    REC_VALUE,
+    REC_CREATED,
+    REC_MODIFIED,
+    REC_TAGS,
+    REC_FIELDS
+};
+
+/* Version 2 files split the records in two, each encrypted on its own:
+   an index of keys, where their value is, times and tags, followed by
+   the values one after another in the same order. Anything asking for
+   names only has to decrypt the index. */
+enum
+{
+    IDX_KEY,
+    IDX_OFFSET,
+    IDX_LENGTH,
+    IDX_CREATED,
+    IDX_MODIFIED,
+    IDX_TAGS,
+    IDX_FIELDS
+};
+
+/* The header of a version 2 file is followed by the IV of the values
+   and the lengths of the encrypted index and values, as 8 byte big
+   endian numbers. */
+#define SECTIONSIZE (PPM_IVSIZE + 16)
+
+/* Attachments are files of their own, named by ppmA_name after their
+   entry, in <vault>.files or a sharded vault's files directory. Each
+   starts with ATTACHMAGIC and its nonce prefix, followed by chunks of
+   CHUNKSIZE bytes sealed by ppmA_chunk, the last one shorter or empty.
+   The chunks are bound to the entry's name, a file moved to another
+   entry fails to open. Neither end holds more than a chunk in memory. */
+#define ATTACHMAGIC "PPA\001"
+#define CHUNKSIZE 65536
+
+static unsigned int
+shardhash(const char *key)
+{
+    unsigned int h = 2166136261u;
+
+    /* FNV-1a, deliberately unrelated to the table's own hash so keys
+       within a shard still spread over all of its buckets. */
+    while (*key)
+    {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
 
-static char *dbpath;
-static ppm_Table *dbtable;
+static Shard *
+getshard(ppm_Vault *vault, const char *key)
+{
+    return vault->shards + (vault->nshards > 1 ? shardhash(key) % vault->nshards : 0);
+}
 
 static char *
 gethome(void)
@@ -59,213 +281,2541 @@ gethome(void)
 }
 
 static void
-parsedbstr(char *string)
+parsedbstr(ppm_Table *table, char *string, time_t deftime)
 {
-    ppm_String pass, app;
-    unsigned int getp = 0;
-    char *p;
+    char *line, *end, *p, *fields[REC_FIELDS];
+    ppm_Node *node;
+    unsigned int n;
+    struct timespec start;
 
-    ppmS_init(&pass, NULL);
-    ppmS_init(&app, NULL);
-    for (p = string; *p; p++)
+    /* Records are split in place, every one ends in a newline. */
+    ppmF_start(&start);
+    for (line = string; *line; line = end + 1)
     {
-        if (*p == '\n')
+        end = strchr(line, '\n');
+        if (!end) break;
+        *end = '\0';
+
+        fields[0] = line;
+        for (n = 1, p = line; n < REC_FIELDS && (p = strchr(p, '\t')); n++)
         {
-            ppmT_insert(dbtable, app.cstr, pass.cstr);
-            if (!p[1]) break;
-            ppmS_set(&pass, NULL);
-            ppmS_set(&app, NULL);
-            getp = 0;
-            continue;
+            *p++ = '\0';
+            fields[n] = p;
         }
-        if (*p == '\t')
+
+        node = ppmT_insert(table, fields[REC_KEY], n > REC_VALUE ? fields[REC_VALUE] : "");
+        node->created = n > REC_CREATED ? (time_t)strtol(fields[REC_CREATED], NULL, 10) : deftime;
+        node->modified = n > REC_MODIFIED ? (time_t)strtol(fields[REC_MODIFIED], NULL, 10) : node->created;
+        free(node->tags);
+        node->tags = (n > REC_TAGS && *fields[REC_TAGS]) ? ppmM_strdup(fields[REC_TAGS]) : NULL;
+    }
+    ppmF_stop(PPM_PHASE_PARSE, &start);
+}
+
+static time_t
+filetime(const char *path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 ? st.st_mtime : time(NULL);
+}
+
+static unsigned int
+readfile(const char *path, char **buffer, size_t *len)
+{
+    FILE *file;
+    long fsize;
+    struct timespec start;
+
+    *buffer = NULL;
+    *len = 0;
+    ppmF_start(&start);
+    file = fopen(path, "rb");
+    if (!file) 
+    {
+        if (errno != ENOENT)
         {
-            getp = 1;
-            continue;
+            ppm_error("failed to open %s", path);
+            return 0;
         }
-        ppmS_addch(getp ? &pass : &app, *p);
+        errno = 0;
+        return 1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    fsize = ftell(file);
+    rewind(file);
+    if (fsize > 0)
+    {
+        *buffer = ppmM_alloc(fsize);
+        *len = fread(*buffer, 1, fsize, file);
+    }
+    fclose(file);
+    ppmF_stop(PPM_PHASE_READ, &start);
+
+    if (*len < (size_t)fsize)
+    {
+        free(*buffer);
+        *buffer = NULL;
+        ppm_error("failed to read %s", path);
+        return 0;
     }
-    free(pass.cstr);
-    free(app.cstr);
+    return 1;
 }
 
-static void
-readdb(FILE *dbfile)
+/* Maps a file rather than reading it, only the pages that are used are
+   read, when they are. */
+static unsigned int
+mapfile(const char *path, char **map, size_t *len)
 {
-    size_t fsize;
-    char *buffer;
-    size_t bytes;
-    char *dbtext;
+    struct stat st;
+    void *p;
+    int fd;
+    struct timespec start;
 
-    fseek(dbfile, 0 , SEEK_END);
-    fsize = ftell(dbfile);
-    rewind(dbfile);
+    *map = NULL;
+    *len = 0;
+    ppmF_start(&start);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        if (errno != ENOENT)
+        {
+            ppm_error("failed to open %s", path);
+            return 0;
+        }
+        errno = 0;
+        return 1;
+    }
 
-    buffer = ppmM_alloc(fsize);
-    bytes = fread(buffer, 1, fsize, dbfile);
-    if (bytes < 0)
+    if (fstat(fd, &st) != 0)
     {
-        free(buffer);
-        ppm_error("read failed");
-        return;
+        ppm_error("failed to read %s", path);
+        close(fd);
+        return 0;
     }
-    else
-    if (bytes == 0)
+    if (st.st_size > 0)
     {
-        free(buffer);
-        return;
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            ppm_error("failed to read %s", path);
+            close(fd);
+            return 0;
+        }
+        *map = p;
+        *len = st.st_size;
     }
-    dbtext = ppmA_decrypt(buffer, bytes);
-    free(buffer);
-    parsedbstr(dbtext);
-    free(dbtext);
+    close(fd);
+    ppmF_stop(PPM_PHASE_READ, &start);
+    return 1;
 }
 
-unsigned int
-ppmD_save(void)
+static int
+readheader(const char *path, ppm_Header *header)
+{
+    unsigned char buf[PPM_HEADERSIZE];
+    FILE *file;
+    size_t bytes;
+    struct timespec start;
+
+    ppmF_start(&start);
+    file = fopen(path, "rb");
+    if (!file) 
+    {
+        if (errno == ENOENT)
+        {
+            errno = 0;
+            return DB_NEW;
+        }
+        ppm_error("failed to open %s", path);
+        return DB_ERROR;
+    }
+    bytes = fread(buf, 1, PPM_HEADERSIZE, file);
+    fclose(file);
+    ppmF_stop(PPM_PHASE_READ, &start);
+
+    if (bytes == 0) 
+        return DB_NEW;
+    if (bytes == PPM_HEADERSIZE && ppmA_unpackheader(header, buf))
+        return DB_ENVELOPE;
+    return DB_LEGACY;
+}
+
+static void
+putsize(unsigned char *buf, size_t n)
 {
     unsigned int i;
-    ppm_String dbtext;
-    char *buffer;
-    FILE *dbfile;
-    size_t len;
 
-    if (!dbtable) return 0;
-    if (dbtable->count == 0) return 1;
-    dbfile = fopen(dbpath, "wb");
-    if (!dbfile)
+    for (i = 8; i-- > 0; n >>= 8)
+        buf[i] = n & 0xff;
+}
+
+static size_t
+getsize(const unsigned char *buf)
+{
+    size_t n = 0;
+    unsigned int i;
+
+    for (i = 0; i < 8; i++)
+        n = n << 8 | buf[i];
+    return n;
+}
+
+static void
+freelazy(Lazy *lazy)
+{
+    if (!lazy) return;
+    munmap(lazy->map, lazy->maplen);
+    free(lazy->index);
+    free(lazy->recs);
+    free(lazy);
+}
+
+/* Decrypts the index of a version 2 file mapped at map and adds its
+   entries to table with empty values. Returns what loadvalues needs to
+   fill them in, which the map then belongs to. */
+static Lazy *
+readindex(const ppm_Key *key, const ppm_Header *header, const char *path, char *map, size_t len, ppm_Table *table)
+{
+    const unsigned char *sect = (unsigned char *)map + PPM_HEADERSIZE;
+    char *text, *line, *end, *p, *fields[IDX_FIELDS];
+    ppm_Node *node;
+    Lazy *lazy;
+    size_t ilen, vlen, size = 0;
+    unsigned int n;
+    struct timespec start;
+
+    ilen = len < PPM_HEADERSIZE + SECTIONSIZE ? 0 : getsize(sect + PPM_IVSIZE);
+    vlen = ilen ? getsize(sect + PPM_IVSIZE + 8) : 0;
+    if (!ilen || ilen > len - PPM_HEADERSIZE - SECTIONSIZE 
+     || vlen != len - PPM_HEADERSIZE - SECTIONSIZE - ilen)
     {
-        ppm_error("failed to open %s", dbpath);
-        return 0;
+        ppm_error("%s is corrupted", path);
+        munmap(map, len);
+        return NULL;
     }
-    ppmS_init(&dbtext, NULL);
-    for (i = 0; i < dbtable->size; i++)
+
+    text = ppmA_decryptbuf(key, header->iv, map + PPM_HEADERSIZE + SECTIONSIZE, &ilen);
+    if (!text)
     {
-        ppm_Node *node = dbtable->nodes[i];
-        while (node)
+        munmap(map, len);
+        return NULL;
+    }
+
+    lazy = NEW(Lazy);
+    lazy->index = text;
+    lazy->recs = NULL;
+    lazy->nrecs = 0;
+    memcpy(lazy->iv, sect, PPM_IVSIZE);
+    lazy->map = map;
+    lazy->maplen = len;
+    lazy->data = map + len - vlen;
+    lazy->len = vlen;
+
+    ppmF_start(&start);
+    for (line = text; *line; line = end + 1)
+    {
+        end = strchr(line, '\n');
+        if (!end) break;
+        *end = '\0';
+
+        fields[0] = line;
+        for (n = 1, p = line; n < IDX_FIELDS && (p = strchr(p, '\t')); n++)
         {
-            ppmS_append(&dbtext, node->key);
-            ppmS_addch(&dbtext, '\t');
-            ppmS_append(&dbtext, node->value);
-            ppmS_addch(&dbtext, '\n');
-            node = node->next;
+            *p++ = '\0';
+            fields[n] = p;
+        }
+        if (n < IDX_FIELDS)
+        {
+            ppm_error("%s is corrupted", path);
+            freelazy(lazy);
+            return NULL;
+        }
+
+        if (lazy->nrecs == size)
+        {
+            size = size ? size * 2 : 64;
+            lazy->recs = ppmM_realloc(lazy->recs, size * sizeof(Record));
         }
+        lazy->recs[lazy->nrecs].key = fields[IDX_KEY];
+        lazy->recs[lazy->nrecs].offset = strtoul(fields[IDX_OFFSET], NULL, 10);
+        lazy->recs[lazy->nrecs].len = strtoul(fields[IDX_LENGTH], NULL, 10);
+        lazy->nrecs++;
+
+        node = ppmT_insert(table, fields[IDX_KEY], "");
+        node->created = (time_t)strtol(fields[IDX_CREATED], NULL, 10);
+        node->modified = (time_t)strtol(fields[IDX_MODIFIED], NULL, 10);
+        free(node->tags);
+        node->tags = *fields[IDX_TAGS] ? ppmM_strdup(fields[IDX_TAGS]) : NULL;
     }
-    buffer = ppmA_encrypt(dbtext.cstr, &len);
-    free(dbtext.cstr);
-    
-    if (fwrite(buffer, 1, len, dbfile) < 0)
-    {
-        free(buffer);
-        fclose(dbfile);
-        ppm_error("failed to write to file");
+    ppmF_stop(PPM_PHASE_PARSE, &start);
+    return lazy;
+}
+
+/* Decrypts the values readindex left out and puts them in table. Every
+   record is checked first, the table is either filled in completely or
+   left as it is. */
+static unsigned int
+loadvalues(const ppm_Key *key, ppm_Table *table, const Lazy *lazy, const char *path)
+{
+    const Record *rec;
+    char *text, c;
+    size_t i, len = lazy->len;
+    struct timespec start;
+
+    text = ppmA_decryptbuf(key, lazy->iv, lazy->data, &len);
+    if (!text) 
         return 0;
+    for (i = 0; i < lazy->nrecs; i++)
+    {
+        rec = lazy->recs + i;
+        if (rec->offset > len || rec->len > len - rec->offset)
+        {
+            ppm_error("%s is corrupted", path);
+            free(text);
+            return 0;
+        }
     }
-    fclose(dbfile);
-    free(buffer);
+
+    /* Values follow each other, every one is terminated in place for as
+       long as it takes to insert it. */
+    ppmF_start(&start);
+    for (i = 0; i < lazy->nrecs; i++)
+    {
+        rec = lazy->recs + i;
+        c = text[rec->offset + rec->len];
+        text[rec->offset + rec->len] = '\0';
+        ppmT_insert(table, rec->key, text + rec->offset);
+        text[rec->offset + rec->len] = c;
+    }
+    ppmF_stop(PPM_PHASE_PARSE, &start);
+    free(text);
     return 1;
 }
 
-unsigned int 
-ppmD_init(void)
+/* Decrypts and parses a file mapped at map, which it unmaps, header
+   being the file's own. The values of a version 2 file are left to
+   loadvalues when lazy is given, it is set to what that takes. */
+static unsigned int
+readdata(const ppm_Key *key, const ppm_Header *header, const char *path, char *map, size_t len, ppm_Table *table, Lazy **lazy)
 {
-    FILE *dbfile = NULL;
-    char *home;
+    char *text;
+    Lazy *l;
+    unsigned int ok;
 
-    if (!ppm_dbfile)
+    if (header->version < 2)
     {
-        home = gethome();
-        if (!home) return 0;
-        
-        dbpath = ppmM_alloc(strlen(home) + 6); 
-        sprintf(dbpath, "%s/.ppm", home);
+        text = ppmA_decrypt(key, header, map + PPM_HEADERSIZE, len - PPM_HEADERSIZE);
+        munmap(map, len);
+        if (!text)
+            return 0;
+        parsedbstr(table, text, filetime(path));
+        free(text);
+        return 1;
     }
-    else
-        dbpath = ppm_dbfile;
 
-    dbtable = ppmT_new(32);
-    dbfile = fopen(dbpath, "rb");
-    if (!dbfile) return 1;
-    
-    readdb(dbfile);
-    fclose(dbfile);
+    l = readindex(key, header, path, map, len, table);
+    if (!l)
+        return 0;
+    if (lazy)
+    {
+        *lazy = l;
+        return 1;
+    }
+    ok = loadvalues(key, table, l, path);
+    freelazy(l);
+    return ok;
+}
+
+/* Fills in the values of a shard read lazily, with writelock held. */
+static unsigned int
+values(Shard *shard)
+{
+    Lazy *lazy = shard->lazy;
+
+    if (!lazy)
+        return 1;
+    if (!loadvalues(&shard->vault->key, shard->table, lazy, shard->path))
+        return 0;
+    PPM_STORE(shard->lazy, NULL);
+    freelazy(lazy);
     return 1;
 }
 
-void
-ppmD_add(const char *app, const char *pass)
+static void
+loadvalue(void *arg, unsigned int i)
+{
+    values(((ppm_Vault *)arg)->shards + i);
+}
+
+/* Fills in the values of every shard, for anything walking them all.
+   Returns 0 if those of any shard can't be read. */
+static unsigned int
+allvalues(ppm_Vault *vault)
 {
-    if (!dbtable) return;
-    if (ppmT_get(dbtable, app))
+    unsigned int i;
+
+    for (i = 0; i < vault->nshards; i++)
     {
-        ppm_error("'%s%s%s' already exists, use '%supdate%s' to change the password", 
-                 PPMC(WHITE), app, PPMC(RED), 
-                 PPMC(WHITE), PPMC(RED));
-        return;
+        if (vault->shards[i].lazy) break;
+    }
+    if (i == vault->nshards)
+        return 1;
+    ppmP_run(loadvalue, vault, vault->nshards);
+    for (i = 0; i < vault->nshards; i++)
+    {
+        if (vault->shards[i].lazy) return 0;
     }
-    ppmT_insert(dbtable, app, pass);
-    ppm_message("'%s%s%s' added", PPMC(WHITE), app, PPMC(GREEN));
+    return 1;
 }
 
-void
-ppmD_update(const char *app, const char *pass)
+/* Notes which file a shard was read from or written to. The file is
+   looked at before reading it, should it be replaced in between the
+   next refresh reads it once more rather than missing the change. */
+static void
+statshard(Shard *shard)
 {
-    ppm_Node *node;
-    
-    if (!dbtable) return;
-    node = ppmT_getnode(dbtable, app);
-    if (!node)
+    struct stat st;
+
+    if (stat(shard->path, &st) != 0)
     {
-        ppm_error("%s%s%s not found, use '%sadd%s' to add a new user", 
-                  PPMC(WHITE), app, PPMC(RED),
-                  PPMC(WHITE), PPMC(RED));
+        errno = 0;
+        shard->ino = 0;
         return;
     }
+    shard->ino = st.st_ino;
+    shard->mtime = st.st_mtim.tv_sec;
+    shard->mtimens = st.st_mtim.tv_nsec;
+}
 
-    free(node->value);
-    node->value = ppmM_strdup(pass);
-    ppm_message("'%s%s%s' updated", PPMC(WHITE), app, PPMC(GREEN));
+static unsigned int
+replaced(const Shard *shard)
+{
+    struct stat st;
+
+    if (stat(shard->path, &st) != 0)
+    {
+        errno = 0;
+        return shard->ino != 0;
+    }
+    return st.st_ino != shard->ino 
+        || st.st_mtim.tv_sec != shard->mtime 
+        || st.st_mtim.tv_nsec != shard->mtimens;
 }
 
-void
-ppmD_rm(const char *app)
+/* Reads a shard's file into table, header is set to the file's own.
+   With lazy the values of a version 2 file are left for later, see
+   readdata. Returns -1 on failure and 0 if there is no file. */
+static int
+readshard(ppm_Vault *vault, Shard *shard, ppm_Table *table, ppm_Header *header, Lazy **lazy)
 {
-    if (!dbtable) return;
-    if (ppmT_remove(dbtable, app))
-        ppm_message("'%s%s%s' deleted", PPMC(WHITE), app, PPMC(GREEN));
-    else
-        ppm_error("'%s%s%s' not found", PPMC(WHITE), app, PPMC(RED));
+    char *map;
+    size_t len;
+
+    statshard(shard);
+    if (!mapfile(shard->path, &map, &len))
+        return -1;
+    if (!map)
+        return 0;
+
+    if (len < PPM_HEADERSIZE || !ppmA_unpackheader(header, (unsigned char *)map))
+    {
+        ppm_error("%s is not a ppm file", shard->path);
+        munmap(map, len);
+        return -1;
+    }
+    return readdata(&vault->key, header, shard->path, map, len, table, lazy) ? 1 : -1;
 }
 
-char *
-ppmD_get(const char *app)
+static void
+loadshard(void *arg, unsigned int i)
 {
-    if (!dbtable) return NULL;
-    return ppmT_get(dbtable, app);
+    ppm_Vault *vault = arg;
+    Shard *shard = vault->shards + i;
+    ppm_Header header;
+
+    /* Only the index is decrypted now, the values when something
+       first needs them. */
+    switch (readshard(vault, shard, shard->table, &header, &shard->lazy))
+    {
+    case -1:
+        shard->failed = 1;
+        break;
+
+    case 0:
+        /* A shard that was never written, write it on the next save so
+           the layout is complete. */
+        shard->dirty = 1;
+        break;
+
+    default:
+        shard->envelope = 1;
+    }
 }
 
-void
-ppmD_list(void)
+static unsigned int
+loadlegacy(ppm_Vault *vault, const char *key)
 {
-    unsigned int i;
-    ppm_Node *node;
-    
-    if (!dbtable) return;
-    for (i = 0; i < dbtable->size; i++)
+    Shard *shard = vault->shards;
+    char *buffer, *dbtext;
+    size_t len;
+
+    /* No header, this file predates envelope encryption. Its contents
+       move to a fresh data key on the next save. */
+    statshard(shard);
+    if (!readfile(shard->path, &buffer, &len) || !buffer)
+        return 0;
+    dbtext = ppmA_legacycipher(&vault->key, key) ? ppmA_decrypt(&vault->key, NULL, buffer, len) : NULL;
+    free(buffer);
+    if (!dbtext) return 0;
+    if (!ppmA_newkey(&vault->key, &vault->header, key))
+    {
+        free(dbtext);
+        return 0;
+    }
+    parsedbstr(shard->table, dbtext, filetime(shard->path));
+    free(dbtext);
+    return 1;
+}
+
+static unsigned int
+writeall(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0)
     {
-        node = dbtable->nodes[i];
-        while (node) 
+        ssize_t n = write(fd, p, len);
+
+        if (n < 0)
         {
-            fprintf(stdout, "%s%s%s => %s%s%s\n", 
-                    PPMC(WHITE), node->key,   PPMC(GREEN),
-                    PPMC(BLUE),  node->value, PPMC(NONE));
-            node = node->next;
+            if (errno == EINTR) continue;
+            return 0;
         }
+        p += n;
+        len -= n;
     }
+    return 1;
 }
 
-void
-ppmD_cleanup(void)
+static void
+syncdir(const char *path)
+{
+    char *dir, *slash;
+    int fd;
+
+    /* A rename is only durable once the directory holding it is. */
+    dir = ppmM_alloc(strlen(path) + 2);
+    strcpy(dir, path);
+    slash = strrchr(dir, '/');
+    if (!slash)
+        strcpy(dir, ".");
+    else
+        slash[slash == dir ? 1 : 0] = '\0';
+
+    fd = open(dir, O_RDONLY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+/* Writes head followed by the encrypted index and values to a new file
+   next to path and returns its name, NULL on failure. */
+static char *
+writefile(const char *path, const unsigned char *head, size_t headlen, const char *index, size_t indexlen, const char *values, size_t valueslen)
+{
+    char *tmp;
+    int fd;
+    struct timespec start;
+
+    /* Write a complete copy next to the vault to rename it over the
+       original, a crash at any point leaves either the old or the new
+       file in place, never a truncated one. */
+    ppmF_start(&start);
+    tmp = ppmM_alloc(strlen(path) + 8);
+    sprintf(tmp, "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd < 0)
+    {
+        ppm_error("failed to create %s", tmp);
+        free(tmp);
+        return NULL;
+    }
+
+    if (!writeall(fd, head, headlen) 
+     || !writeall(fd, index, indexlen) 
+     || !writeall(fd, values, valueslen) 
+     || fsync(fd) != 0)
+    {
+        ppm_error("failed to write to %s", tmp);
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        return NULL;
+    }
+    if (close(fd) != 0)
+    {
+        ppm_error("failed to write to %s", tmp);
+        unlink(tmp);
+        free(tmp);
+        return NULL;
+    }
+    ppmF_stop(PPM_PHASE_WRITE, &start);
+    return tmp;
+}
+
+/* Puts a file from writefile in place of path. */
+static unsigned int
+replacefile(char *tmp, const char *path)
+{
+    unsigned int ok = rename(tmp, path) == 0;
+
+    if (!ok)
+    {
+        ppm_error("failed to replace %s", path);
+        unlink(tmp);
+    }
+    free(tmp);
+    if (ok)
+        syncdir(path);
+    return ok;
+}
+
+static void
+indexnode(ppm_Node *node, void *arg)
+{
+    ppmX_add(arg, node);
+}
+
+/* Stores a password and stamps the entry, a new entry is added to the
+   indexes. */
+static ppm_Node *
+store(Shard *shard, const char *app, const char *pass, time_t now)
+{
+    ppm_Index *index = &shard->vault->index;
+    size_t count = shard->table->count;
+    ppm_Node *node;
+
+    node = ppmT_insert(shard->table, app, pass);
+    node->modified = now;
+    if (shard->table->count != count)
+    {
+        node->created = now;
+        ppmX_add(index, node);
+    }
+    else
+        ppmX_touch(index, node);
+    shard->dirty = 1;
+    return node;
+}
+
+/* Copies an entry as it is, times and tags included. */
+static ppm_Node *
+copyentry(Shard *shard, const ppm_Node *from)
 {
-    ppmT_free(dbtable);
+    ppm_Node *node;
+
+    node = store(shard, from->key, from->value, from->modified);
+    node->created = from->created;
+    ppmX_settags(&shard->vault->index, node, from->tags);
+    return node;
+}
+
+static unsigned int
+removeentry(Shard *shard, const char *app)
+{
+    ppm_Node *node;
+
+    node = ppmT_getnode(shard->table, app);
+    if (!node) 
+        return 0;
+    ppmX_remove(&shard->vault->index, node);
+    ppmT_remove(shard->table, app);
+    shard->dirty = 1;
+    return 1;
+}
+
+/* Records that app was changed by this process. */
+static void
+journal(Shard *shard, const char *app)
+{
+    ppmT_insert(shard->changed, app, "");
+}
+
+static void
+addjournal(ppm_Table *to, const ppm_Table *from)
+{
+    ppm_Node *node;
+    size_t i;
+
+    for (i = 0; i < from->size; i++)
+    {
+        for (node = from->nodes[i]; node; node = node->next)
+            ppmT_insert(to, node->key, "");
+    }
+}
+
+static unsigned int
+sameentry(const ppm_Node *a, const ppm_Node *b)
+{
+    return a->created == b->created 
+        && a->modified == b->modified 
+        && strcmp(a->value, b->value) == 0
+        && (a->tags && b->tags ? strcmp(a->tags, b->tags) == 0 : a->tags == b->tags);
+}
+
+/* Takes the entries of another process' save of a shard, except for
+   those this process changed since: its own version of them is the one
+   written next. */
+static void
+mergeshard(Shard *shard, ppm_Table *theirs)
+{
+    ppm_String gone;
+    ppm_Node *node, *ours;
+    const char *key;
+    size_t i;
+
+    for (i = 0; i < theirs->size; i++)
+    {
+        for (node = theirs->nodes[i]; node; node = node->next)
+        {
+            if (ppmT_getnode(shard->changed, node->key)) continue;
+            ours = ppmT_getnode(shard->table, node->key);
+            if (!ours || !sameentry(ours, node))
+                copyentry(shard, node);
+        }
+    }
+
+    /* Entries they removed, collected first as removing them here would
+       change the table being walked. */
+    ppmS_init(&gone, NULL);
+    for (i = 0; i < shard->table->size; i++)
+    {
+        for (node = shard->table->nodes[i]; node; node = node->next)
+        {
+            if (ppmT_getnode(theirs, node->key) || ppmT_getnode(shard->changed, node->key)) continue;
+            ppmS_append(&gone, node->key);
+            ppmS_addch(&gone, '\0');
+        }
+    }
+    for (key = gone.cstr; key && key < gone.cstr + gone.len; key += strlen(key) + 1)
+        removeentry(shard, key);
+    free(gone.cstr);
+}
+
+/* Takes the advisory lock other processes opening the vault honour,
+   type is F_RDLCK or F_WRLCK. Locks nest, only the outermost one
+   touches the lock file. Without create a vault that has no lock file
+   yet is simply not locked, there is nothing to read in that case. */
+static unsigned int
+lockvault(ppm_Vault *vault, short type, unsigned int create)
+{
+    struct flock fl;
+    struct timespec start;
+
+    if (vault->lockdepth++ > 0) 
+        return 1;
+    if (vault->lockfd < 0)
+    {
+        vault->lockfd = open(vault->lockpath, create ? O_RDWR | O_CREAT : O_RDWR, 0600);
+        if (vault->lockfd < 0)
+        {
+            if (!create && errno == ENOENT)
+            {
+                errno = 0;
+                return 1;
+            }
+            ppm_error("failed to open %s", vault->lockpath);
+            vault->lockdepth--;
+            return 0;
+        }
+    }
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    ppmF_start(&start);
+    while (fcntl(vault->lockfd, F_SETLKW, &fl) != 0)
+    {
+        if (errno == EINTR) continue;
+        ppm_error("failed to lock %s", vault->lockpath);
+        vault->lockdepth--;
+        return 0;
+    }
+    ppmF_stop(PPM_PHASE_LOCK, &start);
+    return 1;
+}
+
+static void
+unlockvault(ppm_Vault *vault)
+{
+    struct flock fl;
+
+    if (--vault->lockdepth > 0 || vault->lockfd < 0) 
+        return;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_UNLCK;
+    fl.l_whence = SEEK_SET;
+    fcntl(vault->lockfd, F_SETLK, &fl);
+}
+
+/* The generation is kept as text in the lock file, the vault's own
+   header has no room to spare. A missing or empty lock file is
+   generation 0. */
+static unsigned long
+readgen(ppm_Vault *vault)
+{
+    char buf[32];
+    ssize_t n;
+
+    if (vault->lockfd < 0) 
+        return 0;
+    n = pread(vault->lockfd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) 
+        return 0;
+    buf[n] = '\0';
+    return strtoul(buf, NULL, 10);
+}
+
+static unsigned int
+writegen(ppm_Vault *vault, unsigned long gen)
+{
+    char buf[32];
+    size_t len;
+
+    len = sprintf(buf, "%lu\n", gen);
+    if (pwrite(vault->lockfd, buf, len, 0) != (ssize_t)len
+     || ftruncate(vault->lockfd, len) != 0
+     || fsync(vault->lockfd) != 0)
+    {
+        ppm_error("failed to write to %s", vault->lockpath);
+        return 0;
+    }
+    vault->generation = gen;
+    return 1;
+}
+
+static void
+forgetkey(ppm_Vault *vault)
+{
+    if (!vault->newkey) return;
+    OPENSSL_cleanse(vault->newkey, strlen(vault->newkey));
+    free(vault->newkey);
+    vault->newkey = NULL;
+}
+
+/* A vault this process created, or converted from the old format, got
+   a data key of its own. Once another process has written the vault
+   first, its data key is the one to use. */
+static unsigned int
+adoptkey(ppm_Vault *vault)
+{
+    ppm_Header header;
+    ppm_Key key;
+
+    switch (readheader(vault->shards[0].path, &header))
+    {
+    case DB_ENVELOPE:
+        break;
+
+    case DB_ERROR:
+        return 0;
+
+    default:
+        return 1;
+    }
+
+    key.slot = -1;
+    if (!ppmA_initcipher(&key, &header, vault->newkey))
+    {
+        ppmA_cleanup(&key);
+        return 0;
+    }
+    vault->key = key;
+    vault->header = header;
+    ppmA_cleanup(&key);
+    forgetkey(vault);
+    return 1;
+}
+
+/* Brings the vault up to date with what other processes saved since it
+   was read, called with the vault locked and the saver idle. Only the
+   shards whose file was replaced are read again. */
+static unsigned int
+refresh(ppm_Vault *vault)
+{
+    ppm_Header header;
+    ppm_Table *theirs;
+    unsigned int i, dirty;
+    int status;
+
+    if (vault->newkey)
+    {
+        if (!adoptkey(vault))
+            return 0;
+
+        /* Nothing was written in this format yet. */
+        if (vault->newkey)
+            return 1;
+    }
+
+    for (i = 0; i < vault->nshards; i++)
+    {
+        Shard *shard = vault->shards + i;
+
+        if (!replaced(shard)) continue;
+        if (!values(shard))
+            return 0;
+        theirs = ppmT_new(32);
+        status = readshard(vault, shard, theirs, &header, NULL);
+        if (status < 0)
+        {
+            ppmT_free(theirs);
+            return 0;
+        }
+
+        /* A vanished file is rewritten as it was rather than taken to
+           mean every entry in it was removed. */
+        if (status > 0)
+        {
+            /* Every save writes all key slots, the latest ones win. */
+            memcpy(vault->header.slots, header.slots, sizeof(header.slots));
+            shard->envelope = 1;
+            dirty = shard->dirty;
+            mergeshard(shard, theirs);
+            shard->dirty = dirty;
+        }
+        ppmT_free(theirs);
+    }
+    return 1;
+}
+
+/* Locks the vault for a change to its files and refreshes it if another
+   process saved since. */
+static unsigned int
+beginwrite(ppm_Vault *vault)
+{
+    unsigned long gen;
+
+    if (!lockvault(vault, F_WRLCK, 1))
+        return 0;
+    gen = readgen(vault);
+    if (gen != vault->generation)
+    {
+        if (!refresh(vault))
+        {
+            unlockvault(vault);
+            return 0;
+        }
+        vault->generation = gen;
+    }
+    return 1;
+}
+
+/* Adds an entry to the index and values of a version 2 file. */
+void
+ppmD_serialize(ppm_String *index, ppm_String *values, const ppm_Node *node)
+{
+    char num[96];
+
+    sprintf(num, "\t%lu\t%lu\t%ld\t%ld\t", (unsigned long)values->len, 
+            (unsigned long)strlen(node->value), (long)node->created, (long)node->modified);
+    ppmS_append(index, node->key);
+    ppmS_append(index, num);
+    if (node->tags)
+        ppmS_append(index, node->tags);
+    ppmS_addch(index, '\n');
+    ppmS_append(values, node->value);
+}
+
+static Snapshot *
+snapshot(Shard *shard)
+{
+    Snapshot *snap;
+    ppm_Table *table = shard->table;
+    unsigned int i;
+    struct timespec start;
+
+    ppmF_start(&start);
+    snap = NEW(Snapshot);
+    ppmS_init(&snap->index, NULL);
+    ppmS_init(&snap->values, NULL);
+    for (i = 0; i < table->size; i++)
+    {
+        ppm_Node *node = table->nodes[i];
+        while (node)
+        {
+            ppmD_serialize(&snap->index, &snap->values, node);
+            node = node->next;
+        }
+    }
+    snap->shard = shard;
+    snap->header = shard->vault->header;
+    snap->changed = shard->changed;
+    snap->tmp = NULL;
+    snap->ok = 0;
+    snap->conflict = 0;
+    snap->next = NULL;
+    shard->changed = ppmT_new(32);
+    shard->dirty = 0;
+    ppmF_stop(PPM_PHASE_SERIALIZE, &start);
+    return snap;
+}
+
+static void
+freesnapshot(Snapshot *snap)
+{
+    free(snap->index.cstr);
+    free(snap->values.cstr);
+    ppmT_free(snap->changed);
+    free(snap);
+}
+
+/* Gives the changes a snapshot that wasn't written back to its shard.
+   Called on the saver's thread as well, the shard's returned list is
+   only touched under savelock. */
+static void
+returnsnapshot(Snapshot *snap)
+{
+    ppm_Vault *vault = snap->shard->vault;
+
+    free(snap->index.cstr);
+    free(snap->values.cstr);
+    snap->index.cstr = snap->values.cstr = NULL;
+    pthread_mutex_lock(&vault->savelock);
+    snap->next = snap->shard->returned;
+    snap->shard->returned = snap;
+    pthread_mutex_unlock(&vault->savelock);
+}
+
+/* Encrypts an index and values into the sections of a version 2 file
+   and fills in the head going in front of them. */
+static unsigned int
+seal(const ppm_Key *key, ppm_Header *header, const ppm_String *index, const ppm_String *values, 
+     unsigned char *head, char **cindex, size_t *indexlen, char **cvalues, size_t *valueslen)
+{
+    unsigned char *sect = head + PPM_HEADERSIZE;
+
+    /* The index and values get an IV each, the header holds the
+       index's. */
+    header->version = 2;
+    *indexlen = index->len;
+    *valueslen = values->len;
+    *cindex = ppmA_encryptbuf(key, header->iv, index->cstr, indexlen);
+    *cvalues = *cindex ? ppmA_encryptbuf(key, sect, values->cstr, valueslen) : NULL;
+    if (!*cvalues)
+    {
+        free(*cindex);
+        return 0;
+    }
+    ppmA_packheader(header, head);
+    putsize(sect + PPM_IVSIZE, *indexlen);
+    putsize(sect + PPM_IVSIZE + 8, *valueslen);
+    return 1;
+}
+
+static void
+writesnapshot(void *arg, unsigned int i)
+{
+    Snapshot *snap = ((Snapshot **)arg)[i];
+    unsigned char head[PPM_HEADERSIZE + SECTIONSIZE];
+    char *index, *values;
+    size_t indexlen, valueslen;
+
+    if (!seal(&snap->shard->vault->key, &snap->header, &snap->index, &snap->values, 
+              head, &index, &indexlen, &values, &valueslen))
+        return;
+    snap->tmp = writefile(snap->shard->path, head, sizeof(head), index, indexlen, values, valueslen);
+    free(index);
+    free(values);
+}
+
+unsigned int
+ppmD_writecopy(FILE *out, const char *key, const ppm_String *index, const ppm_String *values)
+{
+    ppm_Key k;
+    ppm_Header header;
+    unsigned char head[PPM_HEADERSIZE + SECTIONSIZE];
+    char *cindex, *cvalues;
+    size_t indexlen, valueslen;
+    unsigned int ok;
+
+    /* The copy gets a data key of its own, wrapped for key alone, so
+       nothing ties it to this vault. */
+    if (!ppmA_newkey(&k, &header, key))
+        return 0;
+    ok = seal(&k, &header, index, values, head, &cindex, &indexlen, &cvalues, &valueslen);
+    ppmA_cleanup(&k);
+    if (!ok)
+        return 0;
+    if (fwrite(head, 1, sizeof(head), out) != sizeof(head)
+     || fwrite(cindex, 1, indexlen, out) != indexlen
+     || fwrite(cvalues, 1, valueslen, out) != valueslen)
+    {
+        ppm_error("failed to write the vault copy");
+        ok = 0;
+    }
+    free(cindex);
+    free(cvalues);
+    return ok;
+}
+
+/* Moves the files written for snapshots in place of their shards' once
+   all of them were written, or removes them all. */
+static unsigned int
+replaceshards(Snapshot **snaps, unsigned int n)
+{
+    unsigned int i, ok = 1;
+
+    for (i = 0; i < n; i++)
+    {
+        if (!snaps[i]->tmp) ok = 0;
+    }
+    for (i = 0; i < n; i++)
+    {
+        Snapshot *snap = snaps[i];
+
+        if (!snap->tmp) 
+            continue;
+        if (!ok)
+        {
+            unlink(snap->tmp);
+            free(snap->tmp);
+        }
+        else
+        {
+            snap->ok = replacefile(snap->tmp, snap->shard->path);
+            if (snap->ok)
+                statshard(snap->shard);
+            ok = snap->ok;
+        }
+        snap->tmp = NULL;
+    }
+    return ok;
+}
+
+/* Writes snapshots of several shards in parallel under the vault's
+   lock. Snapshots are only written if no other process saved since this
+   one last read the vault, as that would lose its changes. Every shard
+   is written to a file of its own before any of them replaces the
+   shard's, a failure to write one leaves all shards as they were.
+   Returns 1 if all of them were written, -1 on such a conflict and 0 on
+   failure; snapshots that weren't written are returned to their
+   shards. */
+static int
+writesnapshots(ppm_Vault *vault, Snapshot **snaps, unsigned int n)
+{
+    unsigned long gen;
+    unsigned int i;
+    int status = 1;
+
+    if (n == 0) 
+        return 1;
+    if (!lockvault(vault, F_WRLCK, 1))
+        status = 0;
+    else
+    {
+        gen = readgen(vault);
+        if (gen != vault->generation)
+            status = -1;
+        else
+        {
+            ppmP_run(writesnapshot, snaps, n);
+            /* Some shards may have been replaced even on failure. */
+            if (!replaceshards(snaps, n))
+                status = 0;
+            if (!writegen(vault, gen + 1))
+                status = 0;
+        }
+        unlockvault(vault);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (status != 0 && snaps[i]->ok)
+        {
+            snaps[i]->shard->envelope = 1;
+            freesnapshot(snaps[i]);
+            continue;
+        }
+        if (status == 1) 
+            status = 0;
+        snaps[i]->conflict = status < 0;
+        returnsnapshot(snaps[i]);
+    }
+
+    /* The data key is on disk now, other processes adopt it. */
+    if (status == 1)
+        forgetkey(vault);
+    return status;
+}
+
+static void *
+saver(void *arg)
+{
+    ppm_Vault *vault = arg;
+    Snapshot **snaps;
+    unsigned int i, n;
+    int status;
+
+    snaps = ppmM_alloc(vault->nshards * sizeof(Snapshot *));
+    pthread_mutex_lock(&vault->savelock);
+    for (;;)
+    {
+        while (!vault->npending && !vault->saverquit)
+            pthread_cond_wait(&vault->savecond, &vault->savelock);
+        if (!vault->npending) break;
+
+        for (i = n = 0; i < vault->nshards; i++)
+        {
+            Shard *shard = vault->shards + i;
+
+            if (!shard->pending) continue;
+            snaps[n++] = shard->pending;
+            shard->pending = NULL;
+        }
+        vault->npending = 0;
+        vault->saving = 1;
+        pthread_mutex_unlock(&vault->savelock);
+
+        /* The shards' envelope flags, stat and the lock are only
+           touched here and, after waiting for this thread, by the
+           vault's own thread. */
+        status = writesnapshots(vault, snaps, n);
+
+        pthread_mutex_lock(&vault->savelock);
+        if (status < 0)
+            vault->conflict = 1;
+        vault->saving = 0;
+        pthread_cond_broadcast(&vault->savecond);
+    }
+    pthread_mutex_unlock(&vault->savelock);
+    free(snaps);
+    return NULL;
+}
+
+static unsigned int
+waitsaver(ppm_Vault *vault)
+{
+    unsigned int i, ok = 1;
+
+    if (vault->saverup)
+    {
+        pthread_mutex_lock(&vault->savelock);
+        while (vault->npending || vault->saving)
+            pthread_cond_wait(&vault->savecond, &vault->savelock);
+        vault->conflict = 0;
+        pthread_mutex_unlock(&vault->savelock);
+    }
+
+    /* Whatever a failed save held is still only in memory. */
+    for (i = 0; i < vault->nshards; i++)
+    {
+        Shard *shard = vault->shards + i;
+
+        if (shard->failed)
+        {
+            shard->failed = 0;
+            shard->dirty = 1;
+            ok = 0;
+        }
+        while (shard->returned)
+        {
+            Snapshot *snap = shard->returned;
+
+            addjournal(shard->changed, snap->changed);
+            if (!snap->conflict)
+                ok = 0;
+            shard->returned = snap->next;
+            shard->dirty = 1;
+            freesnapshot(snap);
+        }
+    }
+    return ok;
+}
+
+static unsigned int
+isdirty(ppm_Vault *vault)
+{
+    unsigned int i;
+
+    for (i = 0; i < vault->nshards; i++)
+    {
+        if (vault->shards[i].dirty) return 1;
+    }
+    return 0;
+}
+
+static unsigned int
+saveall(ppm_Vault *vault)
+{
+    Snapshot **snaps;
+    unsigned int i, n, ok;
+    int status;
+
+    ok = waitsaver(vault);
+    if (!isdirty(vault)) return ok;
+    if (!beginwrite(vault)) return 0;
+
+    ok = 1;
+    snaps = ppmM_alloc(vault->nshards * sizeof(Snapshot *));
+    for (i = n = 0; i < vault->nshards; i++)
+    {
+        Shard *shard = vault->shards + i;
+
+        if (!shard->dirty) continue;
+
+        /* Its values couldn't be read, writing it would lose them. */
+        if (shard->lazy)
+        {
+            ppm_error("%s could not be read, not saving it", shard->path);
+            ok = 0;
+            continue;
+        }
+        snaps[n++] = snapshot(shard);
+    }
+    status = writesnapshots(vault, snaps, n);
+    free(snaps);
+    unlockvault(vault);
+
+    return waitsaver(vault) && status > 0 && ok;
+}
+
+static void
+savebg(ppm_Vault *vault)
+{
+    unsigned int i, conflict;
+
+    if (!isdirty(vault)) return;
+
+    /* Another process saved before the last background save could, the
+       vault has to be refreshed first and that can't wait. */
+    pthread_mutex_lock(&vault->savelock);
+    conflict = vault->conflict;
+    pthread_mutex_unlock(&vault->savelock);
+    if (conflict)
+    {
+        saveall(vault);
+        return;
+    }
+
+    if (!vault->saverup)
+    {
+        if (pthread_create(&vault->saverthread, NULL, saver, vault) != 0)
+        {
+            saveall(vault);
+            return;
+        }
+        vault->saverup = 1;
+    }
+
+    /* Only the newest snapshot of a shard matters, one still waiting
+       for the writer is replaced rather than written after all. */
+    for (i = 0; i < vault->nshards; i++)
+    {
+        Shard *shard = vault->shards + i;
+        Snapshot *snap;
+
+        if (!shard->dirty || shard->lazy) continue;
+        snap = snapshot(shard);
+        pthread_mutex_lock(&vault->savelock);
+        if (shard->pending)
+        {
+            /* Its changes are part of the newer snapshot as well. */
+            addjournal(snap->changed, shard->pending->changed);
+            freesnapshot(shard->pending);
+        }
+        else
+            vault->npending++;
+        shard->pending = snap;
+        pthread_cond_signal(&vault->savecond);
+        pthread_mutex_unlock(&vault->savelock);
+    }
+}
+
+unsigned int
+ppmD_sync(ppm_Vault *vault)
+{
+    unsigned int ok;
+
+    pthread_mutex_lock(&vault->writelock);
+    ok = waitsaver(vault);
+    pthread_mutex_unlock(&vault->writelock);
+    return ok;
+}
+
+void
+ppmD_savebg(ppm_Vault *vault)
+{
+    pthread_mutex_lock(&vault->writelock);
+    savebg(vault);
+    pthread_mutex_unlock(&vault->writelock);
+}
+
+unsigned int
+ppmD_save(ppm_Vault *vault)
+{
+    unsigned int ok;
+
+    pthread_mutex_lock(&vault->writelock);
+    ok = saveall(vault);
+    pthread_mutex_unlock(&vault->writelock);
+    return ok;
+}
+
+unsigned int
+ppmD_dirty(ppm_Vault *vault)
+{
+    unsigned int dirty;
+
+    pthread_mutex_lock(&vault->writelock);
+    dirty = isdirty(vault);
+    pthread_mutex_unlock(&vault->writelock);
+    return dirty;
+}
+
+static unsigned int
+writeheader(ppm_Vault *vault)
+{
+    unsigned char header[PPM_HEADERSIZE];
+    ppm_Header disk;
+    char **tmps, *map;
+    size_t len;
+    unsigned int i, ok = 1, full = 0;
+
+    waitsaver(vault);
+    tmps = ppmM_alloc(vault->nshards * sizeof(char *));
+    for (i = 0; i < vault->nshards; i++)
+    {
+        Shard *shard = vault->shards + i;
+
+        tmps[i] = NULL;
+        if (!shard->envelope) 
+        {
+            shard->dirty = full = 1;
+            continue;
+        }
+        if (!ok || !mapfile(shard->path, &map, &len))
+        {
+            ok = 0;
+            continue;
+        }
+
+        /* Only the header changes, the payload is copied as it is into
+           a file that replaces the shard's like a save does: a crash
+           leaves either the old key slots or the new ones, never a
+           torn header. The IV is taken from the file as it belongs to
+           its payload. */
+        disk = vault->header;
+        if (len < PPM_HEADERSIZE || !ppmA_unpackheader(&disk, (unsigned char *)map))
+        {
+            ppm_error("%s is corrupted", shard->path);
+            ok = 0;
+        }
+        else
+        {
+            memcpy(disk.slots, vault->header.slots, sizeof(disk.slots));
+            ppmA_packheader(&disk, header);
+            tmps[i] = writefile(shard->path, header, PPM_HEADERSIZE, 
+                                map + PPM_HEADERSIZE, len - PPM_HEADERSIZE, NULL, 0);
+            ok = tmps[i] != NULL;
+        }
+        if (map) 
+            munmap(map, len);
+    }
+
+    /* As with shards on a save, no file is replaced unless all of
+       them were written. */
+    for (i = 0; i < vault->nshards; i++)
+    {
+        Shard *shard = vault->shards + i;
+
+        if (!tmps[i]) 
+            continue;
+        if (!ok)
+        {
+            unlink(tmps[i]);
+            free(tmps[i]);
+            continue;
+        }
+        ok = replacefile(tmps[i], shard->path);
+        if (ok)
+            statshard(shard);
+    }
+    free(tmps);
+    if (!ok)
+        return 0;
+    return full ? saveall(vault) : 1;
+}
+
+/* Changes the key slots with fn, other processes are kept out from
+   before the slots are read until every file holds the new ones. */
+static unsigned int
+changekeys(ppm_Vault *vault, unsigned int (*fn)(const ppm_Key *, ppm_Header *, const char *), const char *key)
+{
+    unsigned int ok;
+
+    waitsaver(vault);
+    if (!beginwrite(vault))
+        return 0;
+    ok = fn(&vault->key, &vault->header, key) && writeheader(vault);
+    if (ok)
+        ok = writegen(vault, vault->generation + 1);
+    unlockvault(vault);
+    return ok;
+}
+
+static unsigned int
+countshards(const char *dir)
+{
+    char *path;
+    unsigned int n;
+
+    path = ppmM_alloc(strlen(dir) + 16);
+    for (n = 0;; n++)
+    {
+        sprintf(path, "%s/%u", dir, n);
+        if (access(path, F_OK) != 0) break;
+    }
+    errno = 0;
+    free(path);
+    return n;
+}
+
+static void
+eachnode(ppm_Vault *vault, void (*fn)(ppm_Node *, void *), void *arg)
+{
+    unsigned int i, j;
+    ppm_Node *node;
+
+    for (i = 0; i < vault->nshards; i++)
+    {
+        ppm_Table *table = vault->shards[i].table;
+
+        for (j = 0; j < table->size; j++)
+        {
+            for (node = table->nodes[j]; node; node = node->next)
+                fn(node, arg);
+        }
+    }
+}
+
+static void
+indexall(ppm_Vault *vault)
+{
+    struct timespec start;
+
+    ppmF_start(&start);
+    eachnode(vault, indexnode, &vault->index);
+    ppmF_stop(PPM_PHASE_INDEX, &start);
+}
+
+static unsigned int
+readvault(ppm_Vault *vault, const char *key)
+{
+    unsigned int i;
+
+    switch (readheader(vault->shards[0].path, &vault->header))
+    {
+    case DB_NEW:
+        vault->newkey = ppmM_strdup(key);
+        return ppmA_newkey(&vault->key, &vault->header, key);
+
+    case DB_LEGACY:
+        if (vault->nshards > 1 || vault->shards[0].path != vault->path)
+        {
+            ppm_error("%s is not a ppm file", vault->shards[0].path);
+            return 0;
+        }
+        if (!loadlegacy(vault, key))
+            return 0;
+        vault->newkey = ppmM_strdup(key);
+        indexall(vault);
+        return 1;
+
+    case DB_ENVELOPE:
+        if (!ppmA_initcipher(&vault->key, &vault->header, key))
+            return 0;
+        break;
+
+    default:
+        return 0;
+    }
+
+    /* The data key is known, decrypting and parsing the shards is
+       independent work. */
+    ppmP_run(loadshard, vault, vault->nshards);
+    for (i = 0; i < vault->nshards; i++)
+    {
+        if (vault->shards[i].failed) return 0;
+    }
+
+    /* The indexes span all shards, they are built once loading is done
+       rather than by the loaders running in parallel. */
+    indexall(vault);
+    return 1;
+}
+
+/* Reads the vault under a shared lock, so no other process is in the
+   middle of saving it. */
+static unsigned int
+load(ppm_Vault *vault, const char *key)
+{
+    unsigned int ok;
+
+    if (!lockvault(vault, F_RDLCK, 0))
+        return 0;
+    vault->generation = readgen(vault);
+    ok = readvault(vault, key);
+    unlockvault(vault);
+    return ok;
+}
+
+ppm_Vault *
+ppmD_open(const char *path, const char *key, unsigned int nshards)
+{
+    ppm_Vault *vault;
+    struct stat st;
+    char *home;
+    unsigned int i, sharded = 0, created = 0;
+
+    vault = NEW(ppm_Vault);
+    memset(vault, 0, sizeof(ppm_Vault));
+    vault->key.slot = -1;
+    vault->lockfd = -1;
+    pthread_mutex_init(&vault->savelock, NULL);
+    pthread_mutex_init(&vault->writelock, NULL);
+    pthread_cond_init(&vault->savecond, NULL);
+
+    if (!path)
+    {
+        home = gethome();
+        if (!home) 
+        {
+            ppmD_close(vault);
+            return NULL;
+        }
+        vault->path = ppmM_alloc(strlen(home) + 6); 
+        sprintf(vault->path, "%s/.ppm", home);
+    }
+    else
+        vault->path = ppmM_strdup(path);
+
+    vault->nshards = 1;
+    if (stat(vault->path, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        vault->nshards = countshards(vault->path);
+
+        /* Another process created the vault and is yet to save it, the
+           first save wins and the other is merged into it. */
+        if (vault->nshards == 0 && nshards > 1)
+        {
+            vault->nshards = nshards;
+            created = 1;
+        }
+        if (vault->nshards == 0)
+        {
+            ppm_error("%s is a directory without any shards", vault->path);
+            ppmD_close(vault);
+            return NULL;
+        }
+        sharded = 1;
+    }
+    else
+    if (errno == ENOENT && nshards > 1)
+    {
+        errno = 0;
+        if (mkdir(vault->path, 0700) != 0 && errno != EEXIST)
+        {
+            ppm_error("failed to create %s", vault->path);
+            ppmD_close(vault);
+            return NULL;
+        }
+        vault->nshards = nshards;
+        sharded = created = 1;
+    }
+    errno = 0;
+
+    /* The lock file lives next to a single file vault, a sharded one
+       keeps it in its directory. */
+    vault->lockpath = ppmM_alloc(strlen(vault->path) + 8);
+    sprintf(vault->lockpath, sharded ? "%s/lock" : "%s.lock", vault->path);
+
+    vault->shards = ppmM_alloc(vault->nshards * sizeof(Shard));
+    for (i = 0; i < vault->nshards; i++)
+    {
+        Shard *shard = vault->shards + i;
+
+        shard->vault = vault;
+        if (sharded)
+        {
+            shard->path = ppmM_alloc(strlen(vault->path) + 16);
+            sprintf(shard->path, "%s/%u", vault->path, i);
+        }
+        else
+            shard->path = vault->path;
+        shard->table = ppmT_new(32);
+        shard->changed = ppmT_new(32);
+        shard->ino = 0;
+        shard->returned = NULL;
+        shard->dirty = created;
+        shard->envelope = 0;
+        shard->failed = 0;
+        shard->pending = NULL;
+        shard->lazy = NULL;
+    }
+
+    if (!load(vault, key))
+    {
+        ppmD_close(vault);
+        return NULL;
+    }
+    return vault;
+}
+
+ppm_Table *
+ppmD_load(const char *path, const char *key)
+{
+    ppm_Key datakey;
+    ppm_Header header;
+    ppm_Table *table;
+    struct stat st;
+    char *file, *map;
+    unsigned int i, n = 1, sharded = 0, ok = 1;
+    size_t len;
+
+    /* Reads another vault, in whatever layout, into a plain table
+       without opening it. */
+    if (stat(path, &st) != 0)
+    {
+        ppm_error("failed to open %s", path);
+        errno = 0;
+        return NULL;
+    }
+    if (S_ISDIR(st.st_mode))
+    {
+        n = countshards(path);
+        sharded = 1;
+    }
+
+    file = ppmM_alloc(strlen(path) + 16);
+    table = ppmT_new(32);
+    for (i = 0; ok && i < n; i++)
+    {
+        if (sharded)
+            sprintf(file, "%s/%u", path, i);
+        else
+            strcpy(file, path);
+
+        ok = mapfile(file, &map, &len);
+        if (!ok || !map) continue;
+        if (len < PPM_HEADERSIZE || !ppmA_unpackheader(&header, (unsigned char *)map))
+        {
+            ppm_error("%s is not a ppm file, or one written by an older version", file);
+            munmap(map, len);
+            ok = 0;
+            continue;
+        }
+
+        /* All shards share a data key, only the first one needs the
+           expensive key derivation. */
+        if (i == 0 && !ppmA_initcipher(&datakey, &header, key))
+        {
+            munmap(map, len);
+            ok = 0;
+            continue;
+        }
+        ok = readdata(&datakey, &header, file, map, len, table, NULL);
+    }
+    ppmA_cleanup(&datakey);
+    free(file);
+
+    if (!ok)
+    {
+        ppmT_free(table);
+        return NULL;
+    }
+    return table;
+}
+
+const char *
+ppmD_path(const ppm_Vault *vault)
+{
+    return vault->path;
+}
+
+size_t
+ppmD_count(ppm_Vault *vault)
+{
+    unsigned int i;
+    size_t n = 0;
+
+    pthread_mutex_lock(&vault->writelock);
+    for (i = 0; i < vault->nshards; i++)
+        n += vault->shards[i].table->count;
+    pthread_mutex_unlock(&vault->writelock);
+    return n;
+}
+
+unsigned int
+ppmD_stats(ppm_Vault *vault, ppm_TableStats *stats)
+{
+    unsigned int i, ok;
+
+    memset(stats, 0, sizeof(ppm_TableStats));
+    pthread_mutex_lock(&vault->writelock);
+    ok = allvalues(vault);
+    for (i = 0; ok && i < vault->nshards; i++)
+        ppmT_stats(vault->shards[i].table, stats);
+    pthread_mutex_unlock(&vault->writelock);
+    return ok;
+}
+
+unsigned int
+ppmD_validname(const char *app)
+{
+    return !strpbrk(app, "\t\n");
+}
+
+static unsigned int
+checkname(const char *app)
+{
+    if (ppmD_validname(app)) 
+        return 1;
+    ppm_error("invalid name '%s', names can't contain tabs or newlines", app);
+    return 0;
+}
+
+unsigned int
+ppmD_put(ppm_Vault *vault, const char *app, const char *pass)
+{
+    Shard *shard;
+    unsigned int ok;
+
+    if (!checkname(app))
+        return 0;
+
+    /* Nothing changes in a shard whose values can't be read, they would
+       be lost when saving it. */
+    pthread_mutex_lock(&vault->writelock);
+    shard = getshard(vault, app);
+    ok = values(shard);
+    if (ok)
+    {
+        store(shard, app, pass, time(NULL));
+        journal(shard, app);
+    }
+    pthread_mutex_unlock(&vault->writelock);
+    return ok;
+}
+
+unsigned int
+ppmD_copy(ppm_Vault *vault, const ppm_Node *from)
+{
+    Shard *shard;
+    unsigned int ok;
+
+    if (!checkname(from->key))
+        return 0;
+
+    /* Takes an entry from another vault as it is, times and tags
+       included. */
+    pthread_mutex_lock(&vault->writelock);
+    shard = getshard(vault, from->key);
+    ok = values(shard);
+    if (ok)
+    {
+        copyentry(shard, from);
+        journal(shard, from->key);
+    }
+    pthread_mutex_unlock(&vault->writelock);
+    return ok;
+}
+
+unsigned int
+ppmD_addkey(ppm_Vault *vault, const char *key)
+{
+    unsigned int ok;
+
+    pthread_mutex_lock(&vault->writelock);
+    ok = changekeys(vault, ppmA_addkey, key);
+    pthread_mutex_unlock(&vault->writelock);
+    return ok;
+}
+
+unsigned int
+ppmD_rmkey(ppm_Vault *vault, const char *key)
+{
+    unsigned int ok;
+
+    pthread_mutex_lock(&vault->writelock);
+    ok = changekeys(vault, ppmA_rmkey, key);
+    pthread_mutex_unlock(&vault->writelock);
+    return ok;
+}
+
+unsigned int
+ppmD_rekey(ppm_Vault *vault, const char *key)
+{
+    unsigned int ok;
+
+    pthread_mutex_lock(&vault->writelock);
+    ok = changekeys(vault, ppmA_rekey, key);
+    pthread_mutex_unlock(&vault->writelock);
+    return ok;
+}
+
+unsigned int
+ppmD_keycount(ppm_Vault *vault)
+{
+    unsigned int n;
+
+    pthread_mutex_lock(&vault->writelock);
+    n = ppmA_keycount(&vault->header);
+    pthread_mutex_unlock(&vault->writelock);
+    return n;
+}
+
+unsigned int
+ppmD_remove(ppm_Vault *vault, const char *app)
+{
+    Shard *shard;
+    unsigned int found;
+
+    pthread_mutex_lock(&vault->writelock);
+    shard = getshard(vault, app);
+    found = values(shard) && removeentry(shard, app);
+    if (found)
+        journal(shard, app);
+    pthread_mutex_unlock(&vault->writelock);
+    return found;
+}
+
+static unsigned int
+settag(ppm_Vault *vault, const char *app, const char *tag, unsigned int add)
+{
+    Shard *shard;
+    ppm_Node *node;
+    ppm_String tags;
+    const char *p, *end;
+    size_t len = strlen(tag);
+    unsigned int found = 0;
+
+    shard = getshard(vault, app);
+    node = ppmT_getnode(shard->table, app);
+    if (!node || !values(shard))
+        return 0;
+
+    /* Rebuild the list without tag, then append it when adding. */
+    ppmS_init(&tags, NULL);
+    for (p = node->tags; p && *p; p = *end ? end + 1 : end)
+    {
+        end = strchr(p, ',');
+        if (!end) end = p + strlen(p);
+        if ((size_t)(end - p) == len && strncmp(p, tag, len) == 0)
+        {
+            found = 1;
+            continue;
+        }
+        if (tags.len) ppmS_addch(&tags, ',');
+        while (p < end) ppmS_addch(&tags, *p++);
+    }
+    if (add)
+    {
+        if (tags.len) ppmS_addch(&tags, ',');
+        ppmS_append(&tags, tag);
+    }
+    if (found != add)
+    {
+        ppmX_settags(&vault->index, node, tags.cstr);
+        journal(shard, app);
+        shard->dirty = 1;
+    }
+    free(tags.cstr);
+    return 1;
+}
+
+unsigned int
+ppmD_tag(ppm_Vault *vault, const char *app, const char *tag, unsigned int add)
+{
+    unsigned int ok;
+
+    pthread_mutex_lock(&vault->writelock);
+    ok = settag(vault, app, tag, add);
+    pthread_mutex_unlock(&vault->writelock);
+    return ok;
+}
+
+unsigned int
+ppmD_tagged(ppm_Vault *vault, const char *tag, void (*fn)(ppm_Node *, void *), void *arg)
+{
+    unsigned int ok;
+
+    pthread_mutex_lock(&vault->writelock);
+    ok = allvalues(vault);
+    if (ok)
+        ppmX_tagged(&vault->index, tag, fn, arg);
+    pthread_mutex_unlock(&vault->writelock);
+    return ok;
+}
+
+unsigned int
+ppmD_stale(ppm_Vault *vault, time_t before, void (*fn)(ppm_Node *, void *), void *arg)
+{
+    unsigned int ok;
+
+    pthread_mutex_lock(&vault->writelock);
+    ok = allvalues(vault);
+    if (ok)
+        ppmX_older(&vault->index, before, fn, arg);
+    pthread_mutex_unlock(&vault->writelock);
+    return ok;
+}
+
+unsigned int
+ppmD_foreach(ppm_Vault *vault, void (*fn)(ppm_Node *, void *), void *arg)
+{
+    unsigned int ok;
+
+    pthread_mutex_lock(&vault->writelock);
+    ok = allvalues(vault);
+    if (ok)
+        eachnode(vault, fn, arg);
+    pthread_mutex_unlock(&vault->writelock);
+    return ok;
+}
+
+typedef struct
+{
+    void (*fn)(const char *, void *);
+    void *arg;
+}
+Names;
+
+static void
+eachname(ppm_Node *node, void *arg)
+{
+    Names *names = arg;
+
+    names->fn(node->key, names->arg);
+}
+
+void
+ppmD_names(ppm_Vault *vault, void (*fn)(const char *, void *), void *arg)
+{
+    Names names;
+
+    /* Keys are all in the index, the values are left as they are. */
+    names.fn = fn;
+    names.arg = arg;
+    pthread_mutex_lock(&vault->writelock);
+    eachnode(vault, eachname, &names);
+    pthread_mutex_unlock(&vault->writelock);
+}
+
+unsigned int
+ppmD_has(ppm_Vault *vault, const char *app)
+{
+    return ppmT_getnode(getshard(vault, app)->table, app) != NULL;
+}
+
+/* Readers only take writelock to fill in the values of a shard read
+   lazily, once. Writers never wait for readers, so this is safe in a
+   read section as well. Returns NULL if the values can't be read. */
+static ppm_Table *
+valuetable(ppm_Vault *vault, const char *app)
+{
+    Shard *shard = getshard(vault, app);
+    unsigned int ok = 1;
+
+    if (PPM_LOAD(shard->lazy))
+    {
+        pthread_mutex_lock(&vault->writelock);
+        ok = values(shard);
+        pthread_mutex_unlock(&vault->writelock);
+    }
+    return ok ? shard->table : NULL;
+}
+
+ppm_Node *
+ppmD_getnode(ppm_Vault *vault, const char *app)
+{
+    ppm_Table *table = valuetable(vault, app);
+
+    return table ? ppmT_getnode(table, app) : NULL;
+}
+
+char *
+ppmD_get(ppm_Vault *vault, const char *app)
+{
+    ppm_Table *table = valuetable(vault, app);
+
+    return table ? ppmT_get(table, app) : NULL;
+}
+
+/* The path of app's attachment, its directory when app is NULL. */
+static char *
+attachpath(ppm_Vault *vault, const ppm_Key *key, const char *app)
+{
+    char *path;
+    size_t len = strlen(vault->path);
+
+    path = ppmM_alloc(len + PPM_NAMESIZE + 8);
+    sprintf(path, vault->shards[0].path != vault->path ? "%s/files" : "%s.files", vault->path);
+    if (app)
+    {
+        strcat(path, "/");
+        ppmA_name(key, app, path + strlen(path));
+    }
+    return path;
+}
+
+/* The data key, once it is certain to be the vault's for good. A vault
+   that was never written may yet adopt the key of another process, it
+   is saved first. */
+static unsigned int
+attachkey(ppm_Vault *vault, ppm_Key *key)
+{
+    unsigned int ok = 1;
+
+    pthread_mutex_lock(&vault->writelock);
+    if (vault->newkey)
+        ok = saveall(vault);
+    if (ok)
+        *key = vault->key;
+    pthread_mutex_unlock(&vault->writelock);
+    return ok;
+}
+
+/* Reads up to size bytes of a stream, last is set if nothing follows
+   them. */
+static size_t
+readchunk(FILE *in, char *buf, size_t size, unsigned int *last)
+{
+    size_t n;
+    int c;
+
+    n = fread(buf, 1, size, in);
+    c = n < size ? EOF : getc(in);
+    *last = c == EOF;
+    if (!*last)
+        ungetc(c, in);
+    return n;
+}
+
+unsigned int
+ppmD_attach(ppm_Vault *vault, const char *app, FILE *in)
+{
+    ppm_Key key;
+    ppm_Chunks *chunks;
+    unsigned char prefix[PPM_PREFIXSIZE];
+    char *dir, *path, *tmp, *buf, *crypt;
+    size_t n, len;
+    int fd;
+    unsigned int ok, last = 0;
+
+    if (!attachkey(vault, &key))
+        return 0;
+    dir = attachpath(vault, &key, NULL);
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+    {
+        ppm_error("failed to create %s", dir);
+        free(dir);
+        ppmA_cleanup(&key);
+        return 0;
+    }
+    errno = 0;
+    free(dir);
+
+    /* Written next to where it goes and renamed over it, like the
+       vault's own files. */
+    path = attachpath(vault, &key, app);
+    tmp = ppmM_alloc(strlen(path) + 8);
+    sprintf(tmp, "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd < 0)
+    {
+        ppm_error("failed to create %s", tmp);
+        free(tmp);
+        free(path);
+        ppmA_cleanup(&key);
+        return 0;
+    }
+
+    buf = ppmM_alloc(CHUNKSIZE);
+    crypt = ppmM_alloc(CHUNKSIZE + PPM_TAGSIZE);
+    chunks = ppmA_chunkstart(&key, prefix, app, 1);
+    ok = chunks && writeall(fd, ATTACHMAGIC, 4) && writeall(fd, prefix, PPM_PREFIXSIZE);
+    while (ok && !last)
+    {
+        n = readchunk(in, buf, CHUNKSIZE, &last);
+        if (ferror(in))
+        {
+            ppm_error("failed to read the attachment");
+            ok = 0;
+            break;
+        }
+        len = ppmA_chunk(chunks, buf, n, last, crypt);
+        ok = len != (size_t)-1 && writeall(fd, crypt, len);
+    }
+    ok = ok && fsync(fd) == 0;
+    ppmA_chunkend(chunks);
+    OPENSSL_cleanse(buf, CHUNKSIZE);
+    free(buf);
+    free(crypt);
+    ppmA_cleanup(&key);
+
+    if (close(fd) != 0 || !ok || rename(tmp, path) != 0)
+    {
+        ppm_error("failed to write %s", path);
+        unlink(tmp);
+        ok = 0;
+    }
+    else
+        syncdir(path);
+    free(tmp);
+    free(path);
+    return ok;
+}
+
+unsigned int
+ppmD_extract(ppm_Vault *vault, const char *app, FILE *out)
+{
+    ppm_Key key;
+    ppm_Chunks *chunks;
+    unsigned char head[4 + PPM_PREFIXSIZE];
+    char *path, *buf, *plain;
+    FILE *file;
+    size_t n, len;
+    unsigned int ok, last = 0;
+
+    if (!attachkey(vault, &key))
+        return 0;
+    path = attachpath(vault, &key, app);
+    file = fopen(path, "rb");
+    if (!file)
+    {
+        if (errno == ENOENT)
+        {
+            errno = 0;
+            ppm_error("'%s' has no attachment", app);
+        }
+        else
+            ppm_error("failed to open %s", path);
+        free(path);
+        ppmA_cleanup(&key);
+        return 0;
+    }
+
+    if (fread(head, 1, sizeof(head), file) != sizeof(head) || memcmp(head, ATTACHMAGIC, 4) != 0)
+    {
+        ppm_error("%s is not a ppm attachment", path);
+        fclose(file);
+        free(path);
+        ppmA_cleanup(&key);
+        return 0;
+    }
+
+    /* Each chunk is checked before any of it is written. */
+    buf = ppmM_alloc(CHUNKSIZE + PPM_TAGSIZE);
+    plain = ppmM_alloc(CHUNKSIZE);
+    chunks = ppmA_chunkstart(&key, head + 4, app, 0);
+    ok = chunks != NULL;
+    while (ok && !last)
+    {
+        n = readchunk(file, buf, CHUNKSIZE + PPM_TAGSIZE, &last);
+        if (ferror(file))
+        {
+            ppm_error("failed to read %s", path);
+            ok = 0;
+            break;
+        }
+        len = ppmA_chunk(chunks, buf, n, last, plain);
+        ok = len != (size_t)-1;
+        if (ok && fwrite(plain, 1, len, out) != len)
+        {
+            ppm_error("failed to write the attachment");
+            ok = 0;
+        }
+    }
+    if (ok && fflush(out) != 0)
+    {
+        ppm_error("failed to write the attachment");
+        ok = 0;
+    }
+    ppmA_chunkend(chunks);
+    OPENSSL_cleanse(plain, CHUNKSIZE);
+    fclose(file);
+    free(buf);
+    free(plain);
+    free(path);
+    ppmA_cleanup(&key);
+    return ok;
+}
+
+unsigned int
+ppmD_detach(ppm_Vault *vault, const char *app)
+{
+    ppm_Key key;
+    struct stat st;
+    char *path;
+    unsigned int ok, written;
+
+    /* Never saves: a vault that was never written has no attachments
+       under its key yet, nor does one without a files directory. */
+    pthread_mutex_lock(&vault->writelock);
+    written = !vault->newkey;
+    key = vault->key;
+    pthread_mutex_unlock(&vault->writelock);
+
+    path = attachpath(vault, &key, NULL);
+    ok = written && stat(path, &st) == 0;
+    errno = 0;
+    free(path);
+    if (!ok)
+    {
+        ppmA_cleanup(&key);
+        return 0;
+    }
+
+    path = attachpath(vault, &key, app);
+    ok = unlink(path) == 0;
+    if (!ok && errno != ENOENT)
+        ppm_error("failed to remove %s", path);
+    errno = 0;
+    free(path);
+    ppmA_cleanup(&key);
+    return ok;
+}
+
+void
+ppmD_concurrent(ppm_Vault *vault)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&vault->writelock);
+    if (!vault->epoch)
+    {
+        vault->epoch = ppmR_new();
+        for (i = 0; i < vault->nshards; i++)
+            vault->shards[i].table->epoch = vault->epoch;
+        vault->index.epoch = vault->epoch;
+    }
+    pthread_mutex_unlock(&vault->writelock);
+}
+
+void
+ppmD_readbegin(ppm_Vault *vault)
+{
+    ppmR_enter(vault->epoch);
+}
+
+void
+ppmD_readend(ppm_Vault *vault)
+{
+    ppmR_exit(vault->epoch);
+}
+
+#ifdef __linux__
+
+/* Applies the saves of other processes since the vault was last read
+   or written, for a save of this process there is nothing to do. */
+static void
+reload(ppm_Vault *vault)
+{
+    unsigned long gen;
+
+    waitsaver(vault);
+    if (!lockvault(vault, F_RDLCK, 0))
+        return;
+    gen = readgen(vault);
+    if (gen != vault->generation && refresh(vault))
+        vault->generation = gen;
+    unlockvault(vault);
+}
+
+static void *
+watcher(void *arg)
+{
+    ppm_Vault *vault = arg;
+    union
+    {
+        struct inotify_event event;
+        char buf[4096];
+    }
+    events;
+    struct inotify_event *event;
+    struct pollfd fds[2];
+    const char *lockname;
+    unsigned int changed;
+    ssize_t n;
+    char *p;
+
+    lockname = strrchr(vault->lockpath, '/');
+    lockname = lockname ? lockname + 1 : vault->lockpath;
+
+    fds[0].fd = vault->watchfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = vault->watchpipe[0];
+    fds[1].events = POLLIN;
+    for (;;)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents) break;
+
+        n = read(vault->watchfd, events.buf, sizeof(events.buf));
+        if (n <= 0) continue;
+
+        /* Every save rewrites the lock file last, the vault's own files
+           are of no interest. A burst of events is a single reload. */
+        changed = 0;
+        for (p = events.buf; p < events.buf + n; p += sizeof(struct inotify_event) + event->len)
+        {
+            event = (struct inotify_event *)p;
+            if (event->len && strcmp(event->name, lockname) == 0)
+                changed = 1;
+        }
+        if (!changed) continue;
+
+        pthread_mutex_lock(&vault->writelock);
+        reload(vault);
+        pthread_mutex_unlock(&vault->writelock);
+    }
+    return NULL;
+}
+
+unsigned int
+ppmD_watch(ppm_Vault *vault)
+{
+    char *dir, *slash;
+    int wd;
+
+    ppmD_concurrent(vault);
+    pthread_mutex_lock(&vault->writelock);
+    if (vault->watching)
+    {
+        pthread_mutex_unlock(&vault->writelock);
+        return 1;
+    }
+
+    /* The directory is watched rather than the lock file, which may
+       not exist yet. */
+    dir = ppmM_strdup(vault->lockpath);
+    slash = strrchr(dir, '/');
+    if (!slash)
+        strcpy(dir, ".");
+    else
+        slash[slash == dir ? 1 : 0] = '\0';
+
+    vault->watchfd = inotify_init();
+    wd = vault->watchfd < 0 ? -1 
+       : inotify_add_watch(vault->watchfd, dir, IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_MOVED_TO);
+    if (wd < 0 || pipe(vault->watchpipe) != 0)
+    {
+        ppm_error("failed to watch %s", dir);
+        if (vault->watchfd >= 0) close(vault->watchfd);
+        free(dir);
+        pthread_mutex_unlock(&vault->writelock);
+        return 0;
+    }
+    free(dir);
+
+    if (pthread_create(&vault->watchthread, NULL, watcher, vault) != 0)
+    {
+        ppm_error("failed to start watching %s", vault->path);
+        close(vault->watchfd);
+        close(vault->watchpipe[0]);
+        close(vault->watchpipe[1]);
+        pthread_mutex_unlock(&vault->writelock);
+        return 0;
+    }
+    vault->watching = 1;
+    pthread_mutex_unlock(&vault->writelock);
+    return 1;
+}
+
+static void
+unwatch(ppm_Vault *vault)
+{
+    if (!vault->watching) return;
+    while (write(vault->watchpipe[1], "", 1) < 0 && errno == EINTR);
+    pthread_join(vault->watchthread, NULL);
+    close(vault->watchfd);
+    close(vault->watchpipe[0]);
+    close(vault->watchpipe[1]);
+    vault->watching = 0;
+}
+
+#else
+
+unsigned int
+ppmD_watch(ppm_Vault *vault)
+{
+    ppm_error("watching %s is not supported on this system", vault->path);
+    return 0;
+}
+
+static void
+unwatch(ppm_Vault *vault)
+{
+}
+
+#endif /* __linux__ */
+
+void
+ppmD_close(ppm_Vault *vault)
+{
+    unsigned int i;
+
+    if (!vault) return;
+
+    /* The watcher goes first, it may be waiting for the saver. */
+    unwatch(vault);
+    if (vault->saverup)
+    {
+        waitsaver(vault);
+        pthread_mutex_lock(&vault->savelock);
+        vault->saverquit = 1;
+        pthread_cond_signal(&vault->savecond);
+        pthread_mutex_unlock(&vault->savelock);
+        pthread_join(vault->saverthread, NULL);
+    }
+
+    /* The data key goes last, a save still in flight needs it. */
+    ppmX_cleanup(&vault->index);
+    for (i = 0; vault->shards && i < vault->nshards; i++)
+    {
+        while (vault->shards[i].returned)
+        {
+            Snapshot *snap = vault->shards[i].returned;
+
+            vault->shards[i].returned = snap->next;
+            freesnapshot(snap);
+        }
+        freelazy(vault->shards[i].lazy);
+        ppmT_free(vault->shards[i].table);
+        ppmT_free(vault->shards[i].changed);
+        if (vault->shards[i].path != vault->path)
+            free(vault->shards[i].path);
+    }
+    free(vault->shards);
+    free(vault->path);
+    if (vault->lockfd >= 0)
+        close(vault->lockfd);
+    free(vault->lockpath);
+    forgetkey(vault);
+    ppmR_free(vault->epoch);
+    ppmA_cleanup(&vault->key);
+    pthread_mutex_destroy(&vault->savelock);
+    pthread_mutex_destroy(&vault->writelock);
+    pthread_cond_destroy(&vault->savecond);
+    free(vault);
 }
@@ -27,13 +27,73 @@
 #ifndef PPM_DB_H
 #define PPM_DB_H
 
-extern unsigned int ppmD_init(void);
-extern char *ppmD_get(const char * /* app */);
-extern void ppmD_add(const char * /* app */, const char * /* pass */);
-extern unsigned int ppmD_save(void);
-extern void ppmD_update(const char * /* app */, const char * /* pass */);
-extern void ppmD_list(void);
-extern void ppmD_cleanup(void);
-extern void ppmD_rm(const char * /* app */);
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "ppm_string.h"
+#include "ppm_table.h"
+
+struct ppm_node;
+struct ppm_table;
+
+/* An open vault, obtained from ppmD_open and released with ppmD_close.
+   Separate vaults share no state. Within one vault changes and walks
+   over the entries are serialized, callbacks must not call back into
+   the vault. After ppmD_concurrent, ppmD_get and ppmD_getnode can run
+   on any number of threads alongside them without locking: between
+   ppmD_readbegin and ppmD_readend the key, value and tags they return
+   stay valid, other fields of a node are only safe to read from the
+   thread making changes. ppmD_watch applies saves made by other
+   processes on a thread of its own and makes the vault concurrent.
+   Values are only decrypted once something needs them, ppmD_names and
+   ppmD_has never do. Everything else needing them fails, returning 0 or
+   NULL, when those of the entry's shard or, for walks and stats, of any
+   shard can't be read. ppmD_put and ppmD_copy refuse names that
+   ppmD_validname rejects, the index keeps them as they are and a tab
+   or newline would split them. Files attached to an entry are kept apart from it
+   and only read by ppmD_extract, ppmD_remove leaves them for
+   ppmD_detach. */
+typedef struct ppm_vault ppm_Vault;
+
+extern ppm_Vault *ppmD_open(const char * /* path */, const char * /* key */, unsigned int /* shards */);
+extern void ppmD_close(ppm_Vault * /* vault */);
+extern const char *ppmD_path(const ppm_Vault * /* vault */);
+extern char *ppmD_get(ppm_Vault * /* vault */, const char * /* app */);
+extern struct ppm_node *ppmD_getnode(ppm_Vault * /* vault */, const char * /* app */);
+extern unsigned int ppmD_put(ppm_Vault * /* vault */, const char * /* app */, const char * /* pass */);
+extern unsigned int ppmD_remove(ppm_Vault * /* vault */, const char * /* app */);
+extern unsigned int ppmD_copy(ppm_Vault * /* vault */, const struct ppm_node * /* node */);
+extern unsigned int ppmD_tag(ppm_Vault * /* vault */, const char * /* app */, const char * /* tag */, unsigned int /* add */);
+extern unsigned int ppmD_tagged(ppm_Vault * /* vault */, const char * /* tag */, void (* /* fn */)(struct ppm_node *, void *), void * /* arg */);
+extern unsigned int ppmD_stale(ppm_Vault * /* vault */, time_t /* before */, void (* /* fn */)(struct ppm_node *, void *), void * /* arg */);
+extern unsigned int ppmD_foreach(ppm_Vault * /* vault */, void (* /* fn */)(struct ppm_node *, void *), void * /* arg */);
+extern void ppmD_names(ppm_Vault * /* vault */, void (* /* fn */)(const char *, void *), void * /* arg */);
+extern unsigned int ppmD_has(ppm_Vault * /* vault */, const char * /* app */);
+extern unsigned int ppmD_validname(const char * /* app */);
+extern unsigned int ppmD_attach(ppm_Vault * /* vault */, const char * /* app */, FILE * /* in */);
+extern unsigned int ppmD_extract(ppm_Vault * /* vault */, const char * /* app */, FILE * /* out */);
+extern unsigned int ppmD_detach(ppm_Vault * /* vault */, const char * /* app */);
+extern size_t ppmD_count(ppm_Vault * /* vault */);
+extern unsigned int ppmD_stats(ppm_Vault * /* vault */, ppm_TableStats * /* stats */);
+extern unsigned int ppmD_save(ppm_Vault * /* vault */);
+extern void ppmD_savebg(ppm_Vault * /* vault */);
+extern unsigned int ppmD_sync(ppm_Vault * /* vault */);
+extern unsigned int ppmD_dirty(ppm_Vault * /* vault */);
+extern unsigned int ppmD_addkey(ppm_Vault * /* vault */, const char * /* key */);
+extern unsigned int ppmD_rmkey(ppm_Vault * /* vault */, const char * /* key */);
+extern unsigned int ppmD_rekey(ppm_Vault * /* vault */, const char * /* key */);
+extern unsigned int ppmD_keycount(ppm_Vault * /* vault */);
+extern void ppmD_concurrent(ppm_Vault * /* vault */);
+extern void ppmD_readbegin(ppm_Vault * /* vault */);
+extern void ppmD_readend(ppm_Vault * /* vault */);
+extern unsigned int ppmD_watch(ppm_Vault * /* vault */);
+extern struct ppm_table *ppmD_load(const char * /* path */, const char * /* key */);
+
+/* Building blocks of a single file vault in the version 2 layout:
+   serialize adds an entry to the index and values, writecopy encrypts
+   them under a new data key for key and writes the file to out. */
+extern void ppmD_serialize(ppm_String * /* index */, ppm_String * /* values */, const struct ppm_node * /* node */);
+extern unsigned int ppmD_writecopy(FILE * /* out */, const char * /* key */, const ppm_String * /* index */, const ppm_String * /* values */);
 
 #endif /* PPM_DB_H */
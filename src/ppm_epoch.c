@@ -0,0 +1,248 @@
+/*
+ * ppm_epoch.c
+ *
+ * Copyright (C) 2014 Niels Vanden Eynde
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "ppm_epoch.h"
+#include "ppm_mem.h"
+
+/* Retired memory piles up to this much before the writer tries to move
+   the epoch on and free what is old enough. */
+#define LIMBO_BATCH 128
+
+/* Keeps the records of different threads on separate cache lines. */
+#define CACHE_LINE 64
+
+/* A thread's announcement, its epoch shifted left by one and the low
+   bit set while it is reading. Records are never freed before the
+   epoch itself, a thread that exits leaves its record for the next. */
+typedef struct reader
+{
+    unsigned long state;
+    unsigned int depth;
+    unsigned int used;
+    struct reader *next;
+    char pad[CACHE_LINE];
+}
+Reader;
+
+typedef struct retired
+{
+    void *ptr;
+    ppm_Free *fn;
+    unsigned long epoch;
+    struct retired *next;
+}
+Retired;
+
+struct ppm_epoch
+{
+    unsigned long epoch;
+    pthread_key_t key;
+
+    /* Guards the list of readers, taken when a thread reads for the
+       first time and when the writer scans it. */
+    pthread_mutex_t lock;
+    Reader *readers;
+
+    /* Oldest first, only touched by the writer. Pending counts what
+       was retired since the last attempt to reclaim. */
+    Retired *limbo;
+    Retired **tail;
+    unsigned int pending;
+};
+
+static void
+release(void *arg)
+{
+    Reader *r = arg;
+
+    __atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+}
+
+static Reader *
+reader(ppm_Epoch *e)
+{
+    Reader *r;
+
+    r = pthread_getspecific(e->key);
+    if (r) return r;
+
+    pthread_mutex_lock(&e->lock);
+    for (r = e->readers; r; r = r->next)
+    {
+        if (!__atomic_load_n(&r->used, __ATOMIC_ACQUIRE)) break;
+    }
+    if (!r)
+    {
+        r = NEW(Reader);
+        r->state = 0;
+        r->next = e->readers;
+        e->readers = r;
+    }
+    r->depth = 0;
+    r->used = 1;
+    pthread_mutex_unlock(&e->lock);
+    pthread_setspecific(e->key, r);
+    return r;
+}
+
+ppm_Epoch *
+ppmR_new(void)
+{
+    ppm_Epoch *e;
+
+    e = NEW(ppm_Epoch);
+    if (pthread_key_create(&e->key, release) != 0)
+    {
+        free(e);
+        return NULL;
+    }
+    pthread_mutex_init(&e->lock, NULL);
+    e->epoch = 0;
+    e->readers = NULL;
+    e->limbo = NULL;
+    e->tail = &e->limbo;
+    e->pending = 0;
+    return e;
+}
+
+void
+ppmR_enter(ppm_Epoch *e)
+{
+    Reader *r;
+
+    if (!e) return;
+    r = reader(e);
+    if (r->depth++ > 0) return;
+
+    /* The announcement has to be visible before any shared pointer is
+       read, or the writer could free what this thread is about to
+       follow. */
+    __atomic_store_n(&r->state, (__atomic_load_n(&e->epoch, __ATOMIC_RELAXED) << 1) | 1, 
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void
+ppmR_exit(ppm_Epoch *e)
+{
+    Reader *r;
+
+    if (!e) return;
+    r = pthread_getspecific(e->key);
+    if (r && --r->depth == 0)
+        __atomic_store_n(&r->state, 0, __ATOMIC_RELEASE);
+}
+
+/* Moves the epoch on when every active reader has seen the current
+   one. */
+static unsigned int
+tryadvance(ppm_Epoch *e)
+{
+    unsigned long state;
+    Reader *r;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&e->lock);
+    for (r = e->readers; r; r = r->next)
+    {
+        state = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE);
+        if ((state & 1) && (state >> 1) != e->epoch)
+            break;
+    }
+    pthread_mutex_unlock(&e->lock);
+    if (r) return 0;
+    __atomic_store_n(&e->epoch, e->epoch + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Whatever was retired two epochs ago can't be reached by anyone, with
+   no reader in the way both steps happen at once. */
+static void
+reclaim(ppm_Epoch *e)
+{
+    Retired *item;
+
+    if (tryadvance(e)) 
+        tryadvance(e);
+    while ((item = e->limbo) && item->epoch + 2 <= e->epoch)
+    {
+        e->limbo = item->next;
+        item->fn(item->ptr);
+        free(item);
+    }
+    if (!e->limbo)
+        e->tail = &e->limbo;
+    e->pending = 0;
+}
+
+void
+ppmR_retire(ppm_Epoch *e, void *ptr, ppm_Free *fn)
+{
+    Retired *item;
+
+    if (!e)
+    {
+        fn(ptr);
+        return;
+    }
+    item = NEW(Retired);
+    item->ptr = ptr;
+    item->fn = fn;
+    item->epoch = e->epoch;
+    item->next = NULL;
+    *e->tail = item;
+    e->tail = &item->next;
+    if (++e->pending >= LIMBO_BATCH)
+        reclaim(e);
+}
+
+void
+ppmR_free(ppm_Epoch *e)
+{
+    Retired *item;
+    Reader *r;
+
+    if (!e) return;
+
+    /* No reader is left, everything goes. */
+    while ((item = e->limbo))
+    {
+        e->limbo = item->next;
+        item->fn(item->ptr);
+        free(item);
+    }
+    while ((r = e->readers))
+    {
+        e->readers = r->next;
+        free(r);
+    }
+    pthread_key_delete(e->key);
+    pthread_mutex_destroy(&e->lock);
+    free(e);
+}
@@ -0,0 +1,49 @@
+/*
+ * ppm_epoch.h
+ *
+ * Copyright (C) 2014 Niels Vanden Eynde
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef PPM_EPOCH_H
+#define PPM_EPOCH_H
+
+/* Epoch based reclamation. Readers bracket their accesses with
+   ppmR_enter and ppmR_exit and never block, a single writer at a time
+   unlinks memory and hands it to ppmR_retire, which frees it once no
+   reader that could still see it is left. Retiring to a NULL epoch
+   frees right away, for structures never shared between threads. */
+typedef struct ppm_epoch ppm_Epoch;
+typedef void ppm_Free(void * /* ptr */);
+
+extern ppm_Epoch *ppmR_new(void);
+extern void ppmR_enter(ppm_Epoch * /* epoch */);
+extern void ppmR_exit(ppm_Epoch * /* epoch */);
+extern void ppmR_retire(ppm_Epoch * /* epoch */, void * /* ptr */, ppm_Free * /* fn */);
+extern void ppmR_free(ppm_Epoch * /* epoch */);
+
+/* Pointers readers follow without a lock are published and read with
+   these. */
+#define PPM_LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define PPM_STORE(v, x) __atomic_store_n(&(v), (x), __ATOMIC_RELEASE)
+
+#endif /* PPM_EPOCH_H */
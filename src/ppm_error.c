@@ -0,0 +1,103 @@
+/*
+ * ppm_error.c
+ *
+ * Copyright (C) 2014 Niels Vanden Eynde
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include "ppm.h"
+
+/* Diagnostics shared by the library and the program, an embedding
+   program can set program_name and ppm_usecolor to its liking. */
+unsigned int ppm_usecolor = 1;
+char *program_name = "ppm";
+
+char *ppm_colors[] = { "", "", "", "", "", ""};
+
+FILE *ppm_output = NULL;
+void (*ppm_report)(unsigned int, const char *) = NULL;
+
+/* Hands a diagnostic to ppm_report, long ones are cut short. */
+static void
+report(unsigned int error, const char *format, va_list vl)
+{
+    char text[1024];
+    size_t len;
+
+    vsnprintf(text, sizeof(text), format, vl);
+    len = strlen(text);
+    if (error && errno != 0)
+    {
+        snprintf(text + len, sizeof(text) - len, ": %s", strerror(errno));
+        errno = 0;
+    }
+    ppm_report(error, text);
+}
+
+void 
+ppm_error(const char *format, ...)
+{
+    va_list vl;
+    
+    va_start(vl, format);
+    if (ppm_report)
+    {
+        report(1, format, vl);
+        va_end(vl);
+        return;
+    }
+    fprintf(stderr, "%s%s:%s ", 
+            PPMC(BLUE),
+            program_name,
+            PPMC(RED));
+    vfprintf(stderr, format, vl);
+    if (errno != 0)
+    {
+        fprintf(stderr, ": %s", strerror(errno));
+        errno = 0;
+    }
+    fprintf(stderr, "%s\n", PPMC(NONE));
+}
+
+void 
+ppm_message(const char *format, ...)
+{
+    va_list vl;
+    
+    va_start(vl, format);
+    if (ppm_report)
+    {
+        report(0, format, vl);
+        va_end(vl);
+        return;
+    }
+    fprintf(stdout, "%s%s:%s ", 
+            PPMC(BLUE), 
+            program_name,
+            PPMC(GREEN));
+    vfprintf(stdout, format, vl);
+    fprintf(stdout, "%s\n", PPMC(NONE));
+}
@@ -0,0 +1,269 @@
+/*
+ * ppm_export.c
+ *
+ * Copyright (C) 2014 Niels Vanden Eynde
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/crypto.h>
+
+#include "ppm_export.h"
+#include "ppm_db.h"
+#include "ppm_table.h"
+#include "ppm_mem.h"
+#include "ppm_string.h"
+#include "ppm.h"
+
+#define WRITE_SIZE (1 << 20)
+
+/* Records are formatted straight into a fixed size buffer that is
+   written out whenever it fills up. The export never holds more than
+   one buffer of output no matter how big the vault is, except for a
+   vault copy: its index and values are encrypted apart and their sizes
+   go in front of them, it is built in memory like a save. */
+typedef struct
+{
+    FILE *out;
+    int format;
+    char *buf;
+    size_t len;
+    ppm_String index;
+    ppm_String values;
+    unsigned long count;
+    unsigned int failed;
+}
+Exporter;
+
+static const struct
+{
+    const char *name;
+    int value;
+}
+formats[] = 
+{
+    { "tsv", PPM_ETSV },
+    { "csv", PPM_ECSV },
+    { "json", PPM_EJSONL },
+    { "jsonl", PPM_EJSONL },
+    { "vault", PPM_EVAULT },
+    { "ppm", PPM_EVAULT },
+    { NULL, 0 }
+};
+
+int
+ppmE_format(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; formats[i].name; i++)
+    {
+        if (strcmp(formats[i].name, name) == 0)
+            return formats[i].value;
+    }
+    return -1;
+}
+
+static void
+flush(Exporter *e)
+{
+    size_t len = e->len;
+
+    /* After a failure the rest of the output is dropped. */
+    e->len = 0;
+    if (e->failed || len == 0) 
+        return;
+    if (fwrite(e->buf, 1, len, e->out) != len)
+    {
+        ppm_error("failed to write export");
+        e->failed = 1;
+    }
+}
+
+static void
+put(Exporter *e, const char *s, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n = WRITE_SIZE - e->len;
+
+        if (n > len) n = len;
+        memcpy(e->buf + e->len, s, n);
+        e->len += n;
+        s += n;
+        len -= n;
+        if (e->len == WRITE_SIZE) 
+            flush(e);
+    }
+}
+
+static void
+putch(Exporter *e, char c)
+{
+    if (e->len == WRITE_SIZE) 
+        flush(e);
+    e->buf[e->len++] = c;
+}
+
+/* The inverse of the escapes the TSV importer understands. */
+static void
+puttsv(Exporter *e, const char *s)
+{
+    for (; *s; s++)
+    {
+        switch (*s)
+        {
+        case '\\': put(e, "\\\\", 2); break;
+        case '\t': put(e, "\\t", 2);  break;
+        case '\n': put(e, "\\n", 2);  break;
+        case '\r': put(e, "\\r", 2);  break;
+        default:   putch(e, *s);      break;
+        }
+    }
+}
+
+static void
+putcsv(Exporter *e, const char *s)
+{
+    size_t len = strlen(s);
+
+    if (strpbrk(s, ",\"\r\n") == NULL 
+        && (len == 0 || (s[0] != ' ' && s[len - 1] != ' ')))
+    {
+        put(e, s, len);
+        return;
+    }
+    putch(e, '"');
+    for (; *s; s++)
+    {
+        if (*s == '"') putch(e, '"');
+        putch(e, *s);
+    }
+    putch(e, '"');
+}
+
+static void
+putjson(Exporter *e, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    putch(e, '"');
+    for (; *s; s++)
+    {
+        unsigned char c = (unsigned char)*s;
+
+        switch (c)
+        {
+        case '"':  put(e, "\\\"", 2); break;
+        case '\\': put(e, "\\\\", 2); break;
+        case '\t': put(e, "\\t", 2);  break;
+        case '\n': put(e, "\\n", 2);  break;
+        case '\r': put(e, "\\r", 2);  break;
+        default:
+            if (c < 0x20)
+            {
+                put(e, "\\u00", 4);
+                putch(e, hex[c >> 4]);
+                putch(e, hex[c & 0xf]);
+            }
+            else
+                putch(e, (char)c);
+            break;
+        }
+    }
+    putch(e, '"');
+}
+
+static void
+exportnode(ppm_Node *node, void *arg)
+{
+    Exporter *e = arg;
+
+    if (e->failed) 
+        return;
+    switch (e->format)
+    {
+    case PPM_ECSV:
+        putcsv(e, node->key);
+        putch(e, ',');
+        putcsv(e, node->value);
+        break;
+    case PPM_EJSONL:
+        put(e, "{\"name\":", 8);
+        putjson(e, node->key);
+        put(e, ",\"password\":", 12);
+        putjson(e, node->value);
+        putch(e, '}');
+        break;
+    case PPM_EVAULT:
+        /* Entries go into the copy exactly as a save writes them. */
+        ppmD_serialize(&e->index, &e->values, node);
+        e->count++;
+        return;
+    default:
+        puttsv(e, node->key);
+        putch(e, '\t');
+        puttsv(e, node->value);
+        break;
+    }
+    putch(e, '\n');
+    e->count++;
+}
+
+unsigned int
+ppmE_export(ppm_Vault *vault, FILE *out, int format, const char *key, unsigned long *count)
+{
+    Exporter e;
+
+    memset(&e, 0, sizeof(e));
+    e.out = out;
+    e.format = format;
+    e.buf = ppmM_alloc(WRITE_SIZE);
+    ppmS_init(&e.index, NULL);
+    ppmS_init(&e.values, NULL);
+
+    if (format == PPM_ECSV)
+        put(&e, "name,password\n", 14);
+
+    if (!ppmD_foreach(vault, exportnode, &e))
+        e.failed = 1;
+    flush(&e);
+
+    if (format == PPM_EVAULT && !e.failed)
+        e.failed = !ppmD_writecopy(out, key, &e.index, &e.values);
+    if (fflush(out) != 0 && !e.failed)
+    {
+        ppm_error("failed to write export");
+        e.failed = 1;
+    }
+    OPENSSL_cleanse(e.buf, WRITE_SIZE);
+    OPENSSL_cleanse(e.index.cstr, e.index.size);
+    OPENSSL_cleanse(e.values.cstr, e.values.size);
+    free(e.index.cstr);
+    free(e.values.cstr);
+    free(e.buf);
+
+    *count = e.count;
+    return !e.failed;
+}
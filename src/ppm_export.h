@@ -0,0 +1,45 @@
+/*
+ * ppm_export.h
+ *
+ * Copyright (C) 2014 Niels Vanden Eynde
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef PPM_EXPORT_H
+#define PPM_EXPORT_H
+
+#include <stdio.h>
+
+#include "ppm_db.h"
+
+enum
+{
+    PPM_ETSV = 0,
+    PPM_ECSV,
+    PPM_EJSONL,
+    PPM_EVAULT
+};
+
+extern int ppmE_format(const char * /* name */);
+extern unsigned int ppmE_export(ppm_Vault * /* vault */, FILE * /* out */, int /* format */, const char * /* key */, unsigned long * /* count */);
+
+#endif /* PPM_EXPORT_H */
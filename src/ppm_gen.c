@@ -0,0 +1,131 @@
+/*
+ * ppm_gen.c
+ *
+ * Copyright (C) 2014 Niels Vanden Eynde
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <string.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#include "ppm_gen.h"
+#include "ppm.h"
+
+/* Entropy is drawn from RAND_bytes in blocks of this size and handed
+   out a byte at a time, so generating thousands of passwords costs a
+   few calls into OpenSSL rather than one per character. */
+#define POOL_SIZE 4096
+
+static unsigned char pool[POOL_SIZE];
+static size_t poolpos = POOL_SIZE;
+
+static const struct
+{
+    const char *name;
+    const char *chars;
+}
+charsets[] =
+{
+    { "digit", "0123456789" },
+    { "hex",   "0123456789abcdef" },
+    { "alpha", "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ" },
+    { "alnum", "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789" },
+    { "print", "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
+               "!\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}~" },
+    { NULL, NULL }
+};
+
+static int
+nextbyte(void)
+{
+    if (poolpos == POOL_SIZE)
+    {
+        if (RAND_bytes(pool, POOL_SIZE) != 1)
+        {
+            ppm_error("failed to gather entropy");
+            return -1;
+        }
+        poolpos = 0;
+    }
+    return pool[poolpos++];
+}
+
+const char *
+ppmG_charset(const char *name)
+{
+    unsigned int i;
+    const char *p;
+
+    if (!name) return charsets[4].chars;
+    for (i = 0; charsets[i].name; i++)
+    {
+        if (strcmp(charsets[i].name, name) == 0)
+            return charsets[i].chars;
+    }
+
+    /* Anything else is taken as a literal set of characters, minus the
+       ones used as delimiters in the database. */
+    if (!*name || strlen(name) > 256)
+        return NULL;
+    for (p = name; *p; p++)
+    {
+        if (*p == '\t' || *p == '\n')
+            return NULL;
+    }
+    return name;
+}
+
+unsigned int
+ppmG_password(char *buf, size_t len, const char *charset)
+{
+    size_t n, i;
+    unsigned int limit;
+
+    n = strlen(charset);
+    if (n == 0 || n > 256) return 0;
+
+    /* Bytes at or above LIMIT are rejected, what remains maps onto the
+       charset evenly so no character is more likely than another. */
+    limit = 256 - (256 % n);
+    for (i = 0; i < len; i++)
+    {
+        int b;
+
+        do
+        {
+            if ((b = nextbyte()) < 0)
+                return 0;
+        }
+        while ((unsigned int)b >= limit);
+        buf[i] = charset[b % n];
+    }
+    buf[len] = '\0';
+    return 1;
+}
+
+void
+ppmG_cleanup(void)
+{
+    OPENSSL_cleanse(pool, POOL_SIZE);
+    poolpos = POOL_SIZE;
+}
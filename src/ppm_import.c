@@ -0,0 +1,740 @@
+/*
+ * ppm_import.c
+ *
+ * Copyright (C) 2014 Niels Vanden Eynde
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "ppm_import.h"
+#include "ppm_db.h"
+#include "ppm_mem.h"
+#include "ppm_string.h"
+#include "ppm.h"
+
+#define READ_SIZE  65536
+#define BATCH_SIZE 1024
+#define MAX_FIELDS 32
+#define JSON_DEPTH 64
+
+/* Everything is parsed from a fixed size read buffer into strings that
+   are reused from one record to the next, memory use depends on the
+   longest record rather than on the size of the input. */
+typedef struct
+{
+    FILE *in;
+    unsigned char buf[READ_SIZE];
+    size_t pos;
+    size_t len;
+    unsigned long line;
+}
+Reader;
+
+typedef struct
+{
+    ppm_String key[BATCH_SIZE];
+    ppm_String value[BATCH_SIZE];
+    unsigned long line[BATCH_SIZE];
+    unsigned int count;
+    ppm_Vault *vault;
+    int policy;
+    ppm_ImportStats *stats;
+
+    /* Keys added so far, separated by '\0'. Only kept when a conflict
+       has to undo the whole import. */
+    ppm_String journal;
+    unsigned int failed;
+}
+Batch;
+
+typedef struct
+{
+    ppm_String fields[MAX_FIELDS];
+    ppm_String overflow;
+    unsigned int n;
+}
+Record;
+
+typedef struct
+{
+    ppm_String member;
+    ppm_String scratch;
+    ppm_String name;
+    ppm_String pass;
+    int namerank;
+    int passrank;
+}
+JsonObject;
+
+/* Column or member names that hold the entry's name and password, the
+   earlier a name appears the more it is preferred. */
+static const char *namecols[] = 
+{
+    "name", "title", "key", "app", "user", "username", "url", "login_uri", "uri", NULL
+};
+
+static const char *passcols[] = 
+{
+    "password", "login_password", "value", "pass", NULL
+};
+
+static const struct
+{
+    const char *name;
+    int value;
+}
+formats[] = 
+{
+    { "tsv", PPM_FTSV },
+    { "csv", PPM_FCSV },
+    { "json", PPM_FJSON },
+    { "jsonl", PPM_FJSON },
+    { NULL, 0 }
+},
+policies[] =
+{
+    { "skip", PPM_ISKIP },
+    { "overwrite", PPM_IOVERWRITE },
+    { "fail", PPM_IFAIL },
+    { NULL, 0 }
+};
+
+int
+ppmI_format(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; formats[i].name; i++)
+    {
+        if (strcmp(formats[i].name, name) == 0)
+            return formats[i].value;
+    }
+    return -1;
+}
+
+int
+ppmI_policy(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; policies[i].name; i++)
+    {
+        if (strcmp(policies[i].name, name) == 0)
+            return policies[i].value;
+    }
+    return -1;
+}
+
+static int
+rank(const char **names, const char *name)
+{
+    int i;
+
+    for (i = 0; names[i]; i++)
+    {
+        const char *a = names[i], *b = name;
+
+        while (*a && tolower((unsigned char)*b) == *a)
+            a++, b++;
+        if (!*a && !*b) 
+            return i;
+    }
+    return -1;
+}
+
+static int
+readc(Reader *r)
+{
+    int c;
+
+    if (r->pos == r->len)
+    {
+        r->len = fread(r->buf, 1, READ_SIZE, r->in);
+        r->pos = 0;
+        if (r->len == 0) return EOF;
+    }
+    c = r->buf[r->pos++];
+    if (c == '\n') r->line++;
+    return c;
+}
+
+static int
+peekc(Reader *r)
+{
+    if (r->pos == r->len)
+    {
+        r->len = fread(r->buf, 1, READ_SIZE, r->in);
+        r->pos = 0;
+        if (r->len == 0) return EOF;
+    }
+    return r->buf[r->pos];
+}
+
+static void
+flush(Batch *b)
+{
+    unsigned int i;
+
+    for (i = 0; i < b->count && !b->failed; i++)
+    {
+        const char *key = b->key[i].cstr;
+        const char *value = b->value[i].cstr;
+
+        if (ppmD_has(b->vault, key))
+        {
+            switch (b->policy)
+            {
+            case PPM_ISKIP:
+                b->stats->skipped++;
+                break;
+
+            case PPM_IOVERWRITE:
+                if (!ppmD_put(b->vault, key, value))
+                    b->failed = 1;
+                else
+                    b->stats->updated++;
+                break;
+
+            default:
+                ppm_error("'%s%s%s' on line %lu already exists", 
+                          PPMC(WHITE), key, PPMC(RED), b->line[i]);
+                b->failed = 1;
+                break;
+            }
+            continue;
+        }
+
+        if (!ppmD_put(b->vault, key, value))
+        {
+            b->failed = 1;
+            break;
+        }
+        b->stats->added++;
+        if (b->policy == PPM_IFAIL)
+        {
+            ppmS_append(&b->journal, key);
+            ppmS_addch(&b->journal, '\0');
+        }
+    }
+    b->count = 0;
+}
+
+static void
+rollback(Batch *b)
+{
+    char *p, *end;
+
+    end = b->journal.cstr + b->journal.len;
+    for (p = b->journal.cstr; p < end; p += strlen(p) + 1)
+        ppmD_remove(b->vault, p);
+    b->stats->added = 0;
+}
+
+static unsigned int
+valid(const ppm_String *s)
+{
+    /* A '\0' would end the string early, tabs and newlines are only
+       refused in names, see ppmD_validname. */
+    return strlen(s->cstr) == s->len;
+}
+
+static void
+emit(Batch *b, ppm_String *key, ppm_String *value, unsigned long line)
+{
+    unsigned int i;
+
+    if (key->len == 0 || !valid(key) || !ppmD_validname(key->cstr) || !valid(value))
+    {
+        b->stats->invalid++;
+        return;
+    }
+
+    i = b->count++;
+    ppmS_clear(b->key + i);
+    ppmS_append(b->key + i, key->cstr);
+    ppmS_clear(b->value + i);
+    ppmS_append(b->value + i, value->cstr);
+    b->line[i] = line;
+    if (b->count == BATCH_SIZE)
+        flush(b);
+}
+
+static ppm_String *
+nextfield(Record *rec)
+{
+    ppm_String *field;
+
+    field = (rec->n < MAX_FIELDS) ? rec->fields + rec->n : &rec->overflow;
+    rec->n++;
+    ppmS_clear(field);
+    return field;
+}
+
+/* Reads one TSV or CSV record. TSV fields use backslash escapes, CSV
+   fields may be quoted and then hold separators, newlines and doubled
+   quotes. Returns 0 at the end of the input. */
+static unsigned int
+readrecord(Reader *r, Record *rec, int csv)
+{
+    ppm_String *field;
+    unsigned int quoted = 0;
+    int c;
+
+    if (peekc(r) == EOF) return 0;
+    rec->n = 0;
+    field = nextfield(rec);
+
+    while ((c = readc(r)) != EOF)
+    {
+        if (quoted)
+        {
+            if (c == '"')
+            {
+                if (peekc(r) != '"') 
+                {
+                    quoted = 0;
+                    continue;
+                }
+                readc(r);
+            }
+            ppmS_addch(field, c);
+            continue;
+        }
+
+        if (c == '\n') break;
+        if (c == '\r' && peekc(r) == '\n') continue;
+        if (c == (csv ? ',' : '\t'))
+        {
+            field = nextfield(rec);
+            continue;
+        }
+        if (csv && c == '"' && field->len == 0)
+        {
+            quoted = 1;
+            continue;
+        }
+        if (!csv && c == '\\')
+        {
+            c = readc(r);
+            switch (c)
+            {
+            case 't': c = '\t'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case '0': c = '\0'; break;
+            case '\\': break;
+            case EOF: c = '\\'; break;
+            default: ppmS_addch(field, '\\'); break;
+            }
+        }
+        ppmS_addch(field, c);
+    }
+    return 1;
+}
+
+static unsigned int
+parsedelim(Reader *r, Batch *b, int csv)
+{
+    Record *rec;
+    unsigned int i, first = 1;
+    int keycol = 0, valcol = 1;
+    unsigned long line;
+
+    rec = NEW(Record);
+    for (i = 0; i < MAX_FIELDS; i++)
+        ppmS_init(rec->fields + i, NULL);
+    ppmS_init(&rec->overflow, NULL);
+
+    for (line = r->line; !b->failed && readrecord(r, rec, csv); line = r->line)
+    {
+        if (rec->n == 1 && rec->fields[0].len == 0)
+            continue;
+
+        /* A first record naming a password column is a header, it also
+           tells which columns to take. Otherwise use the first two. */
+        if (first)
+        {
+            int nbest = -1, pbest = -1;
+            unsigned int n = rec->n < MAX_FIELDS ? rec->n : MAX_FIELDS;
+
+            first = 0;
+            for (i = 0; i < n; i++)
+            {
+                int nr = rank(namecols, rec->fields[i].cstr);
+                int pr = rank(passcols, rec->fields[i].cstr);
+
+                if (pr >= 0 && (pbest < 0 || pr < pbest))
+                {
+                    pbest = pr;
+                    valcol = i;
+                }
+                else
+                if (nr >= 0 && (nbest < 0 || nr < nbest))
+                {
+                    nbest = nr;
+                    keycol = i;
+                }
+            }
+            if (pbest >= 0)
+            {
+                if (nbest < 0) keycol = (valcol == 0) ? 1 : 0;
+                continue;
+            }
+            keycol = 0;
+            valcol = 1;
+        }
+
+        if ((int)rec->n <= keycol || (int)rec->n <= valcol)
+        {
+            b->stats->invalid++;
+            continue;
+        }
+        emit(b, rec->fields + keycol, rec->fields + valcol, line);
+    }
+
+    for (i = 0; i < MAX_FIELDS; i++)
+        free(rec->fields[i].cstr);
+    free(rec->overflow.cstr);
+    free(rec);
+    return 1;
+}
+
+static void
+skipws(Reader *r)
+{
+    while (isspace(peekc(r)))
+        readc(r);
+}
+
+static void
+pututf8(ppm_String *s, unsigned long c)
+{
+    if (c < 0x80)
+        ppmS_addch(s, (char)c);
+    else
+    if (c < 0x800)
+    {
+        ppmS_addch(s, (char)(0xc0 | (c >> 6)));
+        ppmS_addch(s, (char)(0x80 | (c & 0x3f)));
+    }
+    else
+    if (c < 0x10000)
+    {
+        ppmS_addch(s, (char)(0xe0 | (c >> 12)));
+        ppmS_addch(s, (char)(0x80 | ((c >> 6) & 0x3f)));
+        ppmS_addch(s, (char)(0x80 | (c & 0x3f)));
+    }
+    else
+    {
+        ppmS_addch(s, (char)(0xf0 | (c >> 18)));
+        ppmS_addch(s, (char)(0x80 | ((c >> 12) & 0x3f)));
+        ppmS_addch(s, (char)(0x80 | ((c >> 6) & 0x3f)));
+        ppmS_addch(s, (char)(0x80 | (c & 0x3f)));
+    }
+}
+
+static long
+hex4(Reader *r)
+{
+    long v = 0;
+    int i, c;
+
+    for (i = 0; i < 4; i++)
+    {
+        c = readc(r);
+        if (!isxdigit(c)) return -1;
+        v = v * 16 + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+    }
+    return v;
+}
+
+/* Reads a JSON string, the opening quote has been consumed. */
+static unsigned int
+jstring(Reader *r, ppm_String *out)
+{
+    int c;
+    long u, lo;
+
+    ppmS_clear(out);
+    while ((c = readc(r)) != '"')
+    {
+        if (c == EOF) return 0;
+        if (c != '\\')
+        {
+            ppmS_addch(out, c);
+            continue;
+        }
+        switch (c = readc(r))
+        {
+        case 'b': ppmS_addch(out, '\b'); break;
+        case 'f': ppmS_addch(out, '\f'); break;
+        case 'n': ppmS_addch(out, '\n'); break;
+        case 'r': ppmS_addch(out, '\r'); break;
+        case 't': ppmS_addch(out, '\t'); break;
+        case '"': case '\\': case '/': ppmS_addch(out, c); break;
+        case 'u':
+            if ((u = hex4(r)) < 0) return 0;
+            if (u >= 0xd800 && u < 0xdc00)
+            {
+                if (readc(r) != '\\' || readc(r) != 'u' || (lo = hex4(r)) < 0xdc00 || lo > 0xdfff)
+                    return 0;
+                u = 0x10000 + ((u - 0xd800) << 10) + (lo - 0xdc00);
+            }
+            pututf8(out, (unsigned long)u);
+            break;
+        default:
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static unsigned int
+jscalar(Reader *r)
+{
+    int c;
+    unsigned int n = 0;
+
+    while ((c = peekc(r)) != EOF && (isalnum(c) || strchr("+-.", c)))
+    {
+        readc(r);
+        n++;
+    }
+    return n > 0;
+}
+
+static unsigned int jobject(Reader *, Batch *, JsonObject *, int, unsigned int);
+
+static unsigned int
+jvalue(Reader *r, Batch *b, JsonObject *stack, int depth, ppm_String *str, unsigned int member)
+{
+    int c;
+
+    skipws(r);
+    c = peekc(r);
+    if (c == '"')
+    {
+        readc(r);
+        return jstring(r, str);
+    }
+    if (c != '{' && c != '[')
+        return jscalar(r);
+
+    if (depth + 1 >= JSON_DEPTH)
+    {
+        ppm_error("JSON nested too deeply on line %lu", r->line);
+        return 0;
+    }
+    readc(r);
+    if (c == '{')
+        return jobject(r, b, stack, depth + 1, member);
+
+    skipws(r);
+    if (peekc(r) == ']')
+        return readc(r) == ']';
+    for (;;)
+    {
+        if (!jvalue(r, b, stack, depth + 1, &stack[depth + 1].scratch, 0))
+            return 0;
+        skipws(r);
+        c = readc(r);
+        if (c == ']') return 1;
+        if (c != ',') return 0;
+    }
+}
+
+/* Any object with a name and a password member is a record, unless it
+   is itself the member of an object. The members of such an object
+   count for the one holding it, as in {"name": .., "login": {"username":
+   .., "password": ..}}, where the outer name is preferred. */
+static unsigned int
+jobject(Reader *r, Batch *b, JsonObject *stack, int depth, unsigned int member)
+{
+    JsonObject *obj = stack + depth;
+    JsonObject *child = stack + depth + 1;
+    ppm_String tmp;
+    unsigned long line = r->line;
+    int c, nr, pr;
+
+    obj->namerank = obj->passrank = -1;
+    skipws(r);
+    if (peekc(r) == '}')
+        return readc(r) == '}';
+
+    for (;;)
+    {
+        skipws(r);
+        if (readc(r) != '"' || !jstring(r, &obj->member)) return 0;
+        skipws(r);
+        if (readc(r) != ':') return 0;
+
+        skipws(r);
+        c = peekc(r);
+        if (!jvalue(r, b, stack, depth, &obj->scratch, 1))
+            return 0;
+
+        if (c == '"')
+        {
+            nr = rank(namecols, obj->member.cstr);
+            pr = rank(passcols, obj->member.cstr);
+            if (nr >= 0 && (obj->namerank < 0 || nr < obj->namerank))
+            {
+                tmp = obj->name, obj->name = obj->scratch, obj->scratch = tmp;
+                obj->namerank = nr;
+            }
+            else
+            if (pr >= 0 && (obj->passrank < 0 || pr < obj->passrank))
+            {
+                tmp = obj->pass, obj->pass = obj->scratch, obj->scratch = tmp;
+                obj->passrank = pr;
+            }
+        }
+        else
+        if (c == '{' && depth + 1 < JSON_DEPTH)
+        {
+            if (child->passrank >= 0 && (obj->passrank < 0 || child->passrank < obj->passrank))
+            {
+                tmp = obj->pass, obj->pass = child->pass, child->pass = tmp;
+                obj->passrank = child->passrank;
+            }
+            if (child->namerank >= 0 && (obj->namerank < 0 || child->namerank < obj->namerank))
+            {
+                tmp = obj->name, obj->name = child->name, child->name = tmp;
+                obj->namerank = child->namerank;
+            }
+        }
+
+        skipws(r);
+        c = readc(r);
+        if (c == '}') break;
+        if (c != ',') return 0;
+    }
+
+    if (!member && obj->namerank >= 0 && obj->passrank >= 0)
+    {
+        emit(b, &obj->name, &obj->pass, line);
+        obj->namerank = obj->passrank = -1;
+    }
+    return 1;
+}
+
+static unsigned int
+parsejson(Reader *r, Batch *b)
+{
+    JsonObject *stack;
+    ppm_String top;
+    unsigned int i, ok = 1;
+
+    stack = ppmM_alloc(JSON_DEPTH * sizeof(JsonObject));
+    for (i = 0; i < JSON_DEPTH; i++)
+    {
+        ppmS_init(&stack[i].member, NULL);
+        ppmS_init(&stack[i].scratch, NULL);
+        ppmS_init(&stack[i].name, NULL);
+        ppmS_init(&stack[i].pass, NULL);
+        stack[i].namerank = stack[i].passrank = -1;
+    }
+    ppmS_init(&top, NULL);
+
+    /* A single document or a stream of them, one per line or not. */
+    for (;;)
+    {
+        skipws(r);
+        if (peekc(r) == EOF || b->failed) break;
+        if (!jvalue(r, b, stack, -1, &top, 0))
+        {
+            ppm_error("invalid JSON on line %lu", r->line);
+            ok = 0;
+            break;
+        }
+    }
+
+    for (i = 0; i < JSON_DEPTH; i++)
+    {
+        free(stack[i].member.cstr);
+        free(stack[i].scratch.cstr);
+        free(stack[i].name.cstr);
+        free(stack[i].pass.cstr);
+    }
+    free(stack);
+    free(top.cstr);
+    return ok;
+}
+
+unsigned int
+ppmI_import(ppm_Vault *vault, FILE *in, int format, int policy, ppm_ImportStats *stats)
+{
+    Reader *r;
+    Batch *b;
+    unsigned int i, ok;
+
+    memset(stats, 0, sizeof(ppm_ImportStats));
+    r = NEW(Reader);
+    r->in = in;
+    r->pos = r->len = 0;
+    r->line = 1;
+
+    b = NEW(Batch);
+    for (i = 0; i < BATCH_SIZE; i++)
+    {
+        ppmS_init(b->key + i, NULL);
+        ppmS_init(b->value + i, NULL);
+    }
+    ppmS_init(&b->journal, NULL);
+    b->vault = vault;
+    b->count = 0;
+    b->policy = policy;
+    b->stats = stats;
+    b->failed = 0;
+
+    if (format == PPM_FJSON)
+        ok = parsejson(r, b);
+    else
+        ok = parsedelim(r, b, format == PPM_FCSV);
+    if (ferror(in))
+    {
+        ppm_error("failed to read input");
+        ok = 0;
+    }
+
+    if (ok) flush(b);
+    if (!ok || b->failed)
+    {
+        if (policy == PPM_IFAIL)
+            rollback(b);
+        ok = 0;
+    }
+
+    for (i = 0; i < BATCH_SIZE; i++)
+    {
+        free(b->key[i].cstr);
+        free(b->value[i].cstr);
+    }
+    free(b->journal.cstr);
+    free(b);
+    free(r);
+    return ok;
+}
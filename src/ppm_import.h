@@ -0,0 +1,61 @@
+/*
+ * ppm_import.h
+ *
+ * Copyright (C) 2014 Niels Vanden Eynde
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef PPM_IMPORT_H
+#define PPM_IMPORT_H
+
+#include <stdio.h>
+
+#include "ppm_db.h"
+
+enum
+{
+    PPM_FTSV = 0,
+    PPM_FCSV,
+    PPM_FJSON
+};
+
+enum
+{
+    PPM_ISKIP = 0,
+    PPM_IOVERWRITE,
+    PPM_IFAIL
+};
+
+typedef struct
+{
+    unsigned long added;
+    unsigned long updated;
+    unsigned long skipped;
+    unsigned long invalid;
+}
+ppm_ImportStats;
+
+extern int ppmI_format(const char * /* name */);
+extern int ppmI_policy(const char * /* name */);
+extern unsigned int ppmI_import(ppm_Vault * /* vault */, FILE * /* in */, int /* format */, int /* policy */, ppm_ImportStats * /* stats */);
+
+#endif /* PPM_IMPORT_H */
@@ -0,0 +1,298 @@
+/*
+ * ppm_index.c
+ *
+ * Copyright (C) 2014 Niels Vanden Eynde
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ppm_index.h"
+#include "ppm_mem.h"
+#include "ppm_epoch.h"
+
+#define TAGS_GROW 64
+
+typedef struct ppm_tag
+{
+    char *name;
+    ppm_Node **nodes;
+    size_t count;
+    size_t cap;
+    struct ppm_tag *next;
+}
+Tag;
+
+static unsigned int
+taghash(const char *name, size_t len)
+{
+    unsigned int h = 5381;
+
+    while (len--)
+        h = ((h << 5) + h) + (unsigned char)*name++;
+    return h;
+}
+
+static Tag **
+findtag(ppm_Index *x, const char *name, size_t len)
+{
+    Tag **tag;
+
+    if (!x->tags) return NULL;
+    for (tag = x->tags + taghash(name, len) % x->tagsize; *tag; tag = &(*tag)->next)
+    {
+        if (strncmp((*tag)->name, name, len) == 0 && (*tag)->name[len] == '\0')
+            return tag;
+    }
+    return tag;
+}
+
+static void
+growtags(ppm_Index *x)
+{
+    Tag **old = x->tags, *tag, *next;
+    size_t oldsize = x->tagsize, i;
+
+    x->tagsize = x->tagsize ? x->tagsize * 2 : TAGS_GROW;
+    x->tags = ppmM_alloc(x->tagsize * sizeof(Tag *));
+    memset(x->tags, 0, x->tagsize * sizeof(Tag *));
+    for (i = 0; i < oldsize; i++)
+    {
+        for (tag = old[i]; tag; tag = next)
+        {
+            unsigned int h = taghash(tag->name, strlen(tag->name)) % x->tagsize;
+
+            next = tag->next;
+            tag->next = x->tags[h];
+            x->tags[h] = tag;
+        }
+    }
+    free(old);
+}
+
+static void
+tagnode(ppm_Index *x, const char *name, size_t len, ppm_Node *node)
+{
+    Tag **slot, *tag;
+
+    if (x->tagcount >= x->tagsize)
+        growtags(x);
+    slot = findtag(x, name, len);
+    if (!*slot)
+    {
+        tag = NEW(Tag);
+        tag->name = ppmM_alloc(len + 1);
+        memcpy(tag->name, name, len);
+        tag->name[len] = '\0';
+        tag->nodes = NULL;
+        tag->count = tag->cap = 0;
+        tag->next = NULL;
+        *slot = tag;
+        x->tagcount++;
+    }
+    tag = *slot;
+    if (tag->count == tag->cap)
+    {
+        tag->cap = tag->cap ? tag->cap * 2 : 8;
+        tag->nodes = ppmM_realloc(tag->nodes, tag->cap * sizeof(ppm_Node *));
+    }
+    tag->nodes[tag->count++] = node;
+}
+
+static void
+untagnode(ppm_Index *x, const char *name, size_t len, ppm_Node *node)
+{
+    Tag **slot, *tag;
+    size_t i;
+
+    slot = findtag(x, name, len);
+    if (!slot || !*slot) return;
+    tag = *slot;
+    for (i = 0; i < tag->count; i++)
+    {
+        if (tag->nodes[i] != node) continue;
+        tag->nodes[i] = tag->nodes[--tag->count];
+        break;
+    }
+    if (tag->count > 0) return;
+
+    *slot = tag->next;
+    free(tag->name);
+    free(tag->nodes);
+    free(tag);
+    x->tagcount--;
+}
+
+static void
+eachtag(ppm_Index *x, ppm_Node *node, void (*fn)(ppm_Index *, const char *, size_t, ppm_Node *))
+{
+    const char *p = node->tags, *end;
+
+    while (p && *p)
+    {
+        end = strchr(p, ',');
+        if (!end) end = p + strlen(p);
+        if (end > p) fn(x, p, end - p, node);
+        p = *end ? end + 1 : end;
+    }
+}
+
+static void
+heapset(ppm_Index *x, size_t i, ppm_Node *node)
+{
+    x->heap[i] = node;
+    node->heappos = i + 1;
+}
+
+static void
+siftup(ppm_Index *x, size_t i)
+{
+    ppm_Node *node = x->heap[i];
+
+    while (i > 0 && x->heap[(i - 1) / 2]->modified > node->modified)
+    {
+        heapset(x, i, x->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    heapset(x, i, node);
+}
+
+static void
+siftdown(ppm_Index *x, size_t i)
+{
+    ppm_Node *node = x->heap[i];
+    size_t child;
+
+    for (;;)
+    {
+        child = 2 * i + 1;
+        if (child >= x->heapcount) break;
+        if (child + 1 < x->heapcount && x->heap[child + 1]->modified < x->heap[child]->modified)
+            child++;
+        if (x->heap[child]->modified >= node->modified) break;
+        heapset(x, i, x->heap[child]);
+        i = child;
+    }
+    heapset(x, i, node);
+}
+
+void
+ppmX_add(ppm_Index *x, ppm_Node *node)
+{
+    if (x->heapcount == x->heapcap)
+    {
+        x->heapcap = x->heapcap ? x->heapcap * 2 : 1024;
+        x->heap = ppmM_realloc(x->heap, x->heapcap * sizeof(ppm_Node *));
+    }
+    heapset(x, x->heapcount++, node);
+    siftup(x, x->heapcount - 1);
+    eachtag(x, node, tagnode);
+}
+
+void
+ppmX_remove(ppm_Index *x, ppm_Node *node)
+{
+    ppm_Node *last;
+    size_t i;
+
+    eachtag(x, node, untagnode);
+    if (!node->heappos) return;
+
+    i = node->heappos - 1;
+    node->heappos = 0;
+    if (i == --x->heapcount) return;
+    last = x->heap[x->heapcount];
+    heapset(x, i, last);
+    siftup(x, i);
+    siftdown(x, last->heappos - 1);
+}
+
+void
+ppmX_touch(ppm_Index *x, ppm_Node *node)
+{
+    if (!node->heappos) return;
+    siftup(x, node->heappos - 1);
+    siftdown(x, node->heappos - 1);
+}
+
+void
+ppmX_settags(ppm_Index *x, ppm_Node *node, const char *list)
+{
+    eachtag(x, node, untagnode);
+    if (node->tags)
+        ppmR_retire(x->epoch, node->tags, free);
+    PPM_STORE(node->tags, (list && *list) ? ppmM_strdup(list) : NULL);
+    eachtag(x, node, tagnode);
+}
+
+void
+ppmX_tagged(ppm_Index *x, const char *tag, void (*fn)(ppm_Node *, void *), void *arg)
+{
+    Tag **slot;
+    size_t i;
+
+    slot = findtag(x, tag, strlen(tag));
+    if (!slot || !*slot) return;
+    for (i = 0; i < (*slot)->count; i++)
+        fn((*slot)->nodes[i], arg);
+}
+
+static void
+older(ppm_Index *x, size_t i, time_t before, void (*fn)(ppm_Node *, void *), void *arg)
+{
+    /* Children are never older than their parent, a subtree whose root
+       is recent enough holds nothing to report. */
+    while (i < x->heapcount && x->heap[i]->modified < before)
+    {
+        fn(x->heap[i], arg);
+        older(x, 2 * i + 1, before, fn, arg);
+        i = 2 * i + 2;
+    }
+}
+
+void
+ppmX_older(ppm_Index *x, time_t before, void (*fn)(ppm_Node *, void *), void *arg)
+{
+    older(x, 0, before, fn, arg);
+}
+
+void
+ppmX_cleanup(ppm_Index *x)
+{
+    Tag *tag, *next;
+    size_t i;
+
+    for (i = 0; i < x->tagsize; i++)
+    {
+        for (tag = x->tags[i]; tag; tag = next)
+        {
+            next = tag->next;
+            free(tag->name);
+            free(tag->nodes);
+            free(tag);
+        }
+    }
+    free(x->tags);
+    free(x->heap);
+    memset(x, 0, sizeof(ppm_Index));
+}
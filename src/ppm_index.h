@@ -0,0 +1,67 @@
+/*
+ * ppm_index.h
+ *
+ * Copyright (C) 2014 Niels Vanden Eynde
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef PPM_INDEX_H
+#define PPM_INDEX_H
+
+#include <time.h>
+
+#include "ppm_table.h"
+
+struct ppm_tag;
+struct ppm_epoch;
+
+/* Secondary indexes over the entries of a vault: tags map to the
+   entries carrying them, modification times are kept in a min-heap. An
+   index starts out zeroed, an entry must be removed from it before it
+   is freed. */
+typedef struct
+{
+    struct ppm_tag **tags;
+    size_t tagsize;
+    size_t tagcount;
+
+    /* An entry's heappos is its index in heap plus one, so zero means
+       it isn't in the heap. */
+    ppm_Node **heap;
+    size_t heapcount;
+    size_t heapcap;
+
+    /* Replaced tag lists are retired to epoch, readers of the table
+       may still be looking at them. */
+    struct ppm_epoch *epoch;
+}
+ppm_Index;
+
+extern void ppmX_add(ppm_Index * /* index */, ppm_Node * /* node */);
+extern void ppmX_remove(ppm_Index * /* index */, ppm_Node * /* node */);
+extern void ppmX_touch(ppm_Index * /* index */, ppm_Node * /* node */);
+extern void ppmX_settags(ppm_Index * /* index */, ppm_Node * /* node */, const char * /* tags */);
+extern void ppmX_tagged(ppm_Index * /* index */, const char * /* tag */, void (* /* fn */)(ppm_Node *, void *), void * /* arg */);
+extern void ppmX_older(ppm_Index * /* index */, time_t /* before */, void (* /* fn */)(ppm_Node *, void *), void * /* arg */);
+extern void ppmX_cleanup(ppm_Index * /* index */);
+
+#endif /* PPM_INDEX_H */
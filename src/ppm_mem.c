@@ -27,32 +27,103 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "ppm_mem.h"
+
+/* Allocation sizes are counted in power of two classes from 16 bytes,
+   the last one holds everything larger. */
+#define CLASSES 14
+#define MAXSITES 32
+
+/* The allocations made by one file. Counters are only ever added to,
+   from any thread. */
+typedef struct
+{
+    const char *file;
+    unsigned long calls;
+    unsigned long bytes;
+    unsigned long classes[CLASSES];
+}
+Site;
+
+static Site sites[MAXSITES];
+static unsigned int nsites;
+static unsigned int tracking;
+static pthread_mutex_t siteslock = PTHREAD_MUTEX_INITIALIZER;
 
 static void
 out_of_memory(const char *type, size_t size)
 {
-    fprintf(stderr, "(%s) failed to allocate %d bytes, exiting...\n", type, size);
+    fprintf(stderr, "(%s) failed to allocate %lu bytes, exiting...\n", type, (unsigned long)size);
     exit(EXIT_FAILURE);
 }
 
+/* Sites are found by the file name's address first, every file passes
+   the same literal. New ones are added under siteslock and published
+   by bumping nsites. */
+static Site *
+getsite(const char *file)
+{
+    unsigned int i, n;
+
+    n = __atomic_load_n(&nsites, __ATOMIC_ACQUIRE);
+    for (i = 0; i < n; i++)
+    {
+        if (sites[i].file == file) return sites + i;
+    }
+
+    pthread_mutex_lock(&siteslock);
+    for (i = 0; i < nsites; i++)
+    {
+        if (sites[i].file == file || strcmp(sites[i].file, file) == 0) break;
+    }
+    if (i == nsites && nsites < MAXSITES)
+    {
+        sites[i].file = file;
+        __atomic_store_n(&nsites, nsites + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&siteslock);
+    return i < MAXSITES ? sites + i : NULL;
+}
+
+static void
+count(const char *file, size_t size)
+{
+    Site *site;
+    unsigned int c;
+    size_t limit;
+
+    if (!__atomic_load_n(&tracking, __ATOMIC_RELAXED)) return;
+    site = getsite(file);
+    if (!site) return;
+    for (c = 0, limit = 16; c < CLASSES - 1 && size > limit; c++, limit *= 2);
+    __atomic_fetch_add(&site->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&site->bytes, size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&site->classes[c], 1, __ATOMIC_RELAXED);
+}
+
 void *
-ppmM_alloc(size_t size)
+ppmM_allocat(size_t size, const char *file)
 {
     void *p = malloc(size);
 
     if (!p)
         out_of_memory("malloc", size);
 
+    count(file, size);
     return p;
 }
 
 void *
-ppmM_realloc(void *ptr, size_t size)
+ppmM_reallocat(void *ptr, size_t size, const char *file)
 {
     void *p;
 
     if (!ptr)
-        return ppmM_alloc(size);
+        return ppmM_allocat(size, file);
 
     p = realloc(ptr, size);
     if (!p)
@@ -61,19 +132,82 @@ ppmM_realloc(void *ptr, size_t size)
         out_of_memory("realloc", size);
     }
 
+    count(file, size);
     return p;
 }
 
 char *
-ppmM_strdup(const char *string)
+ppmM_strdupat(const char *string, const char *file)
 {
     char *copy;
     size_t len = strlen(string);
 
-    copy = ppmM_alloc(len + 1);
-    strncpy(copy, string, len);
-    copy[len] = '\0';
-
+    copy = ppmM_allocat(len + 1, file);
+    memcpy(copy, string, len + 1);
     return copy;
 }
 
+static void
+dump(void)
+{
+    fprintf(stderr, "\n");
+    ppmM_stats(stderr);
+}
+
+/* Starts counting allocations, they are reported on exit as well. */
+void
+ppmM_track(void)
+{
+    if (tracking) return;
+    __atomic_store_n(&tracking, 1, __ATOMIC_RELAXED);
+    atexit(dump);
+}
+
+unsigned int
+ppmM_tracking(void)
+{
+    return __atomic_load_n(&tracking, __ATOMIC_RELAXED);
+}
+
+/* Frees aren't seen, the bytes are those asked for over the process'
+   lifetime. Its peak resident size comes from the kernel. */
+void
+ppmM_stats(FILE *out)
+{
+    struct rusage ru;
+    unsigned long calls = 0, bytes = 0;
+    unsigned int i, c, n;
+    size_t limit;
+
+    n = __atomic_load_n(&nsites, __ATOMIC_ACQUIRE);
+    fprintf(out, "%-12s %12s %14s\n", "site", "calls", "bytes");
+    for (i = 0; i < n; i++)
+    {
+        Site *site = sites + i;
+        const char *name = strrchr(site->file, '/');
+        unsigned long sc = __atomic_load_n(&site->calls, __ATOMIC_RELAXED);
+        unsigned long sb = __atomic_load_n(&site->bytes, __ATOMIC_RELAXED);
+
+        name = name ? name + 1 : site->file;
+        if (strncmp(name, "ppm_", 4) == 0) name += 4;
+        fprintf(out, "%-12.*s %12lu %14lu\n", (int)strcspn(name, "."), name, sc, sb);
+        calls += sc;
+        bytes += sb;
+
+        fprintf(out, "            ");
+        for (c = 0, limit = 16; c < CLASSES; c++, limit *= 2)
+        {
+            unsigned long k = __atomic_load_n(&site->classes[c], __ATOMIC_RELAXED);
+
+            if (!k) continue;
+            if (c < CLASSES - 1)
+                fprintf(out, " <=%lu:%lu", (unsigned long)limit, k);
+            else
+                fprintf(out, " >%lu:%lu", (unsigned long)limit / 2, k);
+        }
+        fprintf(out, "\n");
+    }
+    fprintf(out, "%-12s %12lu %14lu\n", "total", calls, bytes);
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+        fprintf(out, "%-12s %27lu\n", "peak rss", (unsigned long)ru.ru_maxrss * 1024);
+}
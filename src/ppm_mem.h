@@ -28,10 +28,21 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stdio.h>
+
 #define NEW(p) (ppmM_alloc(sizeof(p)))
 
-extern void *ppmM_alloc(size_t /* size */);
-extern char *ppmM_strdup(const char * /* string */);
-extern void *ppmM_realloc(void * /* ptr */, size_t /* size */);
+/* Every allocation passes the file making it, once ppmM_track was
+   called they are counted by file. */
+#define ppmM_alloc(size) ppmM_allocat((size), __FILE__)
+#define ppmM_strdup(string) ppmM_strdupat((string), __FILE__)
+#define ppmM_realloc(ptr, size) ppmM_reallocat((ptr), (size), __FILE__)
+
+extern void *ppmM_allocat(size_t /* size */, const char * /* file */);
+extern char *ppmM_strdupat(const char * /* string */, const char * /* file */);
+extern void *ppmM_reallocat(void * /* ptr */, size_t /* size */, const char * /* file */);
+extern void ppmM_track(void);
+extern unsigned int ppmM_tracking(void);
+extern void ppmM_stats(FILE * /* out */);
 
 #endif /* UTIL_H */
@@ -0,0 +1,404 @@
+/*
+ * ppm_merkle.c
+ *
+ * Copyright (C) 2014 Niels Vanden Eynde
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/evp.h>
+
+#include "ppm_merkle.h"
+#include "ppm_db.h"
+#include "ppm_table.h"
+#include "ppm_mem.h"
+#include "ppm.h"
+
+#define HASH_SIZE   32
+#define LEAF_FILL   8
+#define MAX_DEPTH   20
+
+/* A vault's records are spread over 2^depth leaves by the hash of their
+   key and sorted within each leaf, so the same key lands in the same
+   leaf of both trees whatever else either vault holds. A leaf hashes
+   its records' hashes, every inner node its two children. Two trees are
+   compared from the root down, descending only where hashes differ, so
+   the comparison costs in proportion to the difference rather than to
+   the size of the vaults. */
+typedef struct
+{
+    unsigned long bucket;
+    ppm_Node *node;
+    unsigned char hash[HASH_SIZE];
+}
+Record;
+
+typedef struct
+{
+    Record *records;
+    size_t count;
+    size_t cap;
+    unsigned int depth;
+    size_t *start;
+    unsigned char *hashes;
+}
+Tree;
+
+typedef void DiffFunc(ppm_Node * /* ours */, ppm_Node * /* theirs */, void * /* arg */);
+
+typedef struct
+{
+    ppm_Vault *vault;
+    int policy;
+    unsigned long added;
+    unsigned long updated;
+    unsigned long kept;
+    unsigned int failed;
+}
+Merge;
+
+static const struct
+{
+    const char *name;
+    int value;
+}
+policies[] = 
+{
+    { "newer", PPM_MNEWER },
+    { "ours", PPM_MOURS },
+    { "theirs", PPM_MTHEIRS },
+    { "ask", PPM_MASK },
+    { NULL, 0 }
+};
+
+int
+ppmH_policy(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; policies[i].name; i++)
+    {
+        if (strcmp(policies[i].name, name) == 0)
+            return policies[i].value;
+    }
+    return -1;
+}
+
+static unsigned long
+keyhash(const char *key)
+{
+    unsigned long h = 2166136261ul;
+
+    while (*key)
+    {
+        h ^= (unsigned char)*key++;
+        h = (h * 16777619ul) & 0xfffffffful;
+    }
+    return h;
+}
+
+static void
+addrecord(ppm_Node *node, void *arg)
+{
+    Tree *tree = arg;
+
+    if (tree->count == tree->cap)
+    {
+        tree->cap = tree->cap ? tree->cap * 2 : 1024;
+        tree->records = ppmM_realloc(tree->records, tree->cap * sizeof(Record));
+    }
+    tree->records[tree->count].node = node;
+    tree->count++;
+}
+
+static int
+cmprecord(const void *a, const void *b)
+{
+    const Record *ra = a, *rb = b;
+
+    if (ra->bucket != rb->bucket)
+        return ra->bucket < rb->bucket ? -1 : 1;
+    return strcmp(ra->node->key, rb->node->key);
+}
+
+static void
+digest(EVP_MD_CTX *ctx, const void *a, const void *b, unsigned char *out)
+{
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    EVP_DigestUpdate(ctx, a, HASH_SIZE);
+    EVP_DigestUpdate(ctx, b, HASH_SIZE);
+    EVP_DigestFinal_ex(ctx, out, NULL);
+}
+
+static unsigned int
+treedepth(size_t count)
+{
+    unsigned int depth = 0;
+
+    while (depth < MAX_DEPTH && ((size_t)LEAF_FILL << depth) < count)
+        depth++;
+    return depth;
+}
+
+/* Hashes and sorts the records gathered into tree and builds its nodes,
+   stored heap style with the root at 1 and leaf i at (1 << depth) + i. */
+static void
+buildtree(Tree *tree, unsigned int depth)
+{
+    static const unsigned char zero[HASH_SIZE];
+    size_t leaves = (size_t)1 << depth, i, j;
+    EVP_MD_CTX *ctx;
+    unsigned char *h;
+
+    ctx = EVP_MD_CTX_new();
+    tree->depth = depth;
+    for (i = 0; i < tree->count; i++)
+    {
+        Record *r = tree->records + i;
+
+        r->bucket = depth ? keyhash(r->node->key) >> (32 - depth) : 0;
+        EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+        EVP_DigestUpdate(ctx, r->node->key, strlen(r->node->key) + 1);
+        EVP_DigestUpdate(ctx, r->node->value, strlen(r->node->value) + 1);
+        if (r->node->tags)
+            EVP_DigestUpdate(ctx, r->node->tags, strlen(r->node->tags));
+        EVP_DigestFinal_ex(ctx, r->hash, NULL);
+    }
+    qsort(tree->records, tree->count, sizeof(Record), cmprecord);
+
+    tree->start = ppmM_alloc((leaves + 1) * sizeof(size_t));
+    tree->hashes = ppmM_alloc(2 * leaves * HASH_SIZE);
+    for (i = j = 0; i < leaves; i++)
+    {
+        tree->start[i] = j;
+        h = tree->hashes + (leaves + i) * HASH_SIZE;
+        if (j == tree->count || tree->records[j].bucket != i)
+        {
+            memcpy(h, zero, HASH_SIZE);
+            continue;
+        }
+        EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+        for (; j < tree->count && tree->records[j].bucket == i; j++)
+            EVP_DigestUpdate(ctx, tree->records[j].hash, HASH_SIZE);
+        EVP_DigestFinal_ex(ctx, h, NULL);
+    }
+    tree->start[leaves] = j;
+
+    for (i = leaves - 1; i >= 1; i--)
+    {
+        h = tree->hashes + 2 * i * HASH_SIZE;
+        digest(ctx, h, h + HASH_SIZE, tree->hashes + i * HASH_SIZE);
+    }
+    EVP_MD_CTX_free(ctx);
+}
+
+static void
+freetree(Tree *tree)
+{
+    free(tree->records);
+    free(tree->start);
+    free(tree->hashes);
+}
+
+/* Both leaves are sorted by key, walk them side by side. */
+static unsigned long
+diffleaf(const Tree *a, const Tree *b, size_t leaf, DiffFunc *fn, void *arg)
+{
+    size_t i = a->start[leaf], iend = a->start[leaf + 1];
+    size_t j = b->start[leaf], jend = b->start[leaf + 1];
+    unsigned long n = 0;
+
+    while (i < iend || j < jend)
+    {
+        int c = (i == iend) ? 1 : (j == jend) ? -1 
+              : strcmp(a->records[i].node->key, b->records[j].node->key);
+
+        if (c < 0)
+        {
+            fn(a->records[i++].node, NULL, arg);
+            n++;
+        }
+        else
+        if (c > 0)
+        {
+            fn(NULL, b->records[j++].node, arg);
+            n++;
+        }
+        else
+        {
+            if (memcmp(a->records[i].hash, b->records[j].hash, HASH_SIZE) != 0)
+            {
+                fn(a->records[i].node, b->records[j].node, arg);
+                n++;
+            }
+            i++;
+            j++;
+        }
+    }
+    return n;
+}
+
+static unsigned long
+difftree(const Tree *a, const Tree *b, size_t i, unsigned long *visited, DiffFunc *fn, void *arg)
+{
+    size_t leaves = (size_t)1 << a->depth;
+
+    (*visited)++;
+    if (memcmp(a->hashes + i * HASH_SIZE, b->hashes + i * HASH_SIZE, HASH_SIZE) == 0)
+        return 0;
+    if (i >= leaves)
+        return diffleaf(a, b, i - leaves, fn, arg);
+    return difftree(a, b, 2 * i, visited, fn, arg) 
+         + difftree(a, b, 2 * i + 1, visited, fn, arg);
+}
+
+/* Builds trees of the same shape over the open vault and the one at
+   path, then calls fn for every entry that differs between them. */
+static unsigned int
+compare(ppm_Vault *vault, const char *path, const char *key, DiffFunc *fn, void *arg)
+{
+    Tree ours, theirs;
+    ppm_Table *other;
+    unsigned long n, visited = 0;
+    unsigned int depth;
+    size_t i;
+
+    other = ppmD_load(path, key);
+    if (!other) return 0;
+
+    memset(&ours, 0, sizeof(Tree));
+    memset(&theirs, 0, sizeof(Tree));
+    if (!ppmD_foreach(vault, addrecord, &ours))
+    {
+        free(ours.records);
+        ppmT_free(other);
+        return 0;
+    }
+    for (i = 0; i < other->size; i++)
+    {
+        ppm_Node *node;
+
+        for (node = other->nodes[i]; node; node = node->next)
+            addrecord(node, &theirs);
+    }
+
+    depth = treedepth(ours.count > theirs.count ? ours.count : theirs.count);
+    buildtree(&ours, depth);
+    buildtree(&theirs, depth);
+    n = difftree(&ours, &theirs, 1, &visited, fn, arg);
+
+    ppm_message("%lu differences, compared %lu of %lu tree nodes", 
+                n, visited, (2ul << depth) - 1);
+    freetree(&ours);
+    freetree(&theirs);
+    ppmT_free(other);
+    return 1;
+}
+
+static void
+printdiff(ppm_Node *ours, ppm_Node *theirs, void *arg)
+{
+    if (!theirs)
+        fprintf(PPM_OUT, "%s-%s %s\n", PPMC(RED), PPMC(NONE), ours->key);
+    else
+    if (!ours)
+        fprintf(PPM_OUT, "%s+%s %s\n", PPMC(GREEN), PPMC(NONE), theirs->key);
+    else
+        fprintf(PPM_OUT, "%s~%s %s\n", PPMC(CYAN), PPMC(NONE), ours->key);
+}
+
+unsigned int
+ppmH_diff(ppm_Vault *vault, const char *path, const char *key)
+{
+    return compare(vault, path, key, printdiff, NULL);
+}
+
+static unsigned int
+ask(const char *name)
+{
+    char answer[32];
+
+    for (;;)
+    {
+        printf("'%s%s%s' differs, keep (o)urs or take (t)heirs? ", 
+               PPMC(WHITE), name, PPMC(NONE));
+        fflush(stdout);
+        if (!fgets(answer, sizeof(answer), stdin))
+            return 0;
+        if (answer[0] == 'o' || answer[0] == 't')
+            return answer[0] == 't';
+    }
+}
+
+static void
+mergeentry(ppm_Node *ours, ppm_Node *theirs, void *arg)
+{
+    Merge *m = arg;
+    unsigned int take;
+
+    /* There is no record of deletions, an entry only we hold stays. */
+    if (!theirs || m->failed)
+        return;
+    if (!ours)
+    {
+        if (!ppmD_copy(m->vault, theirs))
+            m->failed = 1;
+        else
+            m->added++;
+        return;
+    }
+
+    switch (m->policy)
+    {
+    case PPM_MOURS:   take = 0; break;
+    case PPM_MTHEIRS: take = 1; break;
+    case PPM_MASK:    take = ask(ours->key); break;
+    default:          take = theirs->modified > ours->modified; break;
+    }
+    if (take)
+    {
+        if (!ppmD_copy(m->vault, theirs))
+            m->failed = 1;
+        else
+            m->updated++;
+    }
+    else
+        m->kept++;
+}
+
+unsigned int
+ppmH_merge(ppm_Vault *vault, const char *path, const char *key, int policy)
+{
+    Merge m;
+
+    memset(&m, 0, sizeof(Merge));
+    m.vault = vault;
+    m.policy = policy;
+    if (!compare(vault, path, key, mergeentry, &m))
+        return 0;
+
+    ppm_message("%lu added, %lu updated, %lu kept from %s", m.added, m.updated, m.kept, path);
+    return !m.failed;
+}
@@ -0,0 +1,142 @@
+/*
+ * ppm_pool.c
+ *
+ * Copyright (C) 2014 Niels Vanden Eynde
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ppm_pool.h"
+
+#define POOL_MAX 64
+
+/* Workers are started on first use and kept around, they sleep until
+   ppmP_run hands them a batch. Batches run one at a time, the calling
+   thread works on its own batch as well. A task must not call ppmP_run
+   itself. */
+static pthread_t workers[POOL_MAX];
+static unsigned int nworkers = 0;
+static pthread_mutex_t runlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+
+static ppm_Task *task;
+static void *taskarg;
+static unsigned int count = 0;
+static unsigned int next = 0;
+static unsigned int finished = 0;
+static unsigned int quit = 0;
+
+/* Called with lock held, runs tasks until the batch has none left. */
+static void
+drain(void)
+{
+    while (next < count)
+    {
+        unsigned int i = next++;
+
+        pthread_mutex_unlock(&lock);
+        task(taskarg, i);
+        pthread_mutex_lock(&lock);
+        if (++finished == count)
+            pthread_cond_broadcast(&done);
+    }
+}
+
+static void *
+worker(void *arg)
+{
+    pthread_mutex_lock(&lock);
+    while (!quit)
+    {
+        if (next < count)
+            drain();
+        else
+            pthread_cond_wait(&work, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+unsigned int
+ppmP_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1) return 1;
+    return n > POOL_MAX ? POOL_MAX : (unsigned int)n;
+}
+
+void
+ppmP_run(ppm_Task *t, void *arg, unsigned int n)
+{
+    unsigned int want;
+
+    if (n == 0) return;
+    if (n == 1)
+    {
+        t(arg, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&runlock);
+    pthread_mutex_lock(&lock);
+    want = (n < ppmP_threads() ? n : ppmP_threads()) - 1;
+    while (nworkers < want)
+    {
+        if (pthread_create(workers + nworkers, NULL, worker, NULL) != 0)
+            break;
+        nworkers++;
+    }
+
+    task = t;
+    taskarg = arg;
+    count = n;
+    next = 0;
+    finished = 0;
+    pthread_cond_broadcast(&work);
+
+    drain();
+    while (finished < count)
+        pthread_cond_wait(&done, &lock);
+    pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&runlock);
+}
+
+void
+ppmP_cleanup(void)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&lock);
+    quit = 1;
+    pthread_cond_broadcast(&work);
+    pthread_mutex_unlock(&lock);
+
+    for (i = 0; i < nworkers; i++)
+        pthread_join(workers[i], NULL);
+    nworkers = 0;
+    quit = 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * ppm_profile.c
+ *
+ * Copyright (C) 2014 Niels Vanden Eynde
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ppm_profile.h"
+
+typedef struct
+{
+    const char *name;
+    unsigned long calls;
+    unsigned long ns;
+}
+Phase;
+
+/* Phases run on several threads at once when shards are loaded or
+   written, their time is summed over threads and may exceed the wall
+   clock time. */
+static Phase phases[PPM_PHASES] = {
+    { "key", 0, 0 },
+    { "lock", 0, 0 },
+    { "read", 0, 0 },
+    { "decrypt", 0, 0 },
+    { "parse", 0, 0 },
+    { "index", 0, 0 },
+    { "command", 0, 0 },
+    { "serialize", 0, 0 },
+    { "encrypt", 0, 0 },
+    { "write", 0, 0 }
+};
+
+static unsigned int profiling;
+static unsigned int asjson;
+static struct timespec begin;
+
+static unsigned long
+since(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long)(now.tv_sec - start->tv_sec) * 1000000000UL 
+         + now.tv_nsec - start->tv_nsec;
+}
+
+static void
+report(void)
+{
+    unsigned long total = since(&begin), ns = 0;
+    unsigned int i;
+
+    if (asjson)
+    {
+        fprintf(stderr, "{\"total_ms\":%.3f,\"phases\":{", total / 1e6);
+        for (i = 0; i < PPM_PHASES; i++)
+        {
+            fprintf(stderr, "%s\"%s\":{\"calls\":%lu,\"ms\":%.3f}", i ? "," : "", 
+                    phases[i].name, phases[i].calls, phases[i].ns / 1e6);
+        }
+        fprintf(stderr, "}}\n");
+        return;
+    }
+
+    fprintf(stderr, "%-10s %8s %12s %7s\n", "phase", "calls", "ms", "%");
+    for (i = 0; i < PPM_PHASES; i++)
+    {
+        if (!phases[i].calls) continue;
+        fprintf(stderr, "%-10s %8lu %12.3f %6.1f%%\n", phases[i].name, phases[i].calls, 
+                phases[i].ns / 1e6, total ? 100.0 * phases[i].ns / total : 0.0);
+        ns += phases[i].ns;
+    }
+
+    /* Whatever wasn't in a phase: starting up, waiting for input. */
+    fprintf(stderr, "%-10s %8s %12.3f %6.1f%%\n", "other", "", 
+            ns < total ? (total - ns) / 1e6 : 0.0, 
+            ns < total && total ? 100.0 * (total - ns) / total : 0.0);
+    fprintf(stderr, "%-10s %8s %12.3f\n", "total", "", total / 1e6);
+}
+
+void
+ppmF_profile(unsigned int json)
+{
+    if (profiling) return;
+    asjson = json;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    profiling = 1;
+    atexit(report);
+}
+
+void
+ppmF_start(struct timespec *start)
+{
+    if (profiling)
+        clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+void
+ppmF_stop(ppm_Phase phase, const struct timespec *start)
+{
+    if (!profiling) return;
+    __atomic_add_fetch(&phases[phase].ns, since(start), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&phases[phase].calls, 1, __ATOMIC_RELAXED);
+}
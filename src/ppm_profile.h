@@ -0,0 +1,58 @@
+/*
+ * ppm_profile.h
+ *
+ * Copyright (C) 2014 Niels Vanden Eynde
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef PPM_PROFILE_H
+#define PPM_PROFILE_H
+
+#include <time.h>
+
+/* The phases a command's time is broken down into. */
+typedef enum
+{
+    PPM_PHASE_KEY,
+    PPM_PHASE_LOCK,
+    PPM_PHASE_READ,
+    PPM_PHASE_DECRYPT,
+    PPM_PHASE_PARSE,
+    PPM_PHASE_INDEX,
+    PPM_PHASE_COMMAND,
+    PPM_PHASE_SERIALIZE,
+    PPM_PHASE_ENCRYPT,
+    PPM_PHASE_WRITE,
+    PPM_PHASES
+}
+ppm_Phase;
+
+/* Once ppmF_profile was called the time spent between ppmF_start and
+   ppmF_stop is added to the phase, from any thread, and the totals are
+   written to stderr on exit. Until then both return straight away.
+   Phases within a command, such as merge reading the other vault, are
+   counted in both. */
+extern void ppmF_profile(unsigned int /* json */);
+extern void ppmF_start(struct timespec * /* start */);
+extern void ppmF_stop(ppm_Phase /* phase */, const struct timespec * /* start */);
+
+#endif /* PPM_PROFILE_H */
@@ -0,0 +1,228 @@
+/*
+ * ppm_readbench.c
+ *
+ * Copyright (C) 2014 Niels Vanden Eynde
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ppm_db.h"
+#include "ppm_mem.h"
+#include "ppm_pool.h"
+
+/* Measures lookups in a vault shared by several threads, lock-free as
+   ppmD_concurrent makes them, behind a mutex for comparison, and
+   lock-free again while another thread keeps updating entries. */
+
+enum
+{
+    MODE_LOCKFREE,
+    MODE_LOCKED,
+    MODE_WRITER,
+    MODES
+};
+
+static const char *modes[] = { "lock-free", "mutex", "lock-free+writer" };
+
+typedef struct
+{
+    ppm_Vault *vault;
+    char **keys;
+    unsigned long nkeys;
+    unsigned long lookups;
+    int mode;
+    pthread_mutex_t lock;
+    volatile int stop;
+    unsigned long misses;
+}
+Bench;
+
+typedef struct
+{
+    Bench *bench;
+    unsigned long seed;
+    unsigned long misses;
+}
+Worker;
+
+static unsigned long
+rnd(unsigned long *state)
+{
+    /* xorshift, plenty for picking keys. */
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void *
+reader(void *arg)
+{
+    Worker *w = arg;
+    Bench *b = w->bench;
+    unsigned long i, state = w->seed;
+    const char *value;
+    unsigned int found;
+
+    /* The value is only valid inside the read, it is looked at there. */
+    for (i = 0; i < b->lookups; i++)
+    {
+        const char *key = b->keys[rnd(&state) % b->nkeys];
+
+        if (b->mode == MODE_LOCKED)
+        {
+            pthread_mutex_lock(&b->lock);
+            value = ppmD_get(b->vault, key);
+            found = value && *value;
+            pthread_mutex_unlock(&b->lock);
+        }
+        else
+        {
+            ppmD_readbegin(b->vault);
+            value = ppmD_get(b->vault, key);
+            found = value && *value;
+            ppmD_readend(b->vault);
+        }
+        if (!found) w->misses++;
+    }
+    return NULL;
+}
+
+static void *
+writer(void *arg)
+{
+    Bench *b = arg;
+    unsigned long state = 88172645463325252ul, n = 0;
+    char value[32];
+
+    while (!b->stop)
+    {
+        sprintf(value, "v%lu", n++);
+        ppmD_put(b->vault, b->keys[rnd(&state) % b->nkeys], value);
+    }
+    return NULL;
+}
+
+static double
+run(Bench *b, unsigned int nthreads)
+{
+    pthread_t *threads, wthread;
+    Worker *workers;
+    struct timespec start, end;
+    unsigned int i;
+
+    threads = ppmM_alloc(nthreads * sizeof(pthread_t));
+    workers = ppmM_alloc(nthreads * sizeof(Worker));
+    b->stop = 0;
+    if (b->mode == MODE_WRITER)
+        pthread_create(&wthread, NULL, writer, b);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < nthreads; i++)
+    {
+        workers[i].bench = b;
+        workers[i].seed = 2463534242ul + i * 7919;
+        workers[i].misses = 0;
+        pthread_create(threads + i, NULL, reader, workers + i);
+    }
+    for (i = 0; i < nthreads; i++)
+    {
+        pthread_join(threads[i], NULL);
+        b->misses += workers[i].misses;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (b->mode == MODE_WRITER)
+    {
+        b->stop = 1;
+        pthread_join(wthread, NULL);
+    }
+    free(threads);
+    free(workers);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+    Bench b;
+    char path[64];
+    double base[MODES];
+    unsigned int maxthreads, n;
+    unsigned long i;
+    int mode;
+
+    memset(&b, 0, sizeof(b));
+    b.nkeys = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    b.lookups = argc > 2 ? strtoul(argv[2], NULL, 10) : 2000000;
+    maxthreads = argc > 3 ? (unsigned int)strtoul(argv[3], NULL, 10) : ppmP_threads();
+    if (b.nkeys == 0 || b.lookups == 0 || maxthreads == 0)
+    {
+        fprintf(stderr, "usage: %s [entries] [lookups per thread] [max threads]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* The vault is never saved, nothing ends up on disk. */
+    sprintf(path, "/tmp/ppm-readbench-%ld", (long)getpid());
+    b.vault = ppmD_open(path, "readbench", 0);
+    if (!b.vault) return EXIT_FAILURE;
+    b.keys = ppmM_alloc(b.nkeys * sizeof(char *));
+    for (i = 0; i < b.nkeys; i++)
+    {
+        char key[32];
+
+        sprintf(key, "user%lu", i);
+        b.keys[i] = ppmM_strdup(key);
+        ppmD_put(b.vault, key, "password");
+    }
+    ppmD_concurrent(b.vault);
+    pthread_mutex_init(&b.lock, NULL);
+
+    printf("# %lu entries, %lu lookups per thread\n", b.nkeys, b.lookups);
+    printf("%-18s %8s %14s %8s\n", "mode", "threads", "lookups/s", "scaling");
+    for (mode = 0; mode < MODES; mode++)
+    {
+        b.mode = mode;
+        for (n = 1; n <= maxthreads; n = (n * 2 > maxthreads && n < maxthreads) ? maxthreads : n * 2)
+        {
+            double rate = b.lookups * (double)n / run(&b, n);
+
+            if (n == 1) base[mode] = rate;
+            printf("%-18s %8u %14.0f %7.2fx\n", modes[mode], n, rate, rate / base[mode]);
+        }
+    }
+    if (b.misses)
+        printf("# %lu lookups missed an existing entry\n", b.misses);
+
+    ppmD_close(b.vault);
+    for (i = 0; i < b.nkeys; i++)
+        free(b.keys[i]);
+    free(b.keys);
+    ppmP_cleanup();
+    return b.misses ? EXIT_FAILURE : EXIT_SUCCESS;
+}
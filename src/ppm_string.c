@@ -31,6 +31,20 @@
 
 #define STRING_GROW 32
 
+/* Grow by at least STRING_GROW and otherwise double, appending to a
+   long string (a whole serialized vault) stays linear. */
+static void
+grow(ppm_String *string, size_t len)
+{
+    size_t size = string->size;
+
+    while (size < len + 1)
+        size += (size < STRING_GROW) ? STRING_GROW : size;
+    if (size == string->size) return;
+    string->cstr = ppmM_realloc(string->cstr, size);
+    string->size = size;
+}
+
 void
 ppmS_init(ppm_String *string, const char *str)
 {
@@ -63,16 +77,18 @@ ppmS_new(const char *str)
 void
 ppmS_addch(ppm_String *string, char c)
 {
-    if (string->len + 1 == string->size)
-    {
-        string->size += STRING_GROW;
-        string->cstr = ppmM_realloc(string->cstr, string->size);
-    }
-
+    grow(string, string->len + 1);
     string->cstr[string->len++] = c;
     string->cstr[string->len] = '\0';
 }
 
+void
+ppmS_clear(ppm_String *string)
+{
+    string->len = 0;
+    string->cstr[0] = '\0';
+}
+
 void
 ppmS_set(ppm_String *string, const char *str)
 {
@@ -83,15 +99,11 @@ ppmS_set(ppm_String *string, const char *str)
 void
 ppmS_append(ppm_String *string, const char *str)
 {
-    while (*str)
-    {
-        if (string->len + 1 == string->size)
-        {
-            string->size += STRING_GROW;
-            string->cstr = ppmM_realloc(string->cstr, string->size);
-        }
-        string->cstr[string->len++] = *str++;
-    }
+    size_t len = strlen(str);
+
+    grow(string, string->len + len);
+    memcpy(string->cstr + string->len, str, len);
+    string->len += len;
     string->cstr[string->len] = '\0';
 }
 
@@ -40,6 +40,7 @@ ppm_String;
 extern void ppmS_init(ppm_String * /* string */, const char * /* str */);
 extern ppm_String *ppmS_new(const char * /* str */);
 extern void ppmS_addch(ppm_String * /* string */, char /* c */);
+extern void ppmS_clear(ppm_String * /* string */);
 extern void ppmS_set(ppm_String * /* string */, const char * /* str */);
 extern void ppmS_append(ppm_String * /* string */, const char * /* str */);
 
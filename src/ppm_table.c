@@ -29,8 +29,42 @@
 #include "ppm_table.h"
 #include "ppm.h"
 #include "ppm_mem.h"
+#include "ppm_epoch.h"
 
 #define TABLE_GROW 32
+#define VALUES_GROW 32
+
+/* The bucket array as readers see it, size and array are published
+   together so a reader never pairs one with the other's counterpart. */
+struct ppm_buckets
+{
+    size_t size;
+    ppm_Node **nodes;
+};
+
+/* An interned value, node->value points at its data. */
+typedef struct ppm_value
+{
+    struct ppm_value *next;
+    unsigned int hash;
+    size_t refs;
+    size_t len;
+    char data[1];
+}
+Value;
+
+/* The distinct values of a table, found by content. Only the writer
+   looks values up, readers merely follow node->value into one. */
+struct ppm_values
+{
+    Value **values;
+    size_t size;
+    size_t count;
+    size_t bytes;
+    size_t saved;
+};
+
+#define VALUE(data) ((Value *)((data) - offsetof(Value, data)))
 
 static unsigned int
 hash(const char *string)
@@ -43,27 +77,132 @@ hash(const char *string)
     return hashval;
 }
 
+static void
+growvalues(struct ppm_values *values)
+{
+    Value **old = values->values, *v, *next;
+    size_t oldsize = values->size, i;
+
+    values->size = values->size ? values->size * 2 : VALUES_GROW;
+    values->values = ppmM_alloc(values->size * sizeof(Value *));
+    memset(values->values, 0, values->size * sizeof(Value *));
+    for (i = 0; i < oldsize; i++)
+    {
+        for (v = old[i]; v; v = next)
+        {
+            next = v->next;
+            v->next = values->values[v->hash % values->size];
+            values->values[v->hash % values->size] = v;
+        }
+    }
+    free(old);
+}
+
+/* Returns the table's copy of value, made on first use. */
+static char *
+intern(struct ppm_values *values, const char *value)
+{
+    unsigned int h = hash(value);
+    size_t len = strlen(value);
+    Value *v;
+
+    if (values->size)
+    {
+        for (v = values->values[h % values->size]; v; v = v->next)
+        {
+            if (v->hash == h && v->len == len && memcmp(v->data, value, len) == 0)
+            {
+                v->refs++;
+                values->saved += len + 1;
+                return v->data;
+            }
+        }
+    }
+    if (values->count >= values->size)
+        growvalues(values);
+
+    v = ppmM_alloc(offsetof(Value, data) + len + 1);
+    memcpy(v->data, value, len + 1);
+    v->hash = h;
+    v->len = len;
+    v->refs = 1;
+    v->next = values->values[h % values->size];
+    values->values[h % values->size] = v;
+    values->count++;
+    values->bytes += len + 1;
+    return v->data;
+}
+
+/* Drops a node's reference, the last one retires the value. */
+static void
+release(ppm_Table *table, char *data)
+{
+    struct ppm_values *values = table->values;
+    Value *v = VALUE(data), **slot;
+
+    if (--v->refs > 0)
+    {
+        values->saved -= v->len + 1;
+        return;
+    }
+    for (slot = values->values + v->hash % values->size; *slot != v; slot = &(*slot)->next);
+    *slot = v->next;
+    values->count--;
+    values->bytes -= v->len + 1;
+    ppmR_retire(table->epoch, v, free);
+}
+
 static ppm_Node *
-newnode(const char *key, const char *value)
+newnode(ppm_Table *table, const char *key, const char *value)
 {
     ppm_Node *node;
 
     node = NEW(ppm_Node);
     node->key  = ppmM_strdup(key);
-    node->value = ppmM_strdup(value);
+    node->value = intern(table->values, value);
+    node->tags = NULL;
+    node->created = 0;
+    node->modified = 0;
+    node->heappos = 0;
     node->next = NULL;
     return node;
 }
 
+static struct ppm_buckets *
+newbuckets(ppm_Node **nodes, size_t size)
+{
+    struct ppm_buckets *live;
+
+    live = NEW(struct ppm_buckets);
+    live->nodes = nodes;
+    live->size = size;
+    return live;
+}
+
+static void
+freebuckets(void *arg)
+{
+    struct ppm_buckets *live = arg;
+
+    free(live->nodes);
+    free(live);
+}
+
 ppm_Table *
 ppmT_new(size_t size)
 {
     ppm_Table *table;
     
     table = NEW(ppm_Table);
-    table->nodes = calloc(size, sizeof(ppm_Node *));
+    table->nodes = ppmM_alloc(size * sizeof(ppm_Node *));
+    memset(table->nodes, 0, size * sizeof(ppm_Node *));
     table->size = size;
     table->count = 0;
+    table->live = newbuckets(table->nodes, size);
+    table->epoch = NULL;
+    table->values = NEW(struct ppm_values);
+    memset(table->values, 0, sizeof(struct ppm_values));
+    table->resizes = 0;
 
     return table;
 }
@@ -71,62 +210,86 @@ ppmT_new(size_t size)
 ppm_Table *
 ppmT_resize(ppm_Table *table, size_t size)
 {
-    ppm_Table *ntable;
+    ppm_Node **nodes;
     unsigned int i;
 
-    ntable = ppmT_new(size);
-    ntable->count = table->count;
+    /* Rehash every chain into a new bucket array, the table itself
+       stays where it is so callers holding a pointer to it are
+       unaffected. Nodes move rather than being copied, a reader still
+       walking the old array can follow one into its new chain and miss
+       a key, resizes tells it to look again. */
+    nodes = ppmM_alloc(size * sizeof(ppm_Node *));
+    memset(nodes, 0, size * sizeof(ppm_Node *));
 
+    __atomic_store_n(&table->resizes, table->resizes + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
     for (i = 0; i < table->size; i++) 
     {
         ppm_Node *node = table->nodes[i];
-        unsigned int hashkey;
-            
-        if (!node) continue;
-        hashkey = hash(node->key) % size;
-        ntable->nodes[hashkey] = node;
+
+        while (node)
+        {
+            ppm_Node *next = node->next;
+            unsigned int hashkey = hash(node->key) % size;
+
+            PPM_STORE(node->next, nodes[hashkey]);
+            nodes[hashkey] = node;
+            node = next;
+        }
     }
-    free(table->nodes);
-    free(table);
-    return ntable;
+    ppmR_retire(table->epoch, table->live, freebuckets);
+    table->nodes = nodes;
+    table->size = size;
+    PPM_STORE(table->live, newbuckets(nodes, size));
+    __atomic_store_n(&table->resizes, table->resizes + 1, __ATOMIC_RELEASE);
+    return table;
 }
 
-void
+ppm_Node *
 ppmT_insert(ppm_Table *table, const char *key, const char *value)
 {
     unsigned int hashkey;
     ppm_Node *node;
         
-    if (table->count == table->size)
-        table = ppmT_resize(table, TABLE_GROW);
-
     hashkey = hash(key) % table->size;
     node = table->nodes[hashkey];
 
-    while (node && node->next)
+    while (node)
     {
         if (strcmp(node->key, key) == 0) 
         {
-            free(node->value);
-            node->value = ppmM_strdup(value);
-            return;
+            char *old = node->value;
+
+            PPM_STORE(node->value, intern(table->values, value));
+            release(table, old);
+            return node;
         }
         node = node->next;
     }
     
-    node = newnode(key, value);
+    if (table->count >= table->size)
+    {
+        ppmT_resize(table, table->size + (table->size < TABLE_GROW ? TABLE_GROW : table->size));
+        hashkey = hash(key) % table->size;
+    }
+
+    node = newnode(table, key, value);
     node->next = table->nodes[hashkey];
 
     table->count++;
-    table->nodes[hashkey] = node;
-    return;
+    PPM_STORE(table->nodes[hashkey], node);
+    return node;
 }
 
+/* The value isn't the node's, it was released when the node was
+   unlinked. */
 static void
-freenode(ppm_Node *node)
+freenode(void *arg)
 {
+    ppm_Node *node = arg;
+
     free(node->key);
-    free(node->value);
+    free(node->tags);
     free(node);
 }
 
@@ -150,12 +313,14 @@ ppmT_remove(ppm_Table *table, const char *key)
         }
 
         if (prev)
-            prev->next = node->next;
+            PPM_STORE(prev->next, node->next);
         else
-            table->nodes[hashkey] = node->next;
+            PPM_STORE(table->nodes[hashkey], node->next);
         
         value = node->value;
-        freenode(node);
+        release(table, value);
+        ppmR_retire(table->epoch, node, freenode);
+        table->count--;
         break;
     }
     return value;
@@ -166,6 +331,7 @@ ppmT_free(ppm_Table *table)
 {
     unsigned int i;
     ppm_Node *node, *prev;
+    Value *v, *next;
     
     if (!table) return;
     for (i = 0; i < table->size; i++)
@@ -178,28 +344,46 @@ ppmT_free(ppm_Table *table)
             freenode(prev);
         }
     }
+    for (i = 0; i < table->values->size; i++)
+    {
+        for (v = table->values->values[i]; v; v = next)
+        {
+            next = v->next;
+            free(v);
+        }
+    }
     
-    free(table->nodes);
+    free(table->values->values);
+    free(table->values);
+    freebuckets(table->live);
     free(table);
 }
 
 ppm_Node *
 ppmT_getnode(ppm_Table *table, const char *key)
 {
-    unsigned int hashkey;
+    struct ppm_buckets *live;
+    unsigned long resizes;
+    unsigned int h;
     ppm_Node *node;
 
     if (!table) return NULL;
-    hashkey = hash(key) % table->size;
-    node = table->nodes[hashkey];
+    h = hash(key);
 
-    while (node)
+    /* A hit is always right, a miss only when no resize moved nodes
+       around while the chain was walked. */
+    do
     {
-        if (strcmp(node->key, key) == 0)
-            return node;
-        else
-            node = node->next;
+        resizes = PPM_LOAD(table->resizes);
+        live = PPM_LOAD(table->live);
+        for (node = PPM_LOAD(live->nodes[h % live->size]); node; node = PPM_LOAD(node->next))
+        {
+            if (strcmp(node->key, key) == 0)
+                return node;
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
     }
+    while ((resizes & 1) || __atomic_load_n(&table->resizes, __ATOMIC_RELAXED) != resizes);
     return NULL;
 }
 
@@ -209,5 +393,41 @@ ppmT_get(ppm_Table *table, const char *key)
     ppm_Node *node;
 
     node = ppmT_getnode(table, key);
-    return (node) ? node->value : NULL;
+    return (node) ? PPM_LOAD(node->value) : NULL;
+}
+
+void
+ppmT_stats(ppm_Table *table, ppm_TableStats *stats)
+{
+    struct ppm_values *values = table->values;
+    ppm_Node *node;
+    size_t i, len;
+
+    stats->entries += table->count;
+    stats->values += values->count;
+    stats->valuebytes += values->bytes;
+    stats->saved += values->saved;
+
+    /* Finding the n-th node of a chain takes n comparisons, missing
+       takes the whole chain. */
+    stats->buckets += table->size;
+    for (i = 0; i < table->size; i++)
+    {
+        len = 0;
+        for (node = table->nodes[i]; node; node = node->next)
+        {
+            len++;
+            stats->hits += len;
+            stats->bytes += sizeof(ppm_Node) + strlen(node->key) + 1;
+            if (node->tags)
+                stats->bytes += strlen(node->tags) + 1;
+        }
+        stats->chains[len < PPM_CHAINS ? len : PPM_CHAINS - 1]++;
+        stats->misses += len;
+        if (len > stats->longest)
+            stats->longest = len;
+    }
+    stats->bytes += table->size * sizeof(ppm_Node *) + sizeof(ppm_Table)
+                  + values->size * sizeof(Value *) + values->bytes
+                  + values->count * offsetof(Value, data);
 }
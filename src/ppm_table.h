@@ -27,28 +27,86 @@
 #ifndef PPM_HASH_TABLE_H
 #define PPM_HASH_TABLE_H
 
+#include <stddef.h>
+#include <time.h>
+
 typedef struct ppm_node
 {
     char *key;
     char *value;
+
+    /* Comma separated, NULL when the entry has no tags. */
+    char *tags;
+    time_t created;
+    time_t modified;
+
+    /* Position in the index of modification times, kept by ppm_index. */
+    size_t heappos;
     struct ppm_node *next;
 } 
 ppm_Node;
 
+struct ppm_buckets;
+struct ppm_epoch;
+struct ppm_values;
+
+/* Lookups may run concurrently with one writer at a time once epoch is
+   set: readers inside the epoch find chains through live and never
+   block, writers retire what they replace instead of freeing it. Only
+   a node's key and value are safe to read that way. Values are interned
+   in the table's values, nodes with the same value share one reference
+   counted copy. */
 typedef struct ppm_table
 {
     size_t size;
     size_t count;
     ppm_Node **nodes;
+    struct ppm_buckets *live;
+    struct ppm_epoch *epoch;
+    struct ppm_values *values;
+
+    /* Odd while a resize is relinking chains. */
+    unsigned long resizes;
 }
 ppm_Table;
 
+/* Chain lengths counted apart by ppmT_stats, longer chains are counted
+   with the last. */
+#define PPM_CHAINS 8
+
+/* Filled in by ppmT_stats, which adds to what's there so the stats of
+   several tables can be summed. */
+typedef struct
+{
+    size_t entries;
+
+    /* Distinct values, the bytes they take and the bytes separate
+       copies for every entry would have taken on top. */
+    size_t values;
+    size_t valuebytes;
+    size_t saved;
+
+    /* Buckets and the number of them holding a chain of each length,
+       the longest chain, the key comparisons looking up every entry
+       once takes and those a miss in every bucket takes. */
+    size_t buckets;
+    size_t chains[PPM_CHAINS];
+    size_t longest;
+    size_t hits;
+    size_t misses;
+
+    /* Bytes allocated for buckets, nodes, keys, tags and values. */
+    size_t bytes;
+}
+ppm_TableStats;
+
 extern ppm_Table *ppmT_new(size_t /* size */);
 extern void ppmT_free(ppm_Table * /* table */);
-extern void ppmT_insert(ppm_Table * /* table */, const char * /* key */, const char * /* value */);
+extern ppm_Node *ppmT_insert(ppm_Table * /* table */, const char * /* key */, const char * /* value */);
 extern char *ppmT_get(ppm_Table * /* table */, const char * /* key */);
 extern ppm_Node *ppmT_getnode(ppm_Table * /* table */, const char * /* key */);
 extern ppm_Table *ppmT_resize(ppm_Table * /* table */, size_t /* size */);
 extern char *ppmT_remove(ppm_Table * /* table */, const char * /* key */);
+extern void ppmT_stats(ppm_Table * /* table */, ppm_TableStats * /* stats */);
 
 #endif /* PPM_HASH_TABLE_H */